@@ -0,0 +1,95 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "user_index.hpp"
+
+// Converts a text user file (username:password per line, as the server reads
+// users.txt) into the compiled index the server maps with --users. The index
+// is written to a temporary file and renamed over the output, so a running
+// server watching the output path reloads the finished file and never sees a
+// partial one.
+//
+// Usage: ./build_user_index [--iterations N] [--threads N] users.txt users.idx
+
+bool write_file(const std::string& path, const std::vector<char>& image) {
+    std::string temporary = path + ".tmp." + std::to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    size_t offset = 0;
+    while (offset < image.size()) {
+        ssize_t written = write(fd, image.data() + offset, image.size() - offset);
+        if (written <= 0) {
+            close(fd);
+            unlink(temporary.c_str());
+            return false;
+        }
+        offset += written;
+    }
+    bool ok = fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t iterations = user_index::DEFAULT_ITERATIONS;
+    unsigned threads = 0;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc) {
+            iterations = static_cast<uint32_t>(std::max(1L, std::atol(argv[++i])));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = static_cast<unsigned>(std::max(1L, std::atol(argv[++i])));
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2) {
+        std::cerr << "Usage: " << argv[0] << " [--iterations N] [--threads N] users.txt users.idx" << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream input(paths[0]);
+    if (!input.is_open()) {
+        std::cerr << "Failed to open user file: " << paths[0] << std::endl;
+        return 1;
+    }
+    // Same rules as the server's text loader: split at the first ':', skip lines without one
+    std::vector<std::pair<std::string, std::string>> users;
+    std::string line;
+    while (std::getline(input, line)) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon + 1 == line.size()) continue;
+        users.emplace_back(line.substr(0, colon), line.substr(colon + 1));
+    }
+
+    std::vector<char> image;
+    std::string error;
+    if (!user_index::build(std::move(users), iterations, image, error, threads)) {
+        std::cerr << "Failed to build index: " << error << std::endl;
+        return 1;
+    }
+    if (!write_file(paths[1], image)) {
+        std::cerr << "Failed to write " << paths[1] << std::endl;
+        return 1;
+    }
+    const user_index::Header& header = *reinterpret_cast<const user_index::Header*>(image.data());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote " << header.count << " users to " << paths[1] << " (" << image.size() << " bytes, "
+              << header.iterations << " PBKDF2 iterations) in " << seconds << " s" << std::endl;
+    return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <mutex>
 #include <unordered_map>
@@ -19,6 +20,7 @@ std::mutex cout_mutex;
 
 void handle_server_messages(int server_socket) {
     char buffer[BUFFER_SIZE];
+    std::string pending;  // Received text not printed yet: the start of a line that may be a ping
     while (true) {
         memset(buffer, 0, BUFFER_SIZE);
         int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
@@ -28,8 +30,29 @@ void handle_server_messages(int server_socket) {
             close(server_socket);
             exit(0);
         }
+        // Answer the server's keepalive ping and keep it out of the chat output.
+        // Only a whole "/ping" line is a ping; one split over two reads waits
+        // in pending for the rest of its line.
+        pending.append(buffer, bytes_received);
+        std::string text;
+        size_t start = 0, newline;
+        while ((newline = pending.find('\n', start)) != std::string::npos) {
+            if (pending.compare(start, newline - start, "/ping") == 0) {
+                send(server_socket, "/pong", 5, 0);
+            } else {
+                text.append(pending, start, newline + 1 - start);
+            }
+            start = newline + 1;
+        }
+        pending.erase(0, start);
+        if (!std::string_view("/ping").starts_with(pending)) {
+            // Not a ping, e.g. a prompt without a newline: shown right away
+            text += pending;
+            pending.clear();
+        }
+        if (text.empty()) continue;
         std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
+        std::cout << text << std::endl;
     }
 }
 
@@ -0,0 +1,214 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+// Cluster check on loopback: logs the users of the user file in round-robin
+// over the nodes listening on --ports, puts them all in one group, and has
+// each send --messages group messages and as many private messages to the
+// next user, who is on another node. Every delivery is counted: each group
+// message must reach every other member exactly once and each private
+// message its recipient exactly once, wherever they are connected; the exit
+// status is 1 otherwise. With --admin-ports the nodes' link counters are read
+// before and after, showing the frames and writes that crossed between nodes.
+//
+// Start the nodes first, e.g. for three:
+//   ./server_grp --port 12345 --cluster 127.0.0.1:13345,127.0.0.1:13346,127.0.0.1:13347 --node-id 0
+//   (and --port 12346 --node-id 1, --port 12347 --node-id 2)
+//
+// Usage: ./cluster_test [--ports P,P,...] [--admin-ports P,P,...] [--users FILE] [--messages N]
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<int> ports = {12345, 12346, 12347};
+std::vector<int> admin_ports;
+std::string users_file = "users.txt";
+int message_count = 20;
+
+struct Client {
+    std::string username;
+    int fd = -1;
+    std::string received;  // Not yet split into lines
+    std::map<std::string, int> tags;  // Message tag to times received
+};
+
+std::vector<int> parse_ports(const std::string& list) {
+    std::vector<int> parsed;
+    std::stringstream stream(list);
+    std::string port;
+    while (std::getline(stream, port, ',')) parsed.push_back(std::atoi(port.c_str()));
+    return parsed;
+}
+
+int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        std::cerr << "Cannot connect to port " << port << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    return fd;
+}
+
+void send_line(Client& client, const std::string& line) {
+    std::string framed = line + "\n";
+    if (send(client.fd, framed.data(), framed.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(framed.size())) {
+        std::cerr << "Send to " << client.username << " failed" << std::endl;
+        exit(1);
+    }
+}
+
+// Reads whatever arrives within timeout_ms; records the tag of every chat line
+void pump(std::vector<Client>& clients, int timeout_ms) {
+    std::vector<pollfd> fds;
+    for (const Client& client : clients) fds.push_back({client.fd, POLLIN, 0});
+    Clock::time_point end = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (Clock::now() < end) {
+        int left = std::max<int>(1, std::chrono::duration_cast<std::chrono::milliseconds>(end - Clock::now()).count());
+        if (poll(fds.data(), fds.size(), left) <= 0) continue;
+        char buffer[65536];
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP))) continue;
+            ssize_t got = recv(clients[i].fd, buffer, sizeof(buffer), 0);
+            if (got <= 0) {
+                std::cerr << clients[i].username << " was disconnected" << std::endl;
+                exit(1);
+            }
+            Client& client = clients[i];
+            client.received.append(buffer, got);
+            size_t newline;
+            while ((newline = client.received.find('\n')) != std::string::npos) {
+                std::string line = client.received.substr(0, newline);
+                client.received.erase(0, newline + 1);
+                if (line == "/ping") send_line(client, "/pong");
+                size_t text = line.find("]: ");
+                if (text != std::string::npos && line.compare(text + 3, 4, "ct1-") == 0) {
+                    client.tags[line.substr(text + 3)]++;
+                }
+            }
+        }
+    }
+}
+
+// Sum of a counter over every node's /metrics
+uint64_t scrape(const std::string& name) {
+    uint64_t total = 0;
+    for (int port : admin_ports) {
+        int fd = connect_to(port);
+        std::string request = "GET /metrics HTTP/1.0\r\n\r\n", response;
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        char buffer[65536];
+        ssize_t got;
+        while ((got = recv(fd, buffer, sizeof(buffer), 0)) > 0) response.append(buffer, got);
+        close(fd);
+        size_t at = response.find("\n" + name + " ");
+        if (at != std::string::npos) total += std::strtoull(response.c_str() + at + name.size() + 2, nullptr, 10);
+    }
+    return total;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--ports" && i + 1 < argc) {
+            ports = parse_ports(argv[++i]);
+        } else if (arg == "--admin-ports" && i + 1 < argc) {
+            admin_ports = parse_ports(argv[++i]);
+        } else if (arg == "--users" && i + 1 < argc) {
+            users_file = argv[++i];
+        } else if (arg == "--messages" && i + 1 < argc) {
+            message_count = std::max(1, std::atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--ports P,P,...] [--admin-ports P,P,...] [--users FILE] [--messages N]" << std::endl;
+            return 1;
+        }
+    }
+    std::vector<Client> clients;
+    std::vector<std::string> passwords;
+    std::ifstream file(users_file);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        clients.emplace_back();
+        clients.back().username = line.substr(0, colon);
+        passwords.push_back(line.substr(colon + 1));
+    }
+    if (clients.size() < 2 || ports.empty()) {
+        std::cerr << "Need at least two users in " << users_file << " and one node" << std::endl;
+        return 1;
+    }
+    size_t n = clients.size();
+    for (size_t i = 0; i < n; i++) {
+        clients[i].fd = connect_to(ports[i % ports.size()]);
+        // Line framing, so that pipelined commands are split at newlines
+        send_line(clients[i], "/protocol line\n/login " + clients[i].username + " " + passwords[i]);
+    }
+    // Logins, and the user directory reaching every node
+    pump(clients, 500);
+
+    std::string group = "cluster_test_" + std::to_string(getpid());
+    send_line(clients[0], "/create_group " + group);
+    pump(clients, 300);
+    for (size_t i = 1; i < n; i++) send_line(clients[i], "/join_group " + group);
+    pump(clients, 300);
+
+    uint64_t frames_before = scrape("chat_cluster_frames_sent_total");
+    uint64_t batches_before = scrape("chat_cluster_batches_sent_total");
+    for (int k = 0; k < message_count; k++) {
+        for (size_t i = 0; i < n; i++) {
+            std::string tag = std::to_string(i) + "-" + std::to_string(k);
+            send_line(clients[i], "/group_msg " + group + " ct1-g" + tag);
+            send_line(clients[i], "/msg " + clients[(i + 1) % n].username + " ct1-p" + tag);
+        }
+    }
+    pump(clients, 1000);
+    uint64_t frames = scrape("chat_cluster_frames_sent_total") - frames_before;
+    uint64_t batches = scrape("chat_cluster_batches_sent_total") - batches_before;
+
+    // Everyone gets every other member's group messages and the private ones of the previous user
+    size_t expected = 0, delivered = 0, wrong = 0;
+    for (size_t i = 0; i < n; i++) {
+        std::map<std::string, int> want;
+        for (int k = 0; k < message_count; k++) {
+            for (size_t from = 0; from < n; from++) {
+                if (from != i) want["ct1-g" + std::to_string(from) + "-" + std::to_string(k)] = 1;
+            }
+            want["ct1-p" + std::to_string((i + n - 1) % n) + "-" + std::to_string(k)] = 1;
+        }
+        expected += want.size();
+        for (const auto& [tag, count] : clients[i].tags) {
+            delivered += count;
+            if (want.count(tag) == 0 || count != 1) wrong++;
+        }
+        for (const auto& [tag, count] : want) {
+            if (clients[i].tags.count(tag) == 0) wrong++;
+        }
+        close(clients[i].fd);
+    }
+    std::cout << std::fixed << std::setprecision(2) << "nodes=" << ports.size() << " users=" << n
+              << " messages_per_user=" << 2 * message_count << "\n"
+              << "expected=" << expected << " delivered=" << delivered << " wrong=" << wrong << std::endl;
+    if (!admin_ports.empty()) {
+        std::cout << "link frames=" << frames << " writes=" << batches
+                  << " frames_per_message=" << static_cast<double>(frames) / (2 * n * message_count)
+                  << " frames_per_write=" << static_cast<double>(frames) / std::max<uint64_t>(batches, 1)
+                  << std::endl;
+    }
+    return wrong == 0 ? 0 : 1;
+}
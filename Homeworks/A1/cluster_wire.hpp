@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+
+// Frames of the link between cluster nodes. A frame is
+//
+//   u32 body length | u8 type | fields
+//
+// with the length little-endian and covering the type and the fields. Every
+// field but the last is a u16 length and its bytes; the last field runs to
+// the end of the body, so a forwarded chat line is copied in as it is. A
+// link carries frames back to back, and a sender writes whatever has queued
+// up for a node in one send, so a burst to one node costs one syscall.
+
+namespace cluster_wire {
+
+enum class Type : uint8_t {
+    Hello = 1,     // node id; the first frame on a link
+    UserOnline,    // username; the node has a first session for the user
+    UserOffline,   // username; the node closed the user's last session
+    GroupPresent,  // group; the node has members of the group
+    GroupAbsent,   // group; the node's last member left
+    Private,       // recipient, line; deliver to the recipient's sessions
+    Group,         // group, line; deliver to the node's members of the group
+    Broadcast,     // line; deliver to every client of the node
+};
+
+constexpr size_t HEADER_BYTES = 4;
+constexpr size_t MAX_FIELDS = 2;
+// Bodies are a chat line and a name; anything larger is a broken link
+constexpr size_t MAX_BODY_BYTES = 1 << 20;
+
+// Appends one frame; every field but the last must fit a u16 length
+inline void append(std::string& out, Type type, std::initializer_list<std::string_view> fields) {
+    size_t body = 1;
+    for (std::string_view field : fields) body += field.size() + 2;
+    body -= 2;  // The last field has no length
+    char header[HEADER_BYTES + 1] = {static_cast<char>(body), static_cast<char>(body >> 8),
+                                     static_cast<char>(body >> 16), static_cast<char>(body >> 24),
+                                     static_cast<char>(type)};
+    out.append(header, sizeof(header));
+    size_t index = 0;
+    for (std::string_view field : fields) {
+        if (++index < fields.size()) {
+            char length[2] = {static_cast<char>(field.size()), static_cast<char>(field.size() >> 8)};
+            out.append(length, 2);
+        }
+        out.append(field);
+    }
+}
+
+struct Frame {
+    Type type;
+    std::string_view fields[MAX_FIELDS];
+    size_t count = 0;
+};
+
+// How many fields a frame of each type has
+constexpr size_t field_count(Type type) {
+    return type == Type::Private || type == Type::Group ? 2 : 1;
+}
+
+// Parses the frame at the start of data. Returns its size, 0 if it has not
+// arrived completely, or SIZE_MAX if the bytes are not a valid frame.
+inline size_t parse(const char* data, size_t size, Frame& frame) {
+    if (size < HEADER_BYTES + 1) return 0;
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t body = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | static_cast<size_t>(bytes[3]) << 24;
+    if (body == 0 || body > MAX_BODY_BYTES) return SIZE_MAX;
+    if (size < HEADER_BYTES + body) return 0;
+    uint8_t type = bytes[HEADER_BYTES];
+    if (type < static_cast<uint8_t>(Type::Hello) || type > static_cast<uint8_t>(Type::Broadcast)) return SIZE_MAX;
+    frame.type = static_cast<Type>(type);
+    frame.count = field_count(frame.type);
+    const char* field = data + HEADER_BYTES + 1;
+    const char* end = data + HEADER_BYTES + body;
+    for (size_t index = 0; index + 1 < frame.count; index++) {
+        if (end - field < 2) return SIZE_MAX;
+        size_t length = static_cast<unsigned char>(field[0]) | static_cast<unsigned char>(field[1]) << 8;
+        field += 2;
+        if (static_cast<size_t>(end - field) < length) return SIZE_MAX;
+        frame.fields[index] = std::string_view(field, length);
+        field += length;
+    }
+    frame.fields[frame.count - 1] = std::string_view(field, end - field);
+    return HEADER_BYTES + body;
+}
+
+}  // namespace cluster_wire
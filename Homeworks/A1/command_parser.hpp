@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Chat command parsing shared by the server and its benchmarks. Parsing only
+// produces string_views into the received line, so it never allocates, and
+// the command name is resolved through a perfect hash built at compile time.
+
+enum class CommandId : uint8_t {
+    Unknown,
+    PrivateMessage,
+    Broadcast,
+    CreateGroup,
+    JoinGroup,
+    LeaveGroup,
+    GroupMessage,
+    Stats,
+    Pong,
+    ResumeGroup,
+    ResumeInbox
+};
+
+// A command split once into the pieces the handlers need:
+//   /broadcast <rest>            /create_group <rest>
+//   /msg <target> <text>         /group_msg <target> <text>
+// rest is everything after the first space; target and text split it at
+// its first space. The line is cut at the first CR/LF before parsing.
+struct CommandArgs {
+    std::string_view line;      // Whole command, trimmed
+    std::string_view name;      // First whitespace-delimited token
+    std::string_view rest;
+    std::string_view target;
+    std::string_view text;
+    bool has_rest = false;
+    bool has_text = false;
+};
+
+namespace command_table {
+
+struct Entry {
+    std::string_view name;
+    CommandId id;
+};
+
+constexpr Entry COMMANDS[] = {
+    {"/msg", CommandId::PrivateMessage},
+    {"/broadcast", CommandId::Broadcast},
+    {"/create_group", CommandId::CreateGroup},
+    {"/join_group", CommandId::JoinGroup},
+    {"/leave_group", CommandId::LeaveGroup},
+    {"/group_msg", CommandId::GroupMessage},
+    {"/stats", CommandId::Stats},
+    {"/pong", CommandId::Pong},
+    {"/resume_group", CommandId::ResumeGroup},
+    {"/resume_inbox", CommandId::ResumeInbox},
+};
+constexpr size_t COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+constexpr size_t TABLE_SIZE = 32;  // Power of two >= COMMAND_COUNT, sparse enough for a seed to be found quickly
+
+// FNV-1a, salted with a seed chosen at compile time
+constexpr uint32_t hash(std::string_view text, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : text) {
+        h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return h;
+}
+
+// The first seed under which no two commands share a slot
+constexpr uint32_t find_seed() {
+    for (uint32_t seed = 0; seed < 100000; seed++) {
+        bool used[TABLE_SIZE] = {};
+        bool collision = false;
+        for (const Entry& entry : COMMANDS) {
+            size_t slot = hash(entry.name, seed) & (TABLE_SIZE - 1);
+            if (used[slot]) {
+                collision = true;
+                break;
+            }
+            used[slot] = true;
+        }
+        if (!collision) return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t SEED = find_seed();
+static_assert(SEED != UINT32_MAX, "no perfect hash seed for the command table");
+
+struct Table {
+    Entry slots[TABLE_SIZE];
+};
+
+constexpr Table build_table() {
+    Table table{};
+    for (const Entry& entry : COMMANDS) {
+        table.slots[hash(entry.name, SEED) & (TABLE_SIZE - 1)] = entry;
+    }
+    return table;
+}
+
+constexpr Table TABLE = build_table();
+
+}  // namespace command_table
+
+// One hash and one comparison per lookup
+constexpr CommandId lookup_command(std::string_view name) {
+    const command_table::Entry& entry =
+        command_table::TABLE.slots[command_table::hash(name, command_table::SEED) & (command_table::TABLE_SIZE - 1)];
+    return !entry.name.empty() && entry.name == name ? entry.id : CommandId::Unknown;
+}
+
+static_assert(lookup_command("/group_msg") == CommandId::GroupMessage);
+static_assert(lookup_command("/groupmsg") == CommandId::Unknown);
+
+constexpr bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+// Splits a received command in place; returns the command it names
+constexpr CommandId parse_command(std::string_view message, CommandArgs& args) {
+    args = CommandArgs{};
+    size_t end = message.find_first_of(std::string_view("\r\n\0", 3));
+    std::string_view line = message.substr(0, end);
+    size_t start = 0;
+    while (start < line.size() && is_blank(line[start])) start++;
+    line.remove_prefix(start);
+    args.line = line;
+
+    size_t name_end = 0;
+    while (name_end < line.size() && !is_blank(line[name_end])) name_end++;
+    args.name = line.substr(0, name_end);
+
+    size_t space1 = line.find(' ');
+    if (space1 != std::string_view::npos) {
+        args.has_rest = true;
+        args.rest = line.substr(space1 + 1);
+        size_t space2 = args.rest.find(' ');
+        args.target = args.rest.substr(0, space2);
+        if (space2 != std::string_view::npos) {
+            args.has_text = true;
+            args.text = args.rest.substr(space2 + 1);
+        }
+    }
+    return lookup_command(args.name);
+}
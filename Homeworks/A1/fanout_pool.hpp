@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool for large fan-outs. A fan-out is a Job over items
+// [0, count): the submitting thread cuts it into chunks and deals them over
+// the workers' deques. A worker takes chunks from the back of its own deque
+// and, once that is empty, steals from the front of the others'. A worker
+// stuck on one slow chunk therefore does not hold up the rest of the job.
+//
+// The submitter works on its job as well: it runs the chunks that did not
+// fit a deque, steals back chunks of its own job that no worker has taken
+// yet, and then sleeps until the last chunk is done. Each Job counts its
+// unwritten items, so every fan-out knows when it is complete. Whoever
+// writes the last item says so under the job's mutex, which the submitter
+// must take before it can see the job done and let it go out of scope.
+//
+// A deque is a fixed ring under its own mutex, held only to move one chunk.
+// A full ring is not an error; the submitter keeps the chunk.
+
+namespace fanout_pool {
+
+constexpr size_t DEQUE_SLOTS = 1024;
+
+// One fan-out. write(context, begin, end) writes items [begin, end).
+struct Job {
+    void (*write)(const void* context, size_t begin, size_t end) = nullptr;
+    const void* context = nullptr;
+    std::atomic<size_t> remaining{0};  // Items not yet written
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;  // Under mutex: remaining reached 0
+};
+
+class Pool {
+public:
+    Pool() = default;
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    // Lets the workers finish what is queued and joins them
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (const auto& worker : workers) worker->thread.join();
+    }
+
+    void start(size_t worker_count) {
+        for (size_t i = 0; i < worker_count; i++) workers.push_back(std::make_unique<Worker>());
+        for (size_t i = 0; i < worker_count; i++) {
+            workers[i]->thread = std::thread([this, i] { run(i); });
+        }
+    }
+
+    bool running() const { return !workers.empty(); }
+    size_t size() const { return workers.size(); }
+
+    // Writes items [0, count) of job in chunks of chunk_size and returns when
+    // every item is written
+    void run(Job& job, size_t count, size_t chunk_size) {
+        job.remaining.store(count, std::memory_order_relaxed);
+        job.done = count == 0;
+        // The first chunk is the submitter's; it starts on it once the rest are dealt
+        Chunk own{&job, 0, std::min(count, chunk_size)};
+        size_t first = next_worker.fetch_add(1, std::memory_order_relaxed);
+        size_t begin = own.end;
+        for (size_t dealt = 0; begin < count && !workers.empty(); begin += chunk_size, dealt++) {
+            if (!push(*workers[(first + dealt) % workers.size()], {&job, begin, std::min(count, begin + chunk_size)})) {
+                break;
+            }
+        }
+        if (own.end < begin) {
+            splits.fetch_add(1, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            wake.notify_all();
+        }
+        if (count > 0) execute(own);
+        // What no deque had room for
+        for (; begin < count; begin += chunk_size) execute({&job, begin, std::min(count, begin + chunk_size)});
+        Chunk chunk;
+        while (job.remaining.load(std::memory_order_acquire) > 0 && steal(chunk, &job, SIZE_MAX)) execute(chunk);
+        std::unique_lock<std::mutex> lock(job.mutex);
+        job.finished.wait(lock, [&] { return job.done; });
+    }
+
+    std::atomic<uint64_t> splits{0};  // Jobs handed to the workers
+    std::atomic<uint64_t> stolen{0};  // Chunks run by a thread other than the one dealt them
+
+private:
+    struct Chunk {
+        Job* job = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        Chunk slots[DEQUE_SLOTS];
+        size_t head = 0;  // Front, where thieves take
+        size_t tail = 0;  // Back, where the owner takes
+        std::thread thread;
+    };
+
+    static bool push(Worker& worker, const Chunk& chunk) {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tail - worker.head == DEQUE_SLOTS) return false;
+        worker.slots[worker.tail++ % DEQUE_SLOTS] = chunk;
+        return true;
+    }
+
+    bool pop_own(size_t self, Chunk& chunk) {
+        Worker& worker = *workers[self];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.head == worker.tail) return false;
+        chunk = worker.slots[--worker.tail % DEQUE_SLOTS];
+        return true;
+    }
+
+    // Takes the oldest chunk of another deque, only one of job if it is set
+    bool steal(Chunk& chunk, const Job* job, size_t self) {
+        for (size_t i = 1; i <= workers.size(); i++) {
+            size_t victim = (self == SIZE_MAX ? i - 1 : self + i) % workers.size();
+            if (victim == self) continue;
+            Worker& worker = *workers[victim];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.head == worker.tail) continue;
+            const Chunk& oldest = worker.slots[worker.head % DEQUE_SLOTS];
+            if (job && oldest.job != job) continue;
+            chunk = oldest;
+            worker.head++;
+            stolen.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    static void execute(const Chunk& chunk) {
+        Job& job = *chunk.job;
+        job.write(job.context, chunk.begin, chunk.end);
+        if (job.remaining.fetch_sub(chunk.end - chunk.begin, std::memory_order_acq_rel) == chunk.end - chunk.begin) {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            job.done = true;
+            job.finished.notify_one();
+        }
+    }
+
+    void run(size_t self) {
+        Chunk chunk;
+        while (true) {
+            if (pop_own(self, chunk) || steal(chunk, nullptr, self)) {
+                execute(chunk);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            if (stopping) return;
+            // Dealing takes sleep_mutex before notifying, so a chunk pushed after the check above wakes this wait
+            wake.wait(lock, [&] { return stopping || has_work(); });
+        }
+    }
+
+    bool has_work() {
+        for (const auto& worker : workers) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            if (worker->head != worker->tail) return true;
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_worker{0};  // Where the next job starts dealing
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;  // Under sleep_mutex
+};
+
+}  // namespace fanout_pool
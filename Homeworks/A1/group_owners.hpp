@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Building blocks for giving every group one owning thread.
+//
+// SpscRing is a bounded lock-free queue with exactly one producer thread and
+// one consumer thread: the producer only writes the tail and the consumer
+// only the head, each on its own cache line, and each side keeps a copy of
+// the other's index that it refreshes only when the ring looks full or
+// empty, so a push or pop usually touches no shared cache line but the slot.
+// A full ring refuses the push instead of blocking; the producer keeps the
+// value and raises producer_waiting so that the consumer can wake it once it
+// has made room.
+//
+// HashRing places keys on threads by consistent hashing: each of the nodes
+// puts POINTS points on a 64-bit circle, and a key belongs to the node of the
+// first point at or after its hash. With many points per node the keys
+// spread evenly, and a node added or taken away moves only the keys next to
+// its own points.
+
+namespace group_owners {
+
+constexpr size_t CACHE_LINE = 64;
+
+template <typename T>
+class SpscRing {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        slots = std::make_unique<T[]>(size);
+        mask = size - 1;
+    }
+
+    // Producer: moves value into the ring; false (value untouched) if it is full
+    bool push(T& value) {
+        size_t tail = tail_index.load(std::memory_order_relaxed);
+        if (tail - cached_head > mask) {
+            cached_head = head_index.load(std::memory_order_acquire);
+            if (tail - cached_head > mask) return false;
+        }
+        slots[tail & mask] = std::move(value);
+        tail_index.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: moves the oldest value out; false if the ring is empty
+    bool pop(T& value) {
+        size_t head = head_index.load(std::memory_order_relaxed);
+        if (head == cached_tail) {
+            cached_tail = tail_index.load(std::memory_order_acquire);
+            if (head == cached_tail) return false;
+        }
+        value = std::move(slots[head & mask]);
+        slots[head & mask] = T();
+        head_index.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Set by the producer when a push failed, cleared by the consumer
+    std::atomic<bool> producer_waiting{false};
+
+private:
+    std::unique_ptr<T[]> slots;
+    size_t mask = 0;
+    alignas(CACHE_LINE) std::atomic<size_t> head_index{0};  // Written by the consumer
+    size_t cached_tail = 0;                                  // Consumer's copy of tail_index
+    alignas(CACHE_LINE) std::atomic<size_t> tail_index{0};  // Written by the producer
+    size_t cached_head = 0;                                  // Producer's copy of head_index
+};
+
+class HashRing {
+public:
+    static constexpr size_t POINTS = 64;
+
+    explicit HashRing(size_t nodes = 1) {
+        for (size_t node = 0; node < nodes; node++) {
+            for (size_t point = 0; point < POINTS; point++) {
+                points.emplace_back(mix(node * POINTS + point), node);
+            }
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    size_t owner(uint64_t key_hash) const {
+        uint64_t position = mix(key_hash);
+        auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(position, size_t{0}));
+        return it == points.end() ? points.front().second : it->second;
+    }
+
+private:
+    // splitmix64 finalizer: spreads sequential ids and weak string hashes over the circle
+    static uint64_t mix(uint64_t value) {
+        value += 0x9e3779b97f4a7c15ULL;
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        return value ^ (value >> 31);
+    }
+
+    std::vector<std::pair<uint64_t, size_t>> points;  // Sorted by position
+};
+
+}  // namespace group_owners
@@ -0,0 +1,185 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+
+#include "offline_inbox.hpp"
+
+// Offline inbox at scale: queues --messages private messages of --length
+// bytes for --users offline users, round-robin, then logs every user in and
+// drains their queue. Reports the memory the queues hold (counted against
+// the budget, and the growth of the process's resident set), the cost per
+// queued and per drained message, and how many spilled to disk under
+// --memory-mb. Every drained batch is checked: each message exactly once,
+// in the order it was sent, so the run fails (exit status 1) on any loss,
+// duplicate or reordering.
+//
+// While the messages are queued, a second thread sends one private message
+// every --probe-us microseconds to a user of its own and times each push,
+// as a /msg to an offline user would wait for it. With --memory-mb small
+// enough to spill, this is the latency of /msg while the inbox writes to
+// disk. The pushes that spill are timed as well: each holds the inbox
+// lock, and in the server clients_mutex, for as long as it takes.
+//
+// Usage: ./inbox_bench [--messages N] [--users N] [--length BYTES] [--memory-mb N] [--spill-dir DIR]
+//        [--probe-us N]
+
+using Clock = std::chrono::steady_clock;
+
+size_t message_count = 1000000;
+size_t user_count = 10000;
+size_t message_length = 64;
+size_t memory_mb = 1024;
+std::string spill_dir;
+size_t probe_us = 100;
+
+// Resident set size of this process in bytes
+size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// "[sender]: #<12-digit index> xxx...\n", length bytes in all (at least the header)
+constexpr size_t INDEX_OFFSET = 11;
+constexpr size_t INDEX_DIGITS = 12;
+
+std::string line_template() {
+    std::string line = "[sender]: #" + std::string(INDEX_DIGITS, '0') + " ";
+    if (line.size() + 1 < message_length) line.append(message_length - line.size() - 1, 'x');
+    line += '\n';
+    return line;
+}
+
+void stamp(std::string& line, size_t index) {
+    for (size_t digit = INDEX_OFFSET + INDEX_DIGITS; digit > INDEX_OFFSET; index /= 10) {
+        line[--digit] = static_cast<char>('0' + index % 10);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--messages" && i + 1 < argc) {
+            message_count = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--users" && i + 1 < argc) {
+            user_count = std::max(1ULL, std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--length" && i + 1 < argc) {
+            message_length = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--memory-mb" && i + 1 < argc) {
+            memory_mb = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--spill-dir" && i + 1 < argc) {
+            spill_dir = argv[++i];
+        } else if (arg == "--probe-us" && i + 1 < argc) {
+            probe_us = std::max(1ULL, std::strtoull(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--messages N] [--users N] [--length BYTES] [--memory-mb N] [--spill-dir DIR]"
+                      << " [--probe-us N]" << std::endl;
+            return 1;
+        }
+    }
+    if (message_count / user_count > offline_inbox::MAX_MESSAGES_PER_USER) {
+        std::cerr << "At most " << offline_inbox::MAX_MESSAGES_PER_USER << " messages per user" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> users(user_count);
+    for (size_t i = 0; i < user_count; i++) users[i] = "user" + std::to_string(i);
+
+    size_t resident_before = resident_bytes();
+    offline_inbox::Inbox inbox;
+    std::string error;
+    if (!inbox.open(memory_mb << 20, 3600, spill_dir, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    // One line, restamped with each message's index
+    std::string line = line_template();
+    size_t rejected = 0, spilled = 0;
+    std::atomic<bool> pushing{true};
+    std::vector<double> probe_latency;  // Microseconds
+    std::vector<double> spill_latency;  // Microseconds, pushes that spilled
+    std::thread probe([&] {
+        std::string probe_line = "[probe]: latency\n";
+        Clock::time_point next = Clock::now();
+        while (pushing.load(std::memory_order_relaxed) &&
+               probe_latency.size() < offline_inbox::MAX_MESSAGES_PER_USER) {
+            next += std::chrono::microseconds(probe_us);
+            std::this_thread::sleep_until(next);
+            Clock::time_point sent = Clock::now();
+            inbox.push("probe", probe_line);
+            probe_latency.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+        }
+    });
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < message_count; i++) {
+        stamp(line, i);
+        Clock::time_point pushed = Clock::now();
+        offline_inbox::Result result = inbox.push(users[i % user_count], line);
+        if (result == offline_inbox::Result::Full) rejected++;
+        if (result == offline_inbox::Result::Spilled) {
+            spilled++;
+            spill_latency.push_back(std::chrono::duration<double, std::micro>(Clock::now() - pushed).count());
+        }
+    }
+    double push_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    pushing = false;
+    probe.join();
+    auto percentiles = [](std::vector<double>& samples) {
+        std::sort(samples.begin(), samples.end());
+        auto at = [&](double fraction) {
+            return samples.empty() ? 0.0 : samples[static_cast<size_t>(fraction * (samples.size() - 1))];
+        };
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << "p50=" << at(0.5) << " p99=" << at(0.99) << " max=" << at(1.0);
+        return out.str();
+    };
+    size_t resident_queued = resident_bytes();
+    size_t counted = inbox.memory_used();
+
+    // Drain: every user logs in, in turn. User u was sent messages u, u +
+    // users, u + 2 * users, ...; a full budget, or a spill buffer the disk
+    // has not caught up with, refuses some of them
+    size_t drained = 0, bad = 0;
+    start = Clock::now();
+    for (size_t u = 0; u < user_count; u++) {
+        offline_inbox::Batch batch = inbox.take(users[u]);
+        inbox.collect(batch);
+        size_t next = u;  // Lowest index the next message may have
+        for (size_t offset = 0; offset < batch.text.size(); offset = batch.text.find('\n', offset) + 1) {
+            size_t index = std::strtoull(batch.text.c_str() + offset + INDEX_OFFSET, nullptr, 10);
+            if (index < next || index % user_count != u) bad++;
+            next = index + user_count;
+            drained++;
+        }
+    }
+    double drain_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    offline_inbox::Batch probe_batch = inbox.take("probe");
+    inbox.collect(probe_batch);
+    if (!spill_dir.empty()) std::filesystem::remove(spill_dir);
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "messages=" << message_count << " users=" << user_count << " length=" << message_length
+              << " memory_mb=" << memory_mb << "\n"
+              << "queued: counted_mb=" << counted / 1048576.0 << " rss_growth_mb="
+              << (resident_queued - resident_before) / 1048576.0
+              << " bytes_per_message=" << static_cast<double>(resident_queued - resident_before) / message_count
+              << " spilled=" << spilled << " rejected=" << rejected << "\n"
+              << "push_ns_per_message=" << push_seconds * 1e9 / message_count
+              << " drain_ns_per_message=" << drain_seconds * 1e9 / std::max<size_t>(drained, 1) << "\n"
+              << "msg_latency_us " << percentiles(probe_latency) << " (" << probe_latency.size() << " probes)\n"
+              << "spill_push_us " << percentiles(spill_latency) << "\n"
+              << "drained=" << drained << " out_of_order=" << bad << std::endl;
+    return bad == 0 && drained + rejected == message_count ? 0 : 1;
+}
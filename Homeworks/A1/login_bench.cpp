@@ -0,0 +1,181 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+// Login storm: keeps --concurrency connections logging in at once for
+// --duration seconds and reports logins per second and the time from
+// connect() to the welcome line. Every connection sends the one-command form
+// "/login <username> <password>" right after connecting, without waiting for
+// the prompts, and resets the connection as soon as the reply arrives, so no
+// client ports are left in TIME_WAIT. Users are taken round-robin from the
+// user file, which must be a text file even if the server serves a compiled
+// index of it.
+//
+// Usage: ./login_bench [--port N] [--concurrency N] [--duration SECONDS] [--users FILE]
+
+using Clock = std::chrono::steady_clock;
+
+int server_port = 12345;
+int concurrency = 64;
+double duration_seconds = 5;
+std::string users_file = "users.txt";
+
+struct Attempt {
+    int fd = -1;
+    bool sent = false;
+    std::string reply;
+    Clock::time_point started;
+};
+
+std::vector<std::pair<std::string, std::string>> load_credentials(const std::string& file_name) {
+    std::vector<std::pair<std::string, std::string>> credentials;
+    std::ifstream file(file_name);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t colon = line.find(':');
+        if (colon != std::string::npos && colon + 1 < line.size()) {
+            credentials.emplace_back(line.substr(0, colon), line.substr(colon + 1));
+        }
+    }
+    return credentials;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            server_port = std::atoi(argv[++i]);
+        } else if (arg == "--concurrency" && i + 1 < argc) {
+            concurrency = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--duration" && i + 1 < argc) {
+            duration_seconds = std::max(0.1, std::atof(argv[++i]));
+        } else if (arg == "--users" && i + 1 < argc) {
+            users_file = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--port N] [--concurrency N] [--duration SECONDS] [--users FILE]" << std::endl;
+            return 1;
+        }
+    }
+    std::vector<std::pair<std::string, std::string>> credentials = load_credentials(users_file);
+    if (credentials.empty()) {
+        std::cerr << "No users in " << users_file << std::endl;
+        return 1;
+    }
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int epoll_fd = epoll_create1(0);
+    std::vector<Attempt> attempts(concurrency);
+    std::vector<double> latencies_us;
+    size_t next_user = 0, failures = 0, errors = 0;
+
+    auto start_attempt = [&](size_t slot) {
+        Attempt& attempt = attempts[slot];
+        attempt = Attempt();
+        attempt.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        linger reset{1, 0};  // Close with RST: no TIME_WAIT on the client ports
+        setsockopt(attempt.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        attempt.started = Clock::now();
+        if (connect(attempt.fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+            std::cerr << "connect: " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = slot;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, attempt.fd, &ev);
+    };
+    auto finish_attempt = [&](size_t slot) {
+        close(attempts[slot].fd);
+        attempts[slot].fd = -1;
+    };
+
+    Clock::time_point begin = Clock::now();
+    Clock::time_point end = begin + std::chrono::duration_cast<Clock::duration>(
+                                        std::chrono::duration<double>(duration_seconds));
+    for (int slot = 0; slot < concurrency; slot++) start_attempt(slot);
+    epoll_event events[256];
+    char buffer[4096];
+    int active = concurrency;
+    while (active > 0) {
+        int n = epoll_wait(epoll_fd, events, 256, 1000);
+        for (int i = 0; i < n; i++) {
+            size_t slot = events[i].data.u64;
+            Attempt& attempt = attempts[slot];
+            if (attempt.fd < 0) continue;
+            if (!attempt.sent && (events[i].events & EPOLLOUT)) {
+                const auto& [username, password] = credentials[next_user++ % credentials.size()];
+                std::string request = "/login " + username + " " + password + "\n";
+                attempt.sent = send(attempt.fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+                               static_cast<ssize_t>(request.size());
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.u64 = slot;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, attempt.fd, &ev);
+                if (!attempt.sent) {
+                    errors++;
+                    finish_attempt(slot);
+                }
+            } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ssize_t received = recv(attempt.fd, buffer, sizeof(buffer), 0);
+                if (received > 0) attempt.reply.append(buffer, received);
+                if (attempt.reply.find("Welcome") != std::string::npos) {
+                    latencies_us.push_back(
+                        std::chrono::duration<double, std::micro>(Clock::now() - attempt.started).count());
+                } else if (attempt.reply.find("Authentication failed") != std::string::npos) {
+                    failures++;
+                } else if (received <= 0 && !(received < 0 && errno == EAGAIN)) {
+                    errors++;
+                } else {
+                    continue;
+                }
+                finish_attempt(slot);
+            }
+            if (attempts[slot].fd < 0) {
+                if (Clock::now() < end) {
+                    start_attempt(slot);
+                } else {
+                    active--;
+                }
+            }
+        }
+        if (n == 0 && Clock::now() > end + std::chrono::seconds(5)) {
+            std::cerr << active << " logins did not finish" << std::endl;
+            break;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    std::sort(latencies_us.begin(), latencies_us.end());
+    auto percentile = [&](double p) {
+        return latencies_us.empty() ? 0.0 : latencies_us[std::min(latencies_us.size() - 1,
+                                                                  static_cast<size_t>(p * latencies_us.size()))];
+    };
+    std::cout << std::fixed << std::setprecision(1)
+              << "logins=" << latencies_us.size() << " failed=" << failures << " errors=" << errors
+              << " seconds=" << elapsed << " logins_per_sec=" << latencies_us.size() / elapsed << "\n"
+              << "latency_us p50=" << percentile(0.5) << " p99=" << percentile(0.99)
+              << " max=" << (latencies_us.empty() ? 0.0 : latencies_us.back()) << std::endl;
+    return 0;
+}
@@ -0,0 +1,477 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "message_pool.hpp"
+
+// Durable, append-only message log: one stream per group and one per user
+// inbox, each a directory of segment files.
+//
+//   <dir>/group/<hex name>/<first seq, 20 digits>.log
+//   <dir>/inbox/<hex name>/<first seq, 20 digits>.log
+//
+// A record is exactly the line its recipients were sent, which starts with
+// the stream's sequence number: "#42 [alice][Group g1]: hi\n". Commands are
+// single lines, so records never contain a newline. A segment is therefore
+// a run of records in sequence order with no framing to decode. A replay
+// finds its first record by binary search over a mapped segment, then
+// copies whole byte ranges out of the mapping.
+//
+// Appending assigns the next sequence number and queues the record under
+// one short lock; the caller builds the record from the number and sends
+// it right away. An appender thread writes the queued records and fsyncs
+// every file it touched once per batch (group commit). A crash can lose the
+// batch being synced, which its recipients already have; in exchange the
+// disk never delays a live send. For the same reason a disk that falls
+// behind does not block appending: once PENDING_BYTES are queued, further
+// records are still numbered and sent but not logged, and are counted as
+// dropped.
+//
+// On open every stream's last sequence number is recovered from the tail
+// of its newest segment, dropping a record torn by a crash.
+
+namespace message_log {
+
+constexpr size_t SEGMENT_BYTES = 8 << 20;
+// Below this size a replay scans lines instead of bisecting further
+constexpr size_t SCAN_BYTES = 4096;
+// Recovery reads this much of a segment's tail; more than the longest record
+constexpr size_t TAIL_BYTES = 1 << 18;
+// Record bytes the appender may have queued before appends are dropped
+constexpr size_t PENDING_BYTES = 32 << 20;
+
+enum class Kind { Group, Inbox };
+
+// Sequence number of the record starting at line
+inline uint64_t record_seq(const char* line, const char* end) {
+    uint64_t seq = 0;
+    if (line < end && *line == '#') std::from_chars(line + 1, end, seq);
+    return seq;
+}
+
+// Offset of the first record in data[0, size) with a sequence number above after
+inline size_t first_after(const char* data, size_t size, uint64_t after) {
+    const char* end = data + size;
+    auto next_line = [&](size_t offset) -> size_t {
+        if (offset == 0) return 0;
+        const void* newline = memchr(data + offset - 1, '\n', size - offset + 1);
+        return newline ? static_cast<const char*>(newline) - data + 1 : size;
+    };
+    // lo is a record start known to be at or before the answer
+    size_t lo = 0, hi = size;
+    while (hi - lo > SCAN_BYTES) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t line = next_line(mid);
+        if (line >= hi) {
+            hi = mid;
+        } else if (record_seq(data + line, end) <= after) {
+            lo = line;
+        } else {
+            hi = line;
+        }
+    }
+    while (lo < size && record_seq(data + lo, end) <= after) lo = next_line(lo + 1);
+    return lo;
+}
+
+class Log {
+public:
+    Log() = default;
+    Log(const Log&) = delete;
+    Log& operator=(const Log&) = delete;
+
+    // Recovers the streams under dir and starts the appender; false with a
+    // reason if the directory cannot be used
+    bool open(const std::string& directory, std::string& error) {
+        root = directory;
+        for (const char* kind : {"", "/group", "/inbox"}) {
+            std::string path = root + kind;
+            if (mkdir(path.c_str(), 0700) < 0 && errno != EEXIST) {
+                error = "cannot create " + path + ": " + strerror(errno);
+                return false;
+            }
+        }
+        for (Kind kind : {Kind::Group, Kind::Inbox}) {
+            std::string parent = root + kind_directory(kind);
+            DIR* dir = opendir(parent.c_str());
+            if (!dir) continue;
+            while (dirent* entry = readdir(dir)) {
+                std::string name;
+                if (entry->d_name[0] == '.' || !hex_decode(entry->d_name, name)) continue;
+                std::unique_ptr<Stream> stream = std::make_unique<Stream>();
+                stream->path = parent + "/" + entry->d_name;
+                recover(*stream);
+                streams[static_cast<size_t>(kind)].emplace(std::move(name), std::move(stream));
+            }
+            closedir(dir);
+        }
+        active = true;
+        std::thread([this] { run(); }).detach();
+        return true;
+    }
+
+    bool enabled() const { return active; }
+
+    // Last sequence number assigned in the stream; 0 if it has none
+    uint64_t last_seq(Kind kind, std::string_view name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const StreamMap& map = streams[static_cast<size_t>(kind)];
+        auto it = map.find(name);
+        return it == map.end() ? 0 : it->second->last_seq;
+    }
+
+    // Assigns the stream's next sequence number, builds the record with
+    // build(seq) where seq is the number in decimal, and queues it for the
+    // disk. Returns the record, to be sent to the live recipients.
+    template <typename Build>
+    Payload append(Kind kind, std::string_view name, Build&& build) {
+        char digits[24];
+        std::lock_guard<std::mutex> lock(mutex);
+        Stream& stream = find_or_add(kind, name);
+        uint64_t seq = ++stream.last_seq;
+        char* end = std::to_chars(digits, digits + sizeof(digits), seq).ptr;
+        Payload record = build(std::string_view(digits, end - digits));
+        if (pending_bytes + record.size() > PENDING_BYTES) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return record;
+        }
+        pending.push_back({&stream, seq, record});
+        pending_bytes += record.size();
+        appended.fetch_add(1, std::memory_order_relaxed);
+        if (appender_idle) {
+            appender_idle = false;
+            wakeup.notify_one();
+        }
+        return record;
+    }
+
+    // Passes the stream's records after seq after to emit(bytes), in order and
+    // in as few contiguous pieces as possible, up to max_bytes of whole
+    // records. The first record is passed even if it alone is over max_bytes,
+    // so that resuming from the result always makes progress. Returns the
+    // last sequence number passed, or after if none.
+    template <typename Emit>
+    uint64_t read(Kind kind, std::string_view name, uint64_t after, size_t max_bytes, Emit&& emit) {
+        std::vector<uint64_t> firsts;
+        std::string path;
+        uint64_t written;
+        std::vector<Payload> unwritten;  // Queued or being written, past written
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const StreamMap& map = streams[static_cast<size_t>(kind)];
+            auto it = map.find(name);
+            if (it == map.end()) return after;
+            Stream& stream = *it->second;
+            firsts = stream.segments;
+            path = stream.path;
+            written = stream.written_seq;
+            for (const std::vector<Record>* records : {&writing, &pending}) {
+                for (const Record& record : *records) {
+                    if (record.stream == &stream && record.seq > std::max(after, written)) {
+                        unwritten.push_back(record.payload);
+                    }
+                }
+            }
+        }
+        uint64_t last = after;
+        size_t budget = max_bytes;
+        // The segment holding after + 1 is the last one starting at or before it
+        auto segment = std::upper_bound(firsts.begin(), firsts.end(), after + 1);
+        if (segment != firsts.begin()) --segment;
+        for (; segment != firsts.end() && last < written && budget > 0; ++segment) {
+            int fd = ::open(segment_path(path, *segment).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+            struct stat info{};
+            fstat(fd, &info);
+            size_t size = info.st_size;
+            void* mapped = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (mapped == MAP_FAILED) continue;
+            const char* data = static_cast<const char*>(mapped);
+            // Only whole records: the appender may be writing past written
+            const void* final_newline = memrchr(data, '\n', size);
+            size_t records = final_newline ? static_cast<const char*>(final_newline) - data + 1 : 0;
+            size_t begin = first_after(data, records, last);
+            size_t end = first_after(data, records, written);
+            if (end - begin > budget) {
+                // Cut after the last whole record that fits, or the first one
+                const void* newline = memrchr(data + begin, '\n', budget);
+                if (!newline && last == after) newline = memchr(data + begin, '\n', end - begin);
+                end = newline ? static_cast<const char*>(newline) - data + 1 : begin;
+                budget = 0;
+            } else {
+                budget -= end - begin;
+            }
+            if (end > begin) {
+                const char* tail = static_cast<const char*>(memrchr(data + begin, '\n', end - begin - 1));
+                last = record_seq(tail ? tail + 1 : data + begin, data + end);
+                emit(std::string_view(data + begin, end - begin));
+                replayed.fetch_add(end - begin, std::memory_order_relaxed);
+            }
+            munmap(mapped, size);
+        }
+        if (last >= written) {
+            for (const Payload& record : unwritten) {
+                if (record.size() > budget && last != after) break;
+                budget -= std::min(budget, record.size());
+                last = record_seq(record.data(), record.data() + record.size());
+                emit(record.view());
+                replayed.fetch_add(record.size(), std::memory_order_relaxed);
+            }
+        }
+        return last;
+    }
+
+    std::atomic<uint64_t> appended{0};
+    std::atomic<uint64_t> commits{0};   // Group commits: one fsync round over a batch
+    std::atomic<uint64_t> replayed{0};  // Bytes passed out by read()
+    std::atomic<uint64_t> errors{0};    // Failed writes or syncs; the records stay in memory only
+    std::atomic<uint64_t> dropped{0};   // Appends over PENDING_BYTES, sent but never logged
+
+private:
+    struct Stream {
+        std::string path;
+        uint64_t last_seq = 0;     // Last assigned
+        uint64_t written_seq = 0;  // Last written to its segment (readable, maybe not yet synced)
+        std::vector<uint64_t> segments;  // First sequence number of each segment, ascending
+        // Appender thread only
+        int fd = -1;
+        size_t size = 0;
+        std::string buffer;
+        uint64_t buffered_seq = 0;
+        bool dirty = false;
+        bool created = false;  // Directory exists
+    };
+
+    struct Record {
+        Stream* stream;
+        uint64_t seq;
+        Payload payload;
+    };
+
+    // Looked up by string_view, so appending allocates nothing for a known stream
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+    };
+    using StreamMap = std::unordered_map<std::string, std::unique_ptr<Stream>, NameHash, std::equal_to<>>;
+
+    static const char* kind_directory(Kind kind) { return kind == Kind::Group ? "/group" : "/inbox"; }
+
+    static std::string segment_path(const std::string& path, uint64_t first) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%020llu.log", static_cast<unsigned long long>(first));
+        return path + name;
+    }
+
+    // Names become hex, so any group or user name is a safe file name
+    static std::string hex_encode(std::string_view name) {
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c : name) {
+            out.push_back(digits[c >> 4]);
+            out.push_back(digits[c & 15]);
+        }
+        return out;
+    }
+
+    static bool hex_decode(std::string_view hex, std::string& out) {
+        if (hex.empty() || hex.size() % 2) return false;
+        for (size_t i = 0; i < hex.size(); i += 2) {
+            int value = 0;
+            if (std::from_chars(hex.data() + i, hex.data() + i + 2, value, 16).ptr != hex.data() + i + 2) return false;
+            out.push_back(static_cast<char>(value));
+        }
+        return true;
+    }
+
+    Stream& find_or_add(Kind kind, std::string_view name) {
+        StreamMap& map = streams[static_cast<size_t>(kind)];
+        auto it = map.find(name);
+        if (it == map.end()) {
+            auto stream = std::make_unique<Stream>();
+            stream->path = root + kind_directory(kind) + "/" + hex_encode(name);
+            it = map.emplace(std::string(name), std::move(stream)).first;
+        }
+        return *it->second;
+    }
+
+    // Lists the segments and finds the last whole record of the newest one
+    void recover(Stream& stream) {
+        stream.created = true;
+        DIR* dir = opendir(stream.path.c_str());
+        if (!dir) return;
+        while (dirent* entry = readdir(dir)) {
+            uint64_t first = 0;
+            std::string_view file = entry->d_name;
+            if (file.size() == 24 && file.substr(20) == ".log" &&
+                std::from_chars(file.data(), file.data() + 20, first).ptr == file.data() + 20) {
+                stream.segments.push_back(first);
+            }
+        }
+        closedir(dir);
+        std::sort(stream.segments.begin(), stream.segments.end());
+        if (stream.segments.empty()) return;
+        std::string path = segment_path(stream.path, stream.segments.back());
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        struct stat info{};
+        if (fd < 0 || fstat(fd, &info) < 0) {
+            if (fd >= 0) ::close(fd);
+            return;
+        }
+        // The last newline ends the last whole record; the one before it starts it
+        size_t size = info.st_size;
+        size_t window = std::min(size, TAIL_BYTES);
+        std::string tail(window, '\0');
+        if (pread(fd, tail.data(), window, size - window) != static_cast<ssize_t>(window)) {
+            ::close(fd);
+            return;
+        }
+        uint64_t last = stream.segments.back() - 1;  // An empty segment continues the previous one
+        size_t complete = size - window;
+        size_t newline = tail.rfind('\n');
+        if (newline != std::string::npos) {
+            complete += newline + 1;
+            size_t previous = newline > 0 ? tail.rfind('\n', newline - 1) : std::string::npos;
+            size_t start = previous == std::string::npos ? 0 : previous + 1;
+            last = record_seq(tail.data() + start, tail.data() + newline);
+        }
+        if (complete < size && ftruncate(fd, complete) == 0) {
+            fsync(fd);  // Drops a record torn by a crash
+        }
+        ::close(fd);
+        stream.last_seq = stream.written_seq = last;
+    }
+
+    void run() {
+        std::vector<Stream*> dirty;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                appender_idle = pending.empty();
+                wakeup.wait(lock, [this] { return !pending.empty(); });
+                appender_idle = false;
+                writing.swap(pending);
+                pending_bytes = 0;
+            }
+            for (const Record& record : writing) {
+                Stream& stream = *record.stream;
+                if (stream.fd < 0 || (stream.size + record.payload.size() > SEGMENT_BYTES && stream.size > 0)) {
+                    flush(stream);
+                    roll(stream, record.seq);
+                }
+                stream.buffer.append(record.payload.view());
+                stream.size += record.payload.size();
+                stream.buffered_seq = record.seq;
+                if (!stream.dirty) {
+                    stream.dirty = true;
+                    dirty.push_back(&stream);
+                }
+            }
+            for (Stream* stream : dirty) {
+                flush(*stream);
+            }
+            {
+                // Written records are readable from the files from here on
+                std::lock_guard<std::mutex> lock(mutex);
+                for (Stream* stream : dirty) {
+                    stream->written_seq = stream->buffered_seq;
+                }
+                writing.clear();
+            }
+            for (Stream* stream : dirty) {
+                if (stream->fd >= 0 && fdatasync(stream->fd) < 0) errors.fetch_add(1, std::memory_order_relaxed);
+                stream->dirty = false;
+            }
+            dirty.clear();
+            commits.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void flush(Stream& stream) {
+        size_t offset = 0;
+        while (stream.fd >= 0 && offset < stream.buffer.size()) {
+            ssize_t written = write(stream.fd, stream.buffer.data() + offset, stream.buffer.size() - offset);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                errors.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            offset += written;
+        }
+        stream.buffer.clear();
+    }
+
+    // Continues the newest segment after a restart while it has room, else
+    // starts a new one at seq; the old one is synced before it is closed
+    void roll(Stream& stream, uint64_t seq) {
+        if (stream.fd >= 0) {
+            if (fdatasync(stream.fd) < 0) errors.fetch_add(1, std::memory_order_relaxed);
+            ::close(stream.fd);
+            stream.fd = -1;
+        } else if (!stream.segments.empty()) {
+            std::string path = segment_path(stream.path, stream.segments.back());
+            stream.fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            struct stat info{};
+            if (stream.fd >= 0 && fstat(stream.fd, &info) == 0 && static_cast<size_t>(info.st_size) < SEGMENT_BYTES) {
+                stream.size = info.st_size;
+                return;
+            }
+            if (stream.fd >= 0) ::close(stream.fd);
+            stream.fd = -1;
+        }
+        if (!stream.created) {
+            stream.created = mkdir(stream.path.c_str(), 0700) == 0 || errno == EEXIST;
+            sync_directory(stream.path.substr(0, stream.path.rfind('/')));
+        }
+        stream.fd = ::open(segment_path(stream.path, seq).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        stream.size = 0;
+        if (stream.fd < 0) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        sync_directory(stream.path);
+        std::lock_guard<std::mutex> lock(mutex);
+        stream.segments.push_back(seq);
+    }
+
+    // Makes a new directory entry durable
+    static void sync_directory(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    std::string root;
+    bool active = false;
+    std::mutex mutex;  // Streams, their sequence numbers and segment lists, and both queues
+    std::condition_variable wakeup;
+    bool appender_idle = false;
+    StreamMap streams[2];  // By Kind
+    std::vector<Record> pending;  // Appended, not yet taken by the appender
+    size_t pending_bytes = 0;     // Record bytes in pending
+    std::vector<Record> writing;  // Being written by the appender
+};
+
+}  // namespace message_log
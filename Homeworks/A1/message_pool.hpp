@@ -0,0 +1,283 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Memory for the message path that is recycled instead of going back to the
+// global allocator. Blocks come in power-of-two size classes and every thread
+// keeps its own free list per class, so allocating and freeing a block is a
+// couple of pointer moves with no locks. Blocks often die on another thread
+// than the one that made them (a payload formatted by one shard and written
+// by another), so a thread whose list grows past LOCAL_BLOCKS blocks or
+// CACHE_BYTES bytes hands a batch to a central list per class, and a thread
+// whose list is empty takes a batch from there: one lock per BATCH blocks,
+// and no heap traffic once the lists hold the working set. Blocks larger than the biggest class, and
+// whatever would grow a central list past CENTRAL_BYTES, use the heap.
+
+namespace message_pool {
+
+constexpr size_t MIN_SHIFT = 6;   // 64-byte smallest class
+constexpr size_t MAX_SHIFT = 17;  // 128 KiB largest class
+constexpr size_t CLASS_COUNT = MAX_SHIFT - MIN_SHIFT + 1;
+constexpr size_t HEAP_CLASS = CLASS_COUNT;  // Not pooled
+constexpr size_t CACHE_BYTES = 256 * 1024;
+constexpr size_t CENTRAL_BYTES = 16 * 1024 * 1024;
+constexpr size_t BATCH = 32;
+constexpr size_t LOCAL_BLOCKS = 2 * BATCH;
+
+// Precedes every block; keeps the data that follows 16-byte aligned
+struct alignas(16) BlockHeader {
+    size_t size_class;
+};
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct FreeList {
+    FreeBlock* head = nullptr;
+    size_t bytes = 0;
+};
+
+constexpr size_t class_for(size_t bytes) {
+    size_t size_class = 0;
+    while (size_class < CLASS_COUNT && (size_t{1} << (size_class + MIN_SHIFT)) < bytes) size_class++;
+    return size_class;
+}
+
+constexpr size_t class_bytes(size_t size_class) { return size_t{1} << (size_class + MIN_SHIFT); }
+
+struct CentralList {
+    std::mutex mutex;
+    FreeList list;
+};
+
+inline CentralList central[CLASS_COUNT];
+
+class ThreadCache {
+public:
+    ~ThreadCache() {
+        for (size_t size_class = 0; size_class < CLASS_COUNT; size_class++) {
+            while (local[size_class].head) spill(size_class);
+        }
+        destroyed() = true;
+    }
+
+    void* allocate(size_t bytes) {
+        size_t size_class = class_for(sizeof(BlockHeader) + bytes);
+        void* raw;
+        if (size_class != HEAP_CLASS && (local[size_class].head || refill(size_class))) {
+            FreeList& list = local[size_class];
+            FreeBlock* block = list.head;
+            list.head = block->next;
+            list.bytes -= class_bytes(size_class);
+            raw = block;
+        } else {
+            raw = ::operator new(size_class == HEAP_CLASS ? sizeof(BlockHeader) + bytes : class_bytes(size_class));
+        }
+        BlockHeader* header = static_cast<BlockHeader*>(raw);
+        header->size_class = size_class;
+        return header + 1;
+    }
+
+    void release(void* data) {
+        BlockHeader* header = static_cast<BlockHeader*>(data) - 1;
+        size_t size_class = header->size_class;
+        if (size_class == HEAP_CLASS) {
+            ::operator delete(header);
+            return;
+        }
+        FreeList& list = local[size_class];
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(header);
+        block->next = list.head;
+        list.head = block;
+        list.bytes += class_bytes(size_class);
+        if (list.bytes > CACHE_BYTES || list.bytes > LOCAL_BLOCKS * class_bytes(size_class)) spill(size_class);
+    }
+
+    static bool& destroyed() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+private:
+    // Moves up to BATCH blocks from the central list; false if it was empty
+    bool refill(size_t size_class) {
+        CentralList& shared = central[size_class];
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        for (size_t i = 0; i < BATCH && shared.list.head; i++) {
+            FreeBlock* block = shared.list.head;
+            shared.list.head = block->next;
+            shared.list.bytes -= class_bytes(size_class);
+            block->next = local[size_class].head;
+            local[size_class].head = block;
+            local[size_class].bytes += class_bytes(size_class);
+        }
+        return local[size_class].head != nullptr;
+    }
+
+    // Hands up to BATCH blocks to the central list, or to the heap if it is full
+    void spill(size_t size_class) {
+        FreeList batch;
+        FreeBlock* tail = nullptr;
+        FreeList& list = local[size_class];
+        for (size_t i = 0; i < BATCH && list.head; i++) {
+            FreeBlock* block = list.head;
+            list.head = block->next;
+            list.bytes -= class_bytes(size_class);
+            block->next = batch.head;
+            batch.head = block;
+            batch.bytes += class_bytes(size_class);
+            if (!tail) tail = block;
+        }
+        CentralList& shared = central[size_class];
+        {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            if (shared.list.bytes + batch.bytes <= CENTRAL_BYTES) {
+                tail->next = shared.list.head;
+                shared.list.head = batch.head;
+                shared.list.bytes += batch.bytes;
+                return;
+            }
+        }
+        while (batch.head) {
+            FreeBlock* next = batch.head->next;
+            ::operator delete(batch.head);
+            batch.head = next;
+        }
+    }
+
+    FreeList local[CLASS_COUNT];
+};
+
+inline thread_local ThreadCache thread_cache;
+
+inline void* allocate(size_t bytes) {
+    return thread_cache.allocate(bytes);
+}
+
+inline void release(void* data) {
+    // Late frees during thread exit, after the cache is gone, go straight to the heap
+    if (ThreadCache::destroyed()) {
+        ::operator delete(static_cast<BlockHeader*>(data) - 1);
+        return;
+    }
+    thread_cache.release(data);
+}
+
+}  // namespace message_pool
+
+// An outgoing message: immutable bytes in one pooled block with an
+// intrusive reference count. It is formatted once and shared read-only by
+// every recipient's queue, so fanning it out copies a pointer, not the text,
+// and neither building nor dropping it touches the global allocator.
+class Payload {
+public:
+    Payload() = default;
+
+    // Concatenates the parts straight into the block
+    explicit Payload(std::initializer_list<std::string_view> parts) {
+        size_t length = 0;
+        for (std::string_view part : parts) length += part.size();
+        block = static_cast<Block*>(message_pool::allocate(sizeof(Block) + length));
+        new (block) Block{{1}, static_cast<uint32_t>(length)};
+        char* out = text();
+        for (std::string_view part : parts) {
+            memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+    }
+
+    Payload(const Payload& other) noexcept : block(other.block) {
+        if (block) block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    Payload(Payload&& other) noexcept : block(std::exchange(other.block, nullptr)) {}
+    Payload& operator=(Payload other) noexcept {
+        std::swap(block, other.block);
+        return *this;
+    }
+    ~Payload() {
+        if (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            block->~Block();
+            message_pool::release(block);
+        }
+    }
+
+    const char* data() const { return block ? text() : ""; }
+    size_t size() const { return block ? block->size : 0; }
+    std::string_view view() const { return {data(), size()}; }
+    explicit operator bool() const { return block != nullptr; }
+
+private:
+    struct Block {
+        std::atomic<uint32_t> refs;
+        uint32_t size;
+    };
+
+    char* text() const { return reinterpret_cast<char*>(block + 1); }
+
+    Block* block = nullptr;
+};
+
+// FIFO over a power-of-two ring that grows but never shrinks, so a queue
+// that has reached its working size pushes and pops without allocating
+// (std::deque frees and reallocates its chunks as the queue moves along).
+template <typename T>
+class RingQueue {
+public:
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    T& front() { return slots[head]; }
+    T& operator[](size_t index) { return slots[(head + index) & (slots.size() - 1)]; }
+
+    void push_back(T value) {
+        if (count == slots.size()) grow();
+        slots[(head + count) & (slots.size() - 1)] = std::move(value);
+        count++;
+    }
+
+    void push_front(T value) {
+        if (count == slots.size()) grow();
+        head = (head + slots.size() - 1) & (slots.size() - 1);
+        slots[head] = std::move(value);
+        count++;
+    }
+
+    void pop_front() {
+        slots[head] = T();
+        head = (head + 1) & (slots.size() - 1);
+        count--;
+    }
+
+    // Removes the element at index, moving the ones behind it forward
+    void erase(size_t index) {
+        for (size_t i = index; i + 1 < count; i++) {
+            (*this)[i] = std::move((*this)[i + 1]);
+        }
+        (*this)[count - 1] = T();
+        count--;
+    }
+
+private:
+    void grow() {
+        std::vector<T> larger(slots.empty() ? 16 : slots.size() * 2);
+        for (size_t i = 0; i < count; i++) {
+            larger[i] = std::move((*this)[i]);
+        }
+        slots.swap(larger);
+        head = 0;
+    }
+
+    std::vector<T> slots;
+    size_t head = 0;
+    size_t count = 0;
+};
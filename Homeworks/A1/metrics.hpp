@@ -0,0 +1,286 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "command_parser.hpp"
+
+// Server metrics kept per thread and summed only when scraped. Every thread
+// owns a slab of counters and histograms that only it writes: an update is a
+// relaxed load and store of its own cache lines, with no locked instruction
+// and no sharing with other threads. The scraper reads the slabs with relaxed
+// loads, so it never makes the chat threads wait. Slabs register on first
+// use, and a thread that exits folds its slab into the retired totals, so
+// counters never go backwards.
+
+namespace metrics {
+
+// A value written by one thread and read by the scraper. Gauges that go
+// down add the two's complement; the wrapped sum reads back as signed.
+struct Cell {
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void sub(uint64_t n) { add(~n + 1); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Upper bucket bounds (inclusive, Prometheus "le"); a final +Inf bucket is implicit
+inline constexpr uint64_t LATENCY_BOUNDS_NS[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 1000000000};
+inline constexpr uint64_t FANOUT_BOUNDS[] = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536};
+inline constexpr uint64_t QUEUE_BOUNDS_BYTES[] = {
+    64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216};
+
+template <const auto& BOUNDS>
+struct Histogram {
+    static constexpr size_t SIZE = std::size(BOUNDS);
+    Cell buckets[SIZE + 1];
+    Cell sum;
+    Cell count;
+
+    void observe(uint64_t value) {
+        size_t bucket = std::lower_bound(std::begin(BOUNDS), std::end(BOUNDS), value) - std::begin(BOUNDS);
+        buckets[bucket].add(1);
+        sum.add(value);
+        count.add(1);
+    }
+
+    void merge_into(Histogram& total) const {
+        for (size_t i = 0; i <= SIZE; i++) total.buckets[i].add(buckets[i].get());
+        total.sum.add(sum.get());
+        total.count.add(count.get());
+    }
+};
+
+enum class Counter : size_t {
+    ConnectionsAccepted,
+    ConnectionsClosed,
+    AuthSuccess,
+    AuthFailure,
+    AuthTimeout,
+    LoginsPending,  // Gauge: connections still in the login dialogue
+    BytesReceived,
+    BytesSent,
+    SendCalls,       // sendmsg/send calls on client sockets; io_uring: send submissions
+    SendsCoalesced,  // Thread mode: messages queued behind another thread's write to the socket
+    OutboundDropped,
+    SlowDisconnects,
+    IdleEvictions,
+    PingsSent,
+    PresenceUpdates,
+    QueuedBytes,  // Gauge: bytes waiting in reactor outbound queues
+    HeapAllocations,  // Filled in from thread_allocations when a slab is read
+    COUNT
+};
+
+// Global operator new calls made by this thread. The server's operator new
+// counts here rather than in the slab, which it cannot reach without
+// allocating on first use; the slab reads it through a pointer.
+inline thread_local Cell thread_allocations;
+
+enum class Fanout : size_t { Private, Group, Broadcast, COUNT };
+
+constexpr size_t COMMAND_KINDS = static_cast<size_t>(CommandId::ResumeInbox) + 1;
+
+struct ThreadMetrics {
+    Cell counters[static_cast<size_t>(Counter::COUNT)];
+    Cell commands[COMMAND_KINDS];
+    Histogram<LATENCY_BOUNDS_NS> command_latency[COMMAND_KINDS];
+    Histogram<FANOUT_BOUNDS> fanout[static_cast<size_t>(Fanout::COUNT)];
+    Histogram<QUEUE_BOUNDS_BYTES> queue_depth;  // Connection's queued bytes after each enqueue
+    Histogram<LATENCY_BOUNDS_NS> login_latency;  // Accept to successful login
+    Histogram<LATENCY_BOUNDS_NS> fanout_completion;  // Thread mode: a large fan-out, first write to last
+    const Cell* allocations = nullptr;  // The owning thread's thread_allocations
+
+    Cell& operator[](Counter counter) { return counters[static_cast<size_t>(counter)]; }
+    const Cell& operator[](Counter counter) const { return counters[static_cast<size_t>(counter)]; }
+
+    void merge_into(ThreadMetrics& total) const {
+        for (size_t i = 0; i < std::size(counters); i++) total.counters[i].add(counters[i].get());
+        if (allocations) total[Counter::HeapAllocations].add(allocations->get());
+        for (size_t i = 0; i < COMMAND_KINDS; i++) {
+            total.commands[i].add(commands[i].get());
+            command_latency[i].merge_into(total.command_latency[i]);
+        }
+        for (size_t i = 0; i < std::size(fanout); i++) fanout[i].merge_into(total.fanout[i]);
+        queue_depth.merge_into(total.queue_depth);
+        login_latency.merge_into(total.login_latency);
+        fanout_completion.merge_into(total.fanout_completion);
+    }
+};
+
+class Registry {
+public:
+    // The calling thread's slab, registered on first use
+    ThreadMetrics& local() {
+        thread_local Slot slot(*this);
+        return slot.metrics;
+    }
+
+    // Adds up every live slab and the retired totals
+    void collect(ThreadMetrics& total) {
+        std::lock_guard<std::mutex> lock(mutex);
+        retired.merge_into(total);
+        for (const ThreadMetrics* metrics : live) metrics->merge_into(total);
+    }
+
+private:
+    struct Slot {
+        explicit Slot(Registry& registry) : registry(registry) {
+            metrics.allocations = &thread_allocations;
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.live.push_back(&metrics);
+        }
+        ~Slot() {
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            metrics.merge_into(registry.retired);
+            registry.live.erase(std::find(registry.live.begin(), registry.live.end(), &metrics));
+        }
+        Registry& registry;
+        ThreadMetrics metrics;
+    };
+
+    std::mutex mutex;  // Taken when a thread first records or exits, and by the scraper
+    std::vector<const ThreadMetrics*> live;
+    ThreadMetrics retired;
+};
+
+inline Registry registry;
+
+inline ThreadMetrics& local() {
+    return registry.local();
+}
+
+inline void add(Counter counter, uint64_t n = 1) {
+    local()[counter].add(n);
+}
+
+// "msg" for /msg; label value of a command
+inline std::string_view command_label(size_t id) {
+    for (const command_table::Entry& entry : command_table::COMMANDS) {
+        if (static_cast<size_t>(entry.id) == id) return entry.name.substr(1);
+    }
+    return "unknown";
+}
+
+// --- Prometheus text exposition format (version 0.0.4) ---
+
+inline void write_header(std::string& out, std::string_view name, std::string_view type, std::string_view help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+inline void write_sample(std::string& out, std::string_view name, std::string_view labels, const std::string& value) {
+    out.append(name);
+    if (!labels.empty()) out.append("{").append(labels).append("}");
+    out.append(" ").append(value).append("\n");
+}
+
+inline void write_scalar(std::string& out, std::string_view name, std::string_view type, std::string_view help,
+                         const std::string& value) {
+    write_header(out, name, type, help);
+    write_sample(out, name, "", value);
+}
+
+// Shortest form that round-trips well enough for a scrape: "0.0025", "1e-06", "42"
+inline std::string format_number(double value) {
+    std::ostringstream out;
+    out.precision(12);
+    out << value;
+    return out.str();
+}
+
+// Bucket bounds and sums are stored as integers; scale turns them into the
+// exposed unit (1e-9 for nanoseconds to seconds)
+template <const auto& BOUNDS>
+void write_histogram(std::string& out, std::string_view name, const std::string& labels,
+                     const Histogram<BOUNDS>& histogram, double scale) {
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= Histogram<BOUNDS>::SIZE; i++) {
+        cumulative += histogram.buckets[i].get();
+        std::string le = i < Histogram<BOUNDS>::SIZE ? format_number(BOUNDS[i] * scale) : "+Inf";
+        write_sample(out, std::string(name) + "_bucket", prefix + "le=\"" + le + "\"", std::to_string(cumulative));
+    }
+    write_sample(out, std::string(name) + "_sum", labels, format_number(histogram.sum.get() * scale));
+    write_sample(out, std::string(name) + "_count", labels, std::to_string(histogram.count.get()));
+}
+
+inline std::string render(const ThreadMetrics& total) {
+    std::string out;
+    auto counter = [&](Counter id) { return std::to_string(total[id].get()); };
+    write_scalar(out, "chat_connections_accepted_total", "counter", "Client connections accepted.",
+                 counter(Counter::ConnectionsAccepted));
+    write_scalar(out, "chat_connections_open", "gauge", "Client connections currently open.",
+                 std::to_string(static_cast<int64_t>(total[Counter::ConnectionsAccepted].get() -
+                                                     total[Counter::ConnectionsClosed].get())));
+    write_header(out, "chat_auth_total", "counter", "Login attempts by result.");
+    write_sample(out, "chat_auth_total", "result=\"success\"", counter(Counter::AuthSuccess));
+    write_sample(out, "chat_auth_total", "result=\"failure\"", counter(Counter::AuthFailure));
+    write_sample(out, "chat_auth_total", "result=\"timeout\"", counter(Counter::AuthTimeout));
+    write_scalar(out, "chat_logins_pending", "gauge", "Connections that have not finished logging in.",
+                 std::to_string(static_cast<int64_t>(total[Counter::LoginsPending].get())));
+    write_scalar(out, "chat_received_bytes_total", "counter", "Bytes read from client sockets.",
+                 counter(Counter::BytesReceived));
+    write_scalar(out, "chat_sent_bytes_total", "counter", "Bytes written to client sockets.",
+                 counter(Counter::BytesSent));
+    write_scalar(out, "chat_send_calls_total", "counter",
+                 "Writes to client sockets: send/sendmsg calls, or io_uring send submissions.",
+                 counter(Counter::SendCalls));
+    write_scalar(out, "chat_sends_coalesced_total", "counter",
+                 "Thread mode messages queued behind another thread's write to the same socket.",
+                 counter(Counter::SendsCoalesced));
+    write_scalar(out, "chat_outbound_dropped_total", "counter",
+                 "Messages dropped from full reactor outbound queues.", counter(Counter::OutboundDropped));
+    write_scalar(out, "chat_slow_disconnects_total", "counter",
+                 "Connections closed because their outbound queue was full.", counter(Counter::SlowDisconnects));
+    write_scalar(out, "chat_idle_evictions_total", "counter",
+                 "Sessions closed because they did not answer a keepalive ping.", counter(Counter::IdleEvictions));
+    write_scalar(out, "chat_pings_sent_total", "counter", "Keepalive pings sent to idle sessions.",
+                 counter(Counter::PingsSent));
+    write_scalar(out, "chat_presence_updates_total", "counter",
+                 "Batched join/leave deltas broadcast to everyone online.", counter(Counter::PresenceUpdates));
+    write_scalar(out, "chat_outbound_queued_bytes", "gauge", "Bytes waiting in reactor outbound queues.",
+                 std::to_string(static_cast<int64_t>(total[Counter::QueuedBytes].get())));
+    write_scalar(out, "chat_heap_allocations_total", "counter",
+                 "Global operator new calls by threads that record metrics.", counter(Counter::HeapAllocations));
+
+    write_header(out, "chat_commands_total", "counter", "Commands processed by type.");
+    for (size_t i = 0; i < COMMAND_KINDS; i++) {
+        write_sample(out, "chat_commands_total", "command=\"" + std::string(command_label(i)) + "\"",
+                     std::to_string(total.commands[i].get()));
+    }
+    write_header(out, "chat_command_duration_seconds", "histogram",
+                 "Time spent in each command handler, excluding socket writes.");
+    for (size_t i = 0; i < COMMAND_KINDS; i++) {
+        write_histogram(out, "chat_command_duration_seconds", "command=\"" + std::string(command_label(i)) + "\"",
+                        total.command_latency[i], 1e-9);
+    }
+    write_header(out, "chat_fanout_recipients", "histogram", "Recipients per delivered message by kind.");
+    const char* kinds[] = {"private", "group", "broadcast"};
+    for (size_t i = 0; i < std::size(kinds); i++) {
+        write_histogram(out, "chat_fanout_recipients", std::string("kind=\"") + kinds[i] + "\"", total.fanout[i], 1);
+    }
+    write_header(out, "chat_outbound_queue_depth_bytes", "histogram",
+                 "Bytes queued on a reactor connection after each enqueued message.");
+    write_histogram(out, "chat_outbound_queue_depth_bytes", "", total.queue_depth, 1);
+    write_header(out, "chat_login_duration_seconds", "histogram",
+                 "Time from accepting a connection to its successful login.");
+    write_histogram(out, "chat_login_duration_seconds", "", total.login_latency, 1e-9);
+    write_header(out, "chat_fanout_completion_seconds", "histogram",
+                 "Time to write a thread-mode fan-out of at least --fanout-threshold recipients to all of them.");
+    write_histogram(out, "chat_fanout_completion_seconds", "", total.fanout_completion, 1e-9);
+    return out;
+}
+
+}  // namespace metrics
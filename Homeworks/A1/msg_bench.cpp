@@ -0,0 +1,231 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+// Measures /msg delivery latency while the number of idle online sessions grows.
+// The sender and recipient stay the same for every level, so if private message
+// routing is independent of the number of online users the latency stays flat.
+// allocs_per_msg is the server's heap allocation count (summed over the
+// heap_allocations= fields of /stats) across the measured messages divided by
+// their number, less what one /stats request allocates itself (measured with
+// two requests back to back); the steady-state message path should make none.
+//
+// Usage: ./msg_bench [--port N] [--sessions 0,1000,4000] [--iterations N]
+
+#define BUFFER_SIZE 4096
+
+int server_port = 12345;
+std::vector<int> session_levels = {0, 1000, 4000};
+int iterations = 2000;
+
+// Idle sessions log in as these users; alice sends and bob receives
+std::vector<std::pair<std::string, std::string>> idle_users = {
+    {"charlie", "secure789"},
+    {"david", "helloWorld!"},
+    {"eve", "trustno1"},
+    {"frank", "letmein"},
+    {"grace", "passw0rd"}
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Connects and logs in using the line protocol; returns the socket or -1
+int login(const std::string& username, const std::string& password) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    std::string request = "/protocol line\n" + username + "\n" + password + "\n";
+    if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        close(sock);
+        return -1;
+    }
+    // Wait for the login result so the session is online before it is counted
+    std::string reply;
+    char buffer[BUFFER_SIZE];
+    while (reply.find("Welcome") == std::string::npos) {
+        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n <= 0 || reply.find("Authentication failed") != std::string::npos) {
+            close(sock);
+            return -1;
+        }
+        reply.append(buffer, n);
+    }
+    return sock;
+}
+
+// Asks the server for /stats on sock and returns the sum of its
+// heap_allocations= counters, or -1 if the reply does not arrive
+long long heap_allocations(int sock) {
+    const std::string request = "/stats\n";
+    if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        return -1;
+    }
+    const std::string field = "heap_allocations=";
+    std::string reply;
+    char buffer[BUFFER_SIZE];
+    while (reply.find(field) == std::string::npos || reply.back() != '\n') {
+        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        reply.append(buffer, n);
+    }
+    long long total = 0;
+    for (size_t pos = reply.find(field); pos != std::string::npos; pos = reply.find(field, pos + 1)) {
+        total += std::atoll(reply.c_str() + pos + field.size());
+    }
+    return total;
+}
+
+// Reads and discards everything sent to idle sessions (join notices, rosters)
+// so that the server never blocks on them
+void drain_loop(int epoll_fd, std::atomic<bool>& running) {
+    epoll_event events[64];
+    char buffer[BUFFER_SIZE];
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, 64, 100);
+        for (int i = 0; i < n; i++) {
+            while (recv(events[i].data.fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+            }
+        }
+    }
+}
+
+void parse_args(int argc, char* argv[]) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--port") {
+            server_port = std::stoi(value);
+        } else if (option == "--iterations") {
+            iterations = std::stoi(value);
+        } else if (option == "--sessions") {
+            session_levels.clear();
+            size_t start = 0;
+            while (start <= value.size()) {
+                size_t comma = value.find(',', start);
+                if (comma == std::string::npos) comma = value.size();
+                session_levels.push_back(std::stoi(value.substr(start, comma - start)));
+                start = comma + 1;
+            }
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    parse_args(argc, argv);
+
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    std::atomic<bool> running{true};
+    std::thread drainer(drain_loop, epoll_fd, std::ref(running));
+
+    int sender = login("alice", "password123");
+    int recipient = login("bob", "qwerty456");
+    if (sender < 0 || recipient < 0) {
+        std::cerr << "Failed to log in alice/bob on port " << server_port << std::endl;
+        return 1;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = sender;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sender, &ev);
+
+    std::vector<int> idle_sockets;
+    std::string pending;  // bytes received by bob but not yet matched
+    char buffer[BUFFER_SIZE];
+
+    std::cout << std::setw(10) << "sessions" << std::setw(12) << "mean_us"
+              << std::setw(12) << "p50_us" << std::setw(12) << "p99_us"
+              << std::setw(16) << "allocs_per_msg" << std::endl;
+
+    for (int level : session_levels) {
+        while ((int)idle_sockets.size() < level) {
+            const auto& [user, password] = idle_users[idle_sockets.size() % idle_users.size()];
+            int sock = login(user, password);
+            if (sock < 0) {
+                std::cerr << "Login failed after " << idle_sockets.size() << " idle sessions" << std::endl;
+                running = false;
+                drainer.join();
+                return 1;
+            }
+            ev.data.fd = sock;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+            idle_sockets.push_back(sock);
+        }
+        // Let the join notices settle before measuring
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        while (recv(recipient, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+        }
+        pending.clear();
+        long long allocations_first = heap_allocations(recipient);
+        long long allocations_before = heap_allocations(recipient);
+        long long stats_cost = allocations_before - allocations_first;
+
+        std::vector<double> latencies;
+        latencies.reserve(iterations);
+        for (int i = 0; i < iterations; i++) {
+            std::string expected = "[alice]: ping " + std::to_string(i) + "\n";
+            std::string command = "/msg bob ping " + std::to_string(i) + "\n";
+            auto start = Clock::now();
+            send(sender, command.data(), command.size(), MSG_NOSIGNAL);
+            size_t found;
+            while ((found = pending.find(expected)) == std::string::npos) {
+                ssize_t n = recv(recipient, buffer, sizeof(buffer), 0);
+                if (n <= 0) {
+                    std::cerr << "Recipient disconnected" << std::endl;
+                    return 1;
+                }
+                pending.append(buffer, n);
+            }
+            latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+            pending.erase(0, found + expected.size());
+        }
+        long long allocations_after = heap_allocations(recipient);
+
+        std::sort(latencies.begin(), latencies.end());
+        double total = 0;
+        for (double latency : latencies) total += latency;
+        std::cout << std::setw(10) << idle_sockets.size() + 2 << std::fixed << std::setprecision(1)
+                  << std::setw(12) << total / latencies.size()
+                  << std::setw(12) << latencies[latencies.size() / 2]
+                  << std::setw(12) << latencies[latencies.size() * 99 / 100] << std::setprecision(3)
+                  << std::setw(16) << (double)(allocations_after - allocations_before - stats_cost) / iterations << std::endl;
+    }
+
+    running = false;
+    drainer.join();
+    for (int sock : idle_sockets) close(sock);
+    close(sender);
+    close(recipient);
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,476 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bounded store for private messages to users who are offline, handed over
+// in one piece when the user next logs in.
+//
+// A user's queue is one buffer of the formatted lines, back to back, and an
+// 8-byte entry (length, expiry) per message. A queued message costs its text
+// and those 8 bytes; nothing is allocated per message, and a drain sends the
+// buffer as it is.
+//
+// All queues together are held to a memory budget. Past it, a user's new
+// messages go to a spill file of their own, <dir>/<hex name>.spill, each
+// line prefixed with its expiry. Once a user has spilled, the rest of their
+// messages follow into the file to keep them in order, and a drain sends the
+// buffer and then the file. Without a spill directory the budget is a hard
+// limit. A sweeper thread drops expired messages from memory, and whole
+// spill files once their newest message has expired; a drain skips the rest.
+//
+// Spilling does no I/O on the caller's thread: push() appends the line to
+// the queue's spill buffer, and a writer thread appends each buffer to its
+// file with the inbox unlocked. Buffered spill lines are bounded by
+// SPILL_BUFFER_BYTES; past it pushes are refused until the disk catches up.
+// A login's take() does no I/O either: it hands over the file's path and
+// the lines not yet written, and collect() waits for a write still in
+// flight before it reads the file.
+//
+// Queues live in memory and do not survive a restart; leftover spill files
+// are deleted on open. With the message log enabled, /resume_inbox still
+// finds the messages.
+
+namespace offline_inbox {
+
+// Most messages queued for one user, in memory and spilled together
+constexpr size_t MAX_MESSAGES_PER_USER = 10000;
+// Fixed cost of a user's queue: map node and bucket, and the heap blocks'
+// headers and rounding (measured with inbox_bench, one message per user)
+constexpr size_t QUEUE_OVERHEAD = 192;
+constexpr int SWEEP_SECONDS = 60;
+// Spilled lines start with the expiry as fixed-width digits and a space
+constexpr size_t EXPIRY_DIGITS = 10;
+// Spill lines waiting for the writer thread, over all users
+constexpr size_t SPILL_BUFFER_BYTES = 16 << 20;
+// Users the writer takes per round, so it holds the lock only briefly
+constexpr size_t SPILL_ROUND_USERS = 256;
+
+enum class Result { Queued, Spilled, Full };
+
+// A user's messages, taken out of the inbox at login
+struct Batch {
+    std::string text;          // The messages in memory, oldest first
+    std::string spill_path;    // The user's spill file; read and removed by collect()
+    std::string unwritten;     // Spill lines the writer had not taken yet, after the file's
+    uint64_t write_round = 0;  // Writer round that collect() waits for; 0 for none
+    size_t messages = 0;
+};
+
+class Inbox {
+public:
+    Inbox() = default;
+    Inbox(const Inbox&) = delete;
+    Inbox& operator=(const Inbox&) = delete;
+
+    // Lets the writer finish the spill lines buffered so far and joins it
+    ~Inbox() {
+        if (!writer.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        spill_wakeup.notify_one();
+        writer.join();
+    }
+
+    // Starts the sweeper. An empty spill_directory disables spilling. False
+    // with a reason if the directory cannot be used.
+    bool open(size_t memory_limit_bytes, int ttl_seconds, const std::string& spill_directory, std::string& error) {
+        memory_limit = memory_limit_bytes;
+        ttl = static_cast<uint32_t>(ttl_seconds);
+        directory = spill_directory;
+        if (!directory.empty()) {
+            if (mkdir(directory.c_str(), 0700) < 0 && errno != EEXIST) {
+                error = "cannot create " + directory + ": " + strerror(errno);
+                return false;
+            }
+            DIR* dir = opendir(directory.c_str());
+            if (!dir) {
+                error = "cannot read " + directory + ": " + strerror(errno);
+                return false;
+            }
+            // Spill files of an earlier run; their queues went with its memory
+            while (dirent* entry = readdir(dir)) {
+                std::string_view name = entry->d_name;
+                if (name.size() > 6 && name.substr(name.size() - 6) == ".spill") {
+                    unlinkat(dirfd(dir), entry->d_name, 0);
+                }
+            }
+            closedir(dir);
+        }
+        epoch = std::chrono::steady_clock::now();
+        active = true;
+        std::thread([this] { run(); }).detach();
+        if (!directory.empty()) writer = std::thread([this] { write_spills(); });
+        return true;
+    }
+
+    bool enabled() const { return active; }
+
+    // Queues line, a complete message ending in a newline, for username
+    Result push(std::string_view username, std::string_view line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = queues.find(username);
+        if (it == queues.end()) {
+            it = queues.emplace(std::string(username), Queue{}).first;
+            memory.fetch_add(footprint(it->second) + QUEUE_OVERHEAD, std::memory_order_relaxed);
+        }
+        Queue& queue = it->second;
+        uint32_t expires = now() + ttl;
+        if (queue.entries.size() - queue.first + queue.spilled >= MAX_MESSAGES_PER_USER) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return Result::Full;
+        }
+        if (queue.spilled == 0 &&
+            memory.load(std::memory_order_relaxed) + line.size() + sizeof(Entry) <= memory_limit) {
+            size_t before = footprint(queue);
+            queue.text.append(line);
+            queue.entries.push_back({static_cast<uint32_t>(line.size()), expires});
+            resize(before, footprint(queue));
+            messages.fetch_add(1, std::memory_order_relaxed);
+            return Result::Queued;
+        }
+        if (!directory.empty() && spill_buffered + EXPIRY_DIGITS + 1 + line.size() <= SPILL_BUFFER_BYTES) {
+            spill(it->first, queue, line, expires);
+            return Result::Spilled;
+        }
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        if (empty(queue)) erase(it);
+        return Result::Full;
+    }
+
+    // Removes username's queue; the spill file, if any, is left for
+    // collect(), which does the file I/O outside the caller's locks
+    Batch take(std::string_view username) {
+        Batch batch;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = queues.find(username);
+        if (it == queues.end()) return batch;
+        Queue& queue = it->second;
+        expire(username, queue, now());
+        memory.fetch_sub(footprint(queue) + QUEUE_OVERHEAD, std::memory_order_relaxed);
+        batch.messages = queue.entries.size() - queue.first;
+        batch.text = std::move(queue.text);
+        batch.text.erase(0, queue.head);
+        if (queue.spilled > 0) {
+            batch.spill_path = spill_path(username);
+            batch.unwritten = std::move(queue.spill_buffer);
+            batch.write_round = queue.write_round;
+            spill_buffered -= batch.unwritten.size();
+            messages.fetch_sub(queue.spilled, std::memory_order_relaxed);
+        }
+        messages.fetch_sub(batch.messages, std::memory_order_relaxed);
+        queues.erase(it);
+        return batch;
+    }
+
+    // Appends the batch's unexpired spilled messages to its text; returns
+    // the number of messages the batch holds
+    size_t collect(Batch& batch) {
+        if (batch.messages == 0 && batch.spill_path.empty()) return 0;
+        if (!batch.spill_path.empty()) {
+            if (batch.write_round > 0) {
+                // The writer was appending to the file when the queue was taken
+                std::unique_lock<std::mutex> lock(mutex);
+                spill_written.wait(lock, [&] { return finished_round >= batch.write_round; });
+            }
+            std::string spilled;
+            int fd = ::open(batch.spill_path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info{};
+            if (fd >= 0 && fstat(fd, &info) == 0) spilled.resize(info.st_size);
+            size_t length = 0;
+            while (fd >= 0 && length < spilled.size()) {
+                ssize_t got = read(fd, spilled.data() + length, spilled.size() - length);
+                if (got <= 0) break;
+                length += got;
+            }
+            if (fd >= 0) ::close(fd);
+            unlink(batch.spill_path.c_str());
+            batch.spill_path.clear();
+            spilled.resize(length);
+            spilled.append(batch.unwritten);
+            length = spilled.size();
+            batch.unwritten = std::string();
+            uint32_t current = now();
+            batch.text.reserve(batch.text.size() + length);
+            const char* line = spilled.data();
+            const char* end = line + length;
+            while (const char* newline = static_cast<const char*>(memchr(line, '\n', end - line))) {
+                uint32_t expires = 0;
+                const char* digits = line;
+                for (; digits < line + EXPIRY_DIGITS && digits < newline; digits++) {
+                    expires = expires * 10 + (*digits - '0');
+                }
+                if (newline - line > static_cast<ptrdiff_t>(EXPIRY_DIGITS) && expires > current) {
+                    batch.text.append(line + EXPIRY_DIGITS + 1, newline + 1);
+                    batch.messages++;
+                } else {
+                    expired.fetch_add(1, std::memory_order_relaxed);
+                }
+                line = newline + 1;
+            }
+        }
+        delivered.fetch_add(batch.messages, std::memory_order_relaxed);
+        return batch.messages;
+    }
+
+    // Bytes held in memory, as counted against the budget
+    size_t memory_used() const { return memory.load(std::memory_order_relaxed); }
+
+    std::atomic<size_t> messages{0};  // Queued now, in memory or spilled
+    std::atomic<uint64_t> spilled{0};
+    std::atomic<uint64_t> expired{0};
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> rejected{0};  // Refused: the user's queue or the budget was full
+    std::atomic<uint64_t> errors{0};    // Spill file writes that failed; their messages are lost
+
+private:
+    struct Entry {
+        uint32_t length;
+        uint32_t expires;  // Seconds since epoch
+    };
+
+    struct Queue {
+        std::string text;            // Messages from head on; bytes before head have expired
+        size_t head = 0;
+        std::vector<Entry> entries;  // From first on
+        size_t first = 0;
+        size_t spilled = 0;          // Messages in the spill file or its buffer, all newer than these
+        uint32_t spill_expires = 0;  // Expiry of the newest spilled message
+        std::string spill_buffer;    // Spill lines the writer has not taken yet
+        size_t buffered = 0;         // Messages in spill_buffer
+        uint64_t write_round = 0;    // Writer round appending to the file; 0 for none
+    };
+
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+    };
+    using QueueMap = std::unordered_map<std::string, Queue, NameHash, std::equal_to<>>;
+
+    uint32_t now() const {
+        return static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - epoch).count());
+    }
+
+    static size_t footprint(const Queue& queue) {
+        return queue.text.capacity() + queue.entries.capacity() * sizeof(Entry);
+    }
+
+    static bool empty(const Queue& queue) { return queue.first == queue.entries.size() && queue.spilled == 0; }
+
+    void resize(size_t before, size_t after) {
+        if (after >= before) {
+            memory.fetch_add(after - before, std::memory_order_relaxed);
+        } else {
+            memory.fetch_sub(before - after, std::memory_order_relaxed);
+        }
+    }
+
+    void erase(QueueMap::iterator it) {
+        memory.fetch_sub(footprint(it->second) + QUEUE_OVERHEAD, std::memory_order_relaxed);
+        queues.erase(it);
+    }
+
+    // Drops expired messages from the front of the queue, where the oldest
+    // are; a spill file goes once its newest message has expired
+    void expire(std::string_view username, Queue& queue, uint32_t current) {
+        size_t before = footprint(queue);
+        size_t dropped = 0;
+        while (queue.first < queue.entries.size() && queue.entries[queue.first].expires <= current) {
+            queue.head += queue.entries[queue.first].length;
+            queue.first++;
+            dropped++;
+        }
+        if (queue.first == queue.entries.size()) {
+            queue.text = std::string();
+            queue.entries = std::vector<Entry>();
+            queue.head = queue.first = 0;
+        } else if (queue.head > queue.text.size() / 2) {
+            queue.text.erase(0, queue.head);
+            queue.entries.erase(queue.entries.begin(), queue.entries.begin() + queue.first);
+            queue.text.shrink_to_fit();
+            queue.entries.shrink_to_fit();
+            queue.head = queue.first = 0;
+        }
+        // Not while the writer is appending to the file; the next sweep gets it
+        if (queue.spilled > 0 && queue.spill_expires <= current && queue.write_round == 0) {
+            unlink(spill_path(username).c_str());
+            dropped += queue.spilled;
+            queue.spilled = 0;
+            spill_buffered -= queue.spill_buffer.size();
+            queue.spill_buffer = std::string();
+            queue.buffered = 0;
+        }
+        resize(before, footprint(queue));
+        messages.fetch_sub(dropped, std::memory_order_relaxed);
+        expired.fetch_add(dropped, std::memory_order_relaxed);
+    }
+
+    // Queues line for the writer thread, behind the user's earlier spills
+    void spill(const std::string& username, Queue& queue, std::string_view line, uint32_t expires) {
+        char prefix[EXPIRY_DIGITS + 2];
+        snprintf(prefix, sizeof(prefix), "%010u ", expires);
+        if (queue.spill_buffer.empty()) {
+            spill_dirty.push_back(username);
+            if (writer_idle) {
+                writer_idle = false;
+                spill_wakeup.notify_one();
+            }
+        }
+        queue.spill_buffer.append(prefix, EXPIRY_DIGITS + 1);
+        queue.spill_buffer.append(line);
+        spill_buffered += EXPIRY_DIGITS + 1 + line.size();
+        queue.buffered++;
+        queue.spilled++;
+        queue.spill_expires = expires;
+        messages.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::string spill_path(std::string_view username) const {
+        static const char digits[] = "0123456789abcdef";
+        std::string path = directory + "/";
+        for (unsigned char c : username) {
+            path += digits[c >> 4];
+            path += digits[c & 15];
+        }
+        return path + ".spill";
+    }
+
+    struct SpillWrite {
+        std::string username;
+        std::string lines;
+        size_t messages;
+        bool written = false;
+    };
+
+    // Writer thread: appends the buffered spill lines of each user to their
+    // file, one round at a time, with the inbox unlocked
+    void write_spills() {
+        std::vector<std::string> names;
+        std::vector<SpillWrite> round;
+        while (true) {
+            uint64_t current_round;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                writer_idle = spill_dirty.empty();
+                spill_wakeup.wait(lock, [this] { return stopping || !spill_dirty.empty(); });
+                if (spill_dirty.empty()) return;
+                writer_idle = false;
+                size_t taken = std::min(spill_dirty.size(), SPILL_ROUND_USERS);
+                names.assign(std::make_move_iterator(spill_dirty.begin()),
+                             std::make_move_iterator(spill_dirty.begin() + taken));
+                spill_dirty.erase(spill_dirty.begin(), spill_dirty.begin() + taken);
+                current_round = ++started_round;
+                for (const std::string& name : names) {
+                    auto it = queues.find(name);
+                    // Taken or expired since; the lines went with it
+                    if (it == queues.end() || it->second.spill_buffer.empty()) continue;
+                    Queue& queue = it->second;
+                    round.push_back({name, std::move(queue.spill_buffer), queue.buffered});
+                    queue.spill_buffer = std::string();
+                    queue.buffered = 0;
+                    queue.write_round = current_round;
+                }
+                names.clear();
+            }
+            for (SpillWrite& write : round) write.written = append_spill(write);
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const SpillWrite& write : round) {
+                spill_buffered -= write.lines.size();
+                if (write.written) spilled.fetch_add(write.messages, std::memory_order_relaxed);
+                auto it = queues.find(write.username);
+                if (it == queues.end() || it->second.write_round != current_round) continue;
+                Queue& queue = it->second;
+                queue.write_round = 0;
+                if (!write.written) {
+                    queue.spilled -= write.messages;
+                    messages.fetch_sub(write.messages, std::memory_order_relaxed);
+                }
+            }
+            round.clear();
+            finished_round = current_round;
+            spill_written.notify_all();
+        }
+    }
+
+    bool append_spill(const SpillWrite& write) {
+        int fd = ::open(spill_path(write.username).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        struct stat info{};
+        fstat(fd, &info);
+        size_t offset = 0;
+        while (offset < write.lines.size()) {
+            ssize_t written = ::write(fd, write.lines.data() + offset, write.lines.size() - offset);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) break;
+            offset += written;
+        }
+        if (offset < write.lines.size()) {
+            // Cuts off a torn line, so the next one starts a line of its own
+            if (ftruncate(fd, info.st_size) < 0) errors.fetch_add(1, std::memory_order_relaxed);
+            ::close(fd);
+            errors.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        ::close(fd);
+        return true;
+    }
+
+    void run() {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(SWEEP_SECONDS));
+            std::lock_guard<std::mutex> lock(mutex);
+            uint32_t current = now();
+            for (auto it = queues.begin(); it != queues.end();) {
+                expire(it->first, it->second, current);
+                if (empty(it->second)) {
+                    memory.fetch_sub(footprint(it->second) + QUEUE_OVERHEAD, std::memory_order_relaxed);
+                    it = queues.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    bool active = false;
+    size_t memory_limit = 0;
+    uint32_t ttl = 0;
+    std::string directory;
+    std::chrono::steady_clock::time_point epoch;
+    std::atomic<size_t> memory{0};
+    std::mutex mutex;  // The queues, the spill buffers and the writer's rounds
+    QueueMap queues;
+    std::thread writer;
+    std::condition_variable spill_wakeup;
+    std::condition_variable spill_written;
+    bool writer_idle = false;
+    bool stopping = false;
+    std::vector<std::string> spill_dirty;  // Users with lines in their spill buffer
+    size_t spill_buffered = 0;             // Bytes buffered or being written, over all users
+    uint64_t started_round = 0;
+    uint64_t finished_round = 0;
+};
+
+}  // namespace offline_inbox
@@ -0,0 +1,136 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "command_parser.hpp"
+
+// Single-core throughput of turning a received line into a dispatched
+// command with its arguments, before and after the string_view parser:
+//   before: split() into a vector<string> through istringstream, an if/else
+//           chain over the first token, then the handler's own find/substr
+//           reparse and find_first_of trimming
+//   after:  parse_command() (views only) and the compile-time perfect hash
+//
+// Usage: ./parse_bench [iterations]
+
+using Clock = std::chrono::steady_clock;
+
+const std::vector<std::string> workload = {
+    "/msg bob Hello there, how are you doing today?",
+    "/group_msg TestGroup Test message for everyone in the group",
+    "/broadcast Hello everyone!",
+    "/join_group TestGroup",
+    "/leave_group TestGroup",
+    "/create_group TestGroup",
+    "/group_msg TestGroup another one",
+    "/stats",
+    "/bogus command",
+};
+
+// --- Previous implementation, kept here as the baseline ---
+std::vector<std::string> split(const std::string& s) {
+    std::istringstream iss(s);
+    std::vector<std::string> tokens;
+    std::string token;
+    while (iss >> token) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+size_t legacy_two_args(const std::string& message) {
+    size_t space1 = message.find(' ');
+    size_t space2 = message.find(' ', space1 + 1);
+    if (space1 == std::string::npos || space2 == std::string::npos) return 0;
+    std::string target = message.substr(space1 + 1, space2 - space1 - 1);
+    target = target.substr(0, target.find_first_of("\r\n\0"));
+    std::string text = message.substr(space2 + 1);
+    text = text.substr(0, text.find_first_of("\r\n\0"));
+    return target.size() + text.size();
+}
+
+size_t legacy_one_arg(const std::string& message) {
+    size_t space = message.find(' ');
+    if (space == std::string::npos) return 0;
+    std::string name = message.substr(space + 1);
+    name = name.substr(0, name.find_first_of("\r\n\0"));
+    return name.size();
+}
+
+size_t legacy_dispatch(const std::string& message) {
+    std::vector<std::string> tokens = split(message);
+    if (tokens.empty()) return 0;
+    if (tokens[0] == "/msg") {
+        return 1 + legacy_two_args(message);
+    } else if (tokens[0] == "/broadcast") {
+        return 2 + message.substr(11).size();
+    } else if (tokens[0] == "/create_group") {
+        return 3 + legacy_one_arg(message);
+    } else if (tokens[0] == "/join_group") {
+        return 4 + legacy_one_arg(message);
+    } else if (tokens[0] == "/leave_group") {
+        return 5 + legacy_one_arg(message);
+    } else if (tokens[0] == "/group_msg") {
+        return 6 + legacy_two_args(message);
+    } else if (tokens[0] == "/stats") {
+        return 7;
+    }
+    return 0;
+}
+
+// --- Current implementation ---
+size_t view_dispatch(const std::string& message) {
+    CommandArgs args;
+    CommandId command = parse_command(message, args);
+    size_t id = static_cast<size_t>(command);
+    switch (command) {
+    case CommandId::PrivateMessage:
+    case CommandId::GroupMessage:
+    case CommandId::ResumeGroup:
+        return args.has_text ? id + args.target.size() + args.text.size() : id;
+    case CommandId::Broadcast:
+    case CommandId::CreateGroup:
+    case CommandId::JoinGroup:
+    case CommandId::LeaveGroup:
+    case CommandId::ResumeInbox:
+        return id + args.rest.size();
+    case CommandId::Stats:
+    case CommandId::Pong:
+        return id;
+    case CommandId::Unknown:
+        return 0;
+    }
+    return 0;
+}
+
+template <typename Dispatch>
+double commands_per_second(Dispatch dispatch, long iterations, size_t& checksum) {
+    auto start = Clock::now();
+    for (long i = 0; i < iterations; i++) {
+        checksum += dispatch(workload[i % workload.size()]);
+    }
+    return iterations / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? std::atol(argv[1]) : 2000000;
+    size_t legacy_sum = 0;
+    size_t view_sum = 0;
+    double before = commands_per_second(legacy_dispatch, iterations, legacy_sum);
+    double after = commands_per_second(view_dispatch, iterations, view_sum);
+
+    std::cout << std::fixed << std::setprecision(0)
+              << "split + if/else:            " << std::setw(10) << before << " commands/s\n"
+              << "string_view + perfect hash: " << std::setw(10) << after << " commands/s\n"
+              << std::setprecision(1) << "speedup: " << after / before << "x" << std::endl;
+    // Both paths extract the same arguments, so the checksums must agree
+    if (legacy_sum != view_sum) {
+        std::cerr << "Checksum mismatch: " << legacy_sum << " != " << view_sum << std::endl;
+        return 1;
+    }
+    return 0;
+}
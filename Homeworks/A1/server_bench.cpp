@@ -0,0 +1,616 @@
+// Microbenchmarks of server_grp.cpp hot paths, run in-process against the
+// server's own functions (the file is included with its main() left out).
+// Sockets are AF_UNIX socket pairs: the server writes to one end exactly as
+// it writes to a client, and the other end is drained between timed chunks.
+// The server runs in thread mode (no reactor shards) with logging off,
+// except in the logger cases.
+//
+//   parse:       parse_command(), the successor of split() + if/else
+//   dispatch:    processClientMessage() for /msg, by user count and length
+//   group_fanout: processGroupMessage() by group size, against the shared
+//                registry and against one shard's OwnedGroups (--groups owned)
+//   fanout_completion: time until a group message has been written to every
+//                member of a large group, by the sending thread alone
+//                (--fanout-threshold 0) and split over the fan-out pool
+//   logger:      LOG_INFO() call cost on the logging thread, by length
+//   load_users:  load_users() by user file size
+//   user_index:  mapping a compiled index by user count, and a login lookup
+//                with and without the default password hashing cost
+//   timer_wheel: re-arming one of 100k armed timers (what input on a
+//                connection costs), and one wheel tick with 100k armed
+//   message_log: appending a group message to the log, what --log-dir adds
+//                to every group and private message; the commit itself
+//                runs on the log's own thread
+//
+// Every case reports the fastest of REPEATS timed runs, in ns and heap
+// allocations per operation; interference on a shared machine only ever
+// adds time, so the minimum is far more repeatable than the mean. Each run
+// is also divided by a fixed arithmetic loop timed right before it, which
+// cancels out CPU frequency changes between runs; regressions are judged on
+// that relative cost. --save writes the results as a baseline and --compare
+// flags cases slower than the baseline by more than --threshold percent, or
+// allocating more, and exits with status 1 if there are any. --runs repeats
+// the suite and keeps every case's best run.
+//
+// Usage: ./server_bench [--filter TEXT] [--runs N] [--save FILE] [--compare FILE] [--threshold PERCENT]
+
+#define SERVER_GRP_NO_MAIN
+#include "server_grp.cpp"
+
+#include <iomanip>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <sys/socket.h>
+
+#define REPEATS 9
+#define RUN_SECONDS 0.02  // Timed work per repeat
+#define CONFIRM_RUNS 3    // Extra measurements of a case that looks slower than its baseline
+#define REFERENCE_STEPS 20000
+
+using BenchClock = std::chrono::steady_clock;
+
+struct BenchResult {
+    std::string name;
+    double ns_per_op;
+    double allocs_per_op;
+    double relative;  // ns_per_op in units of the reference loop
+};
+
+struct BenchOptions {
+    std::string filter;
+    std::string save_file;
+    std::string compare_file;
+    double threshold = 10;
+    int runs = 1;
+};
+BenchOptions options;
+
+// The Logger writes to stdout and stderr, which point at /dev/null while the
+// benchmarks run; results go to the original stdout
+int report_fd = -1;
+
+void report(const std::string& text) {
+    size_t offset = 0;
+    while (offset < text.size()) {
+        ssize_t written = write(report_fd, text.data() + offset, text.size() - offset);
+        if (written <= 0) return;
+        offset += written;
+    }
+}
+
+// Nanoseconds per step of a dependent multiply-add chain: pure CPU work
+// whose cost only changes with the clock speed
+double reference_ns() {
+    static volatile uint64_t seed = 1;
+    double best = 1e9;
+    for (int attempt = 0; attempt < 3; attempt++) {
+        uint64_t x = seed;
+        auto start = BenchClock::now();
+        for (int i = 0; i < REFERENCE_STEPS; i++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        double ns = std::chrono::duration<double, std::nano>(BenchClock::now() - start).count();
+        seed = x;
+        best = std::min(best, ns / REFERENCE_STEPS);
+    }
+    return best;
+}
+
+// Runs op in chunks of chunk_ops calls with between() untimed after every
+// chunk; the result is the fastest of REPEATS runs of about RUN_SECONDS, or
+// max_chunks chunks when between() itself takes long
+template <typename Op, typename Between>
+BenchResult measure(const std::string& name, size_t chunk_ops, Op&& op, Between&& between,
+                    size_t max_chunks = SIZE_MAX) {
+    // Calibration run, also warming caches and pools
+    auto start = BenchClock::now();
+    for (size_t i = 0; i < chunk_ops; i++) op();
+    double estimate = std::chrono::duration<double>(BenchClock::now() - start).count() / chunk_ops;
+    between();
+    size_t chunks = std::max<size_t>(1, static_cast<size_t>(RUN_SECONDS / std::max(estimate, 1e-9) / chunk_ops));
+    chunks = std::min(chunks, max_chunks);
+
+    std::vector<double> ns(REPEATS);
+    std::vector<double> allocs(REPEATS);
+    std::vector<double> relative(REPEATS);
+    for (int repeat = 0; repeat < REPEATS; repeat++) {
+        double reference = reference_ns();
+        BenchClock::duration elapsed{};
+        uint64_t allocations = 0;
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            uint64_t before = metrics::thread_allocations.get();
+            auto chunk_start = BenchClock::now();
+            for (size_t i = 0; i < chunk_ops; i++) op();
+            elapsed += BenchClock::now() - chunk_start;
+            allocations += metrics::thread_allocations.get() - before;
+            between();
+        }
+        double ops = static_cast<double>(chunks * chunk_ops);
+        ns[repeat] = std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+        allocs[repeat] = allocations / ops;
+        relative[repeat] = ns[repeat] / reference;
+    }
+    return {name, *std::min_element(ns.begin(), ns.end()), *std::min_element(allocs.begin(), allocs.end()),
+            *std::min_element(relative.begin(), relative.end())};
+}
+
+// Server-side ends write like client sockets; peer ends are read by the benchmark
+struct SocketPairs {
+    std::vector<int> server_ends;
+    std::vector<int> peer_ends;
+
+    explicit SocketPairs(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+                perror("socketpair");
+                exit(1);
+            }
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+            server_ends.push_back(fds[0]);
+            peer_ends.push_back(fds[1]);
+        }
+    }
+    ~SocketPairs() {
+        for (int fd : server_ends) close(fd);
+        for (int fd : peer_ends) close(fd);
+    }
+
+    void drain() {
+        char buffer[65536];
+        for (int fd : peer_ends) {
+            while (recv(fd, buffer, sizeof(buffer), 0) > 0) {}
+        }
+    }
+};
+
+// Commands between drains, so that no socket buffer fills up and makes
+// write_message() wait for the reader
+size_t chunk_for(size_t message_length) {
+    return std::clamp<size_t>(65536 / (message_length + 512), 1, 64);
+}
+
+std::string text_of(size_t length) {
+    std::string text(length, 'x');
+    for (size_t i = 0; i < length; i += 7) text[i] = ' ';
+    return text;
+}
+
+// A benchmark case sets up its own state, so it can be run again on its own
+struct BenchCase {
+    std::string name;
+    std::function<BenchResult(const std::string& name)> run;
+};
+
+void add_parse_cases(std::vector<BenchCase>& cases) {
+    for (size_t length : {16, 256, 4096}) {
+        cases.push_back({"parse/len=" + std::to_string(length), [length](const std::string& name) {
+            std::string command = "/group_msg TestGroup " + text_of(length);
+            size_t checksum = 0;
+            BenchResult result = measure(name, 1024, [&] {
+                CommandArgs args;
+                checksum += static_cast<size_t>(parse_command(command, args)) + args.text.size();
+            }, [] {});
+            if (checksum == 0) report("");  // Keeps the parse from being optimized away
+            return result;
+        }});
+    }
+}
+
+void add_dispatch_cases(std::vector<BenchCase>& cases) {
+    for (size_t user_count : {10, 1000, 100000}) {
+        for (size_t length : {16, 256, 4096}) {
+            std::string name = "dispatch/msg/users=" + std::to_string(user_count) + "/len=" + std::to_string(length);
+            cases.push_back({name, [user_count, length](const std::string& name) {
+                // Sender and recipient are real sockets; the other users are only map entries
+                SocketPairs pairs(2);
+                for (size_t i = 0; i < user_count; i++) {
+                    int sock = i < 2 ? pairs.server_ends[i] : -static_cast<int>(i);
+                    std::string username = "user" + std::to_string(i);
+                    clients[sock] = username;
+                    user_sockets[username].insert(sock);
+                }
+                std::string command = "/msg user1 " + text_of(length);
+                std::string sender = "user0";
+                BenchResult result = measure(name, chunk_for(length), [&] {
+                    DeferredSends sends;
+                    processClientMessage(pairs.server_ends[0], command, sender);
+                }, [&] { pairs.drain(); });
+                clients.clear();
+                user_sockets.clear();
+                return result;
+            }});
+        }
+    }
+}
+
+void add_group_fanout_cases(std::vector<BenchCase>& cases) {
+    for (size_t group_size : {2, 16, 128, 512}) {
+        std::string name = "group_fanout/members=" + std::to_string(group_size) + "/len=64";
+        cases.push_back({name, [group_size](const std::string& name) {
+            SocketPairs pairs(group_size);
+            std::string group_name = "bench" + std::to_string(group_size);
+            groups.create(group_name, pairs.server_ends[0]);
+            MemberList members;
+            for (size_t i = 1; i < group_size; i++) {
+                groups.join(group_name, pairs.server_ends[i], members);
+            }
+            std::string command = "/group_msg " + group_name + " " + text_of(64);
+            CommandArgs args;
+            parse_command(command, args);
+            std::string sender = "user0";
+            BenchResult result = measure(name, chunk_for(64), [&] {
+                DeferredSends sends;
+                processGroupMessage(groups, pairs.server_ends[0], args, sender);
+            }, [&] { pairs.drain(); });
+            for (size_t i = 0; i < group_size; i++) {
+                groups.leave(group_name, pairs.server_ends[i], members);
+            }
+            return result;
+        }});
+    }
+    for (size_t group_size : {2, 16, 128, 512}) {
+        std::string name = "group_fanout_owned/members=" + std::to_string(group_size) + "/len=64";
+        cases.push_back({name, [group_size](const std::string& name) {
+            SocketPairs pairs(group_size);
+            OwnedGroups owned;
+            std::string group_name = "bench" + std::to_string(group_size);
+            owned.create(group_name, pairs.server_ends[0]);
+            OwnedGroups::Members members;
+            for (size_t i = 1; i < group_size; i++) {
+                owned.join(group_name, pairs.server_ends[i], members);
+            }
+            std::string command = "/group_msg " + group_name + " " + text_of(64);
+            CommandArgs args;
+            parse_command(command, args);
+            std::string sender = "user0";
+            return measure(name, chunk_for(64), [&] {
+                DeferredSends sends;
+                processGroupMessage(owned, pairs.server_ends[0], args, sender);
+            }, [&] { pairs.drain(); });
+        }});
+    }
+}
+
+void add_fanout_completion_cases(std::vector<BenchCase>& cases) {
+    for (size_t group_size : {1024, 4096, 8192}) {
+        for (bool pooled : {false, true}) {
+            std::string name = "fanout_completion/members=" + std::to_string(group_size) + "/" +
+                               (pooled ? "pool" : "serial");
+            cases.push_back({name, [group_size, pooled](const std::string& name) {
+                if (pooled && !fanout.running()) fanout.start(std::max(1u, std::thread::hardware_concurrency()));
+                SocketPairs pairs(group_size);
+                std::string group_name = "large" + std::to_string(group_size);
+                groups.create(group_name, pairs.server_ends[0]);
+                MemberList members;
+                for (size_t i = 1; i < group_size; i++) {
+                    groups.join(group_name, pairs.server_ends[i], members);
+                }
+                std::string command = "/group_msg " + group_name + " " + text_of(64);
+                CommandArgs args;
+                parse_command(command, args);
+                std::string sender = "user0";
+                size_t threshold = config.fanout_threshold;
+                config.fanout_threshold = pooled ? 1 : 0;
+                BenchResult result = measure(name, 1, [&] {
+                    DeferredSends sends;
+                    processGroupMessage(groups, pairs.server_ends[0], args, sender);
+                }, [&] { pairs.drain(); });
+                config.fanout_threshold = threshold;
+                for (size_t i = 0; i < group_size; i++) {
+                    groups.leave(group_name, pairs.server_ends[i], members);
+                }
+                return result;
+            }});
+        }
+    }
+}
+
+// Waits until the writer thread has taken everything this thread logged
+void wait_for_logger() {
+    Logger::Ring* ring = Logger::thread_ring.ring.get();
+    while (ring && ring->tail.load() != ring->head.load()) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+void add_logger_cases(std::vector<BenchCase>& cases) {
+    cases.push_back({"logger/level_off", [](const std::string& name) {
+        std::string text = text_of(256);
+        return measure(name, 1024, [&] { LOG_INFO("User ", text, " disconnected."); }, [] {});
+    }});
+    for (size_t length : {16, 256, 1024}) {
+        cases.push_back({"logger/info/len=" + std::to_string(length), [length](const std::string& name) {
+            std::string text = text_of(length);
+            Logger::min_level = static_cast<int>(Logger::Level::Info);
+            // Half a ring per chunk, so that records are never dropped; every
+            // chunk waits about a millisecond for the writer thread to wake up
+            size_t chunk = Logger::RING_BYTES / 2 / (sizeof(Logger::RecordHeader) + length + 16);
+            BenchResult result = measure(name, chunk, [&] { LOG_INFO("User ", text, " disconnected."); },
+                                         wait_for_logger, 50);
+            Logger::min_level = static_cast<int>(Logger::Level::Off);
+            return result;
+        }});
+    }
+}
+
+void add_load_users_cases(std::vector<BenchCase>& cases) {
+    for (size_t user_count : {100, 10000, 100000}) {
+        cases.push_back({"load_users/users=" + std::to_string(user_count), [user_count](const std::string& name) {
+            std::string file_name = "/tmp/server_bench_users_" + std::to_string(getpid()) + ".txt";
+            {
+                std::ofstream file(file_name);
+                for (size_t i = 0; i < user_count; i++) {
+                    file << "user" << i << ":password" << i << "\n";
+                }
+            }
+            size_t loaded = 0;
+            BenchResult result = measure(name, 1, [&] {
+                if (std::optional<UserTable> table = load_users(file_name)) loaded += table->size();
+            }, [] {});
+            unlink(file_name.c_str());
+            if (loaded == 0) report("load_users loaded nothing\n");
+            return result;
+        }});
+    }
+}
+
+// Writes a compiled index of user_count users with the given hashing cost
+std::string write_user_index(size_t user_count, uint32_t iterations) {
+    std::vector<std::pair<std::string, std::string>> entries;
+    for (size_t i = 0; i < user_count; i++) {
+        entries.emplace_back("user" + std::to_string(i), "password" + std::to_string(i));
+    }
+    std::vector<char> image;
+    std::string error;
+    user_index::build(std::move(entries), iterations, image, error);
+    std::string file_name = "/tmp/server_bench_users_" + std::to_string(getpid()) + ".idx";
+    std::ofstream(file_name, std::ios::binary).write(image.data(), image.size());
+    return file_name;
+}
+
+void add_user_index_cases(std::vector<BenchCase>& cases) {
+    for (size_t user_count : {100, 10000, 100000}) {
+        cases.push_back({"user_index/open/users=" + std::to_string(user_count), [user_count](const std::string& name) {
+            std::string file_name = write_user_index(user_count, 1);
+            size_t opened = 0;
+            std::string error;
+            BenchResult result = measure(name, 16, [&] {
+                user_index::Index index;
+                if (index.open(file_name, error)) opened += index.size();
+            }, [] {});
+            unlink(file_name.c_str());
+            if (opened == 0) report("user_index open failed: " + error + "\n");
+            return result;
+        }});
+    }
+    for (uint32_t iterations : {1u, user_index::DEFAULT_ITERATIONS}) {
+        cases.push_back({"user_index/verify/iterations=" + std::to_string(iterations), [iterations](const std::string& name) {
+            std::string file_name = write_user_index(100000, iterations);
+            user_index::Index index;
+            std::string error;
+            index.open(file_name, error);
+            unlink(file_name.c_str());
+            size_t accepted = 0, next = 0;
+            BenchResult result = measure(name, 64, [&] {
+                std::string user = "user" + std::to_string(next % 100000);
+                std::string password = "password" + std::to_string(next % 100000);
+                accepted += index.verify(user, password);
+                next += 7919;
+            }, [] {});
+            if (accepted == 0) report("user_index verify accepted nothing\n");
+            return result;
+        }});
+    }
+}
+
+// Connection timers spread over a 60 s idle timeout in 100 ms ticks, as on a busy shard
+#define WHEEL_TIMERS 100000
+#define WHEEL_SPREAD 600
+
+void add_timer_wheel_cases(std::vector<BenchCase>& cases) {
+    cases.push_back({"timer_wheel/reschedule/timers=100000", [](const std::string& name) {
+        TimerWheel wheel;
+        std::vector<TimerWheel::Timer> timers(WHEEL_TIMERS);
+        for (size_t i = 0; i < timers.size(); i++) wheel.schedule(timers[i], 1 + i % WHEEL_SPREAD);
+        size_t next = 0;
+        return measure(name, 1024, [&] {
+            wheel.schedule(timers[next % WHEEL_TIMERS], 1 + next % WHEEL_SPREAD);
+            next += 7919;
+        }, [] {});
+    }});
+    cases.push_back({"timer_wheel/tick/timers=100000", [](const std::string& name) {
+        // Every expired timer is re-armed a full spread ahead, so each tick
+        // expires about WHEEL_TIMERS / WHEEL_SPREAD timers indefinitely
+        TimerWheel wheel;
+        std::vector<TimerWheel::Timer> timers(WHEEL_TIMERS);
+        for (size_t i = 0; i < timers.size(); i++) wheel.schedule(timers[i], 1 + i % WHEEL_SPREAD);
+        size_t expired = 0;
+        BenchResult result = measure(name, 16, [&] {
+            wheel.advance(wheel.now() + 1, [&](TimerWheel::Timer& timer) {
+                wheel.schedule(timer, WHEEL_SPREAD);
+                expired++;
+            });
+        }, [] {});
+        if (expired == 0) report("timer_wheel expired nothing\n");
+        return result;
+    }});
+}
+
+std::string format_result(const BenchResult& result) {
+    std::ostringstream line;
+    line << std::left << std::setw(44) << result.name << std::right << std::fixed << std::setprecision(1)
+         << std::setw(14) << result.ns_per_op << " ns/op" << std::setprecision(3) << std::setw(10)
+         << result.allocs_per_op << " allocs/op";
+    return line.str();
+}
+
+// Baseline file: one "name ns_per_op allocs_per_op relative" line per case
+std::map<std::string, BenchResult> read_baseline(const std::string& file_name) {
+    std::map<std::string, BenchResult> baseline;
+    std::ifstream file(file_name);
+    BenchResult result;
+    while (file >> result.name >> result.ns_per_op >> result.allocs_per_op >> result.relative) {
+        baseline[result.name] = result;
+    }
+    return baseline;
+}
+
+bool slower(const BenchResult& result, const BenchResult& base) {
+    return (result.relative - base.relative) / base.relative * 100 > options.threshold;
+}
+
+// Allocation counts are deterministic, so any real increase is a regression
+bool allocates_more(const BenchResult& result, const BenchResult& base) {
+    return result.allocs_per_op > base.allocs_per_op + 0.05;
+}
+
+// Prints every case against the baseline; returns the number of regressions.
+// A case that looks slower is measured up to CONFIRM_RUNS more times and only
+// counts if it stays slower, so a burst of noise does not fail the build.
+int compare(const std::vector<BenchCase>& cases, std::vector<BenchResult>& results,
+            const std::map<std::string, BenchResult>& baseline) {
+    int regressions = 0;
+    std::ostringstream out;
+    out << "\nAgainst " << options.compare_file << " (threshold " << options.threshold << "%):\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        BenchResult& result = results[i];
+        auto it = baseline.find(result.name);
+        out << std::left << std::setw(44) << result.name << std::right;
+        if (it == baseline.end()) {
+            out << "   (not in baseline)\n";
+            continue;
+        }
+        const BenchResult& base = it->second;
+        for (int retry = 0; retry < CONFIRM_RUNS && slower(result, base) && !allocates_more(result, base); retry++) {
+            BenchResult again = cases[i].run(cases[i].name);
+            result.ns_per_op = std::min(result.ns_per_op, again.ns_per_op);
+            result.relative = std::min(result.relative, again.relative);
+        }
+        double change = (result.relative - base.relative) / base.relative * 100;
+        out << std::showpos << std::fixed << std::setprecision(1) << std::setw(8) << change << "%" << std::noshowpos;
+        if (slower(result, base) || allocates_more(result, base)) {
+            out << "   REGRESSION";
+            if (allocates_more(result, base)) {
+                out << " (allocs/op " << std::setprecision(3) << base.allocs_per_op << " -> "
+                    << result.allocs_per_op << ")";
+            }
+            regressions++;
+        } else if (change < -options.threshold) {
+            out << "   improved";
+        }
+        out << "\n";
+    }
+    out << regressions << " regression(s)\n";
+    report(out.str());
+    return regressions;
+}
+
+bool parse_bench_args(int argc, char* argv[]) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--filter") {
+            options.filter = argv[i + 1];
+        } else if (option == "--save") {
+            options.save_file = argv[i + 1];
+        } else if (option == "--compare") {
+            options.compare_file = argv[i + 1];
+        } else if (option == "--threshold") {
+            options.threshold = std::atof(argv[i + 1]);
+        } else if (option == "--runs") {
+            options.runs = std::max(1, std::atoi(argv[i + 1]));
+        } else {
+            return false;
+        }
+    }
+    return argc % 2 == 1;
+}
+
+void add_message_log_cases(std::vector<BenchCase>& cases) {
+    cases.push_back({"message_log/append/len=64", [](const std::string& name) {
+        // A log cannot be closed, so every pass shares one, removed at exit
+        static message_log::Log* log = nullptr;
+        if (!log) {
+            static std::string directory = "/tmp/server_bench_log_" + std::to_string(getpid());
+            log = new message_log::Log;
+            std::string error;
+            if (!log->open(directory, error)) {
+                std::cerr << error << std::endl;
+                exit(1);
+            }
+            std::atexit([] { std::filesystem::remove_all(directory); });
+        }
+        std::string text = text_of(64);
+        std::string sender = "user0";
+        return measure(name, 1024, [&] {
+            log->append(message_log::Kind::Group, "bench", [&](std::string_view seq) {
+                return make_payload({"#", seq, " [", sender, "][Group bench]: ", text, "\n"});
+            });
+        }, [] {});
+    }});
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_bench_args(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " [--filter TEXT] [--runs N] [--save FILE] [--compare FILE]\n"
+                  << "       [--threshold PERCENT]" << std::endl;
+        return 1;
+    }
+    raise_fd_limit();
+    report_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+    Logger::min_level = static_cast<int>(Logger::Level::Off);
+
+    std::vector<BenchCase> cases;
+    for (auto add : {add_parse_cases, add_dispatch_cases, add_group_fanout_cases, add_fanout_completion_cases,
+                     add_logger_cases,
+                     add_load_users_cases, add_user_index_cases, add_timer_wheel_cases,
+                     add_message_log_cases}) {
+        add(cases);
+    }
+    cases.erase(std::remove_if(cases.begin(), cases.end(), [](const BenchCase& bench) {
+        return bench.name.find(options.filter) == std::string::npos;
+    }), cases.end());
+
+    // Every pass runs the whole suite; a case keeps its best pass, so noise
+    // that lasts a few hundred milliseconds is outvoted by the other passes
+    std::vector<BenchResult> results;
+    for (int run = 0; run < options.runs; run++) {
+        for (size_t i = 0; i < cases.size(); i++) {
+            BenchResult result = cases[i].run(cases[i].name);
+            if (run == 0) {
+                results.push_back(result);
+            } else {
+                results[i].ns_per_op = std::min(results[i].ns_per_op, result.ns_per_op);
+                results[i].allocs_per_op = std::min(results[i].allocs_per_op, result.allocs_per_op);
+                results[i].relative = std::min(results[i].relative, result.relative);
+            }
+        }
+    }
+    for (const BenchResult& result : results) {
+        report(format_result(result) + "\n");
+    }
+
+    if (!options.save_file.empty()) {
+        std::ofstream file(options.save_file);
+        file << std::setprecision(6);
+        for (const BenchResult& result : results) {
+            file << result.name << " " << result.ns_per_op << " " << result.allocs_per_op << " " << result.relative
+                 << "\n";
+        }
+        report("Baseline saved to " + options.save_file + "\n");
+    }
+    if (!options.compare_file.empty()) {
+        std::map<std::string, BenchResult> baseline = read_baseline(options.compare_file);
+        if (baseline.empty()) {
+            report("No baseline in " + options.compare_file + "\n");
+            return 1;
+        }
+        return compare(cases, results, baseline) > 0 ? 1 : 0;
+    }
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include <unordered_set>
 #include <fstream>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -14,425 +15,4700 @@
 #include <chrono>
 #include <ctime>
 #include <algorithm>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+#include <string_view>
+
+#include "cluster_wire.hpp"
+#include "command_parser.hpp"
+#include "fanout_pool.hpp"
+#include "group_owners.hpp"
+#include "message_log.hpp"
+#include "message_pool.hpp"
+#include "metrics.hpp"
+#include "offline_inbox.hpp"
+#include "timer_wheel.hpp"
+#include "user_index.hpp"
 
 // Define buffer size for client-server messages
 #define BUFFER_SIZE 1024
+// How long send_message waits for room in a full non-blocking socket buffer
+#define SEND_TIMEOUT_MS 1000
+// Most recipients per chunk when thread mode splits a large fan-out over the
+// fan-out pool; a fan-out at --fanout-threshold is cut into at least 4
+#define FANOUT_CHUNK 256
+// Most descriptors the server opens; reactor mode keeps per-descriptor tables this long
+#define MAX_OPEN_FILES (1 << 20)
+// Maximum number of readiness events handled per epoll_wait call
+#define MAX_EVENTS 256
+// Maximum number of queued messages gathered into one sendmsg
+#define IOV_BATCH 64
+// Longest command accepted from a line-protocol client, and its read size
+#define MAX_LINE_LENGTH 65536
+#define LINE_READ_SIZE 65536
+// Reactor sends of at least this many bytes use MSG_ZEROCOPY / IORING_OP_SENDMSG_ZC
+#define ZEROCOPY_THRESHOLD 16384
+// io_uring backend sizing: submission queue entries and provided receive buffers per shard
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024
+// How long the user file must stay unchanged after a write before it is reloaded
+#define USER_RELOAD_SETTLE_MS 50
+// Resolution of the login, idle and ping timers of an event loop
+#define TIMER_TICK_MS 100
+// Seconds a pinged client has to answer when --idle-timeout is given without --ping-timeout
+#define DEFAULT_PING_TIMEOUT 10
+// Presence changes are gathered for this long and sent as one delta, naming at most PRESENCE_MAX_NAMES users
+#define PRESENCE_INTERVAL_MS 100
+#define PRESENCE_MAX_NAMES 64
+// Most history one /resume_group or /resume_inbox sends; the client asks again for more
+#define REPLAY_MAX_BYTES 262144
+
+// Heap allocation accounting: every global operator new is counted in its
+// thread's metrics::thread_allocations, with no shared cache line; /stats and
+// /metrics sum the threads' counts, so they show whether the message path allocates
+void* operator new(size_t size) {
+    metrics::thread_allocations.add(1);
+    if (void* block = malloc(size ? size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+// Kept out of line: inlined into callers at -O2, GCC would see free() on
+// memory from operator new and warn (-Wmismatched-new-delete)
+__attribute__((noinline)) void operator delete(void* block) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block) noexcept { free(block); }
+__attribute__((noinline)) void operator delete(void* block, size_t) noexcept { free(block); }
+__attribute__((noinline)) void operator delete[](void* block, size_t) noexcept { free(block); }
+
+// Asynchronous logger. The hot path only copies a record (timestamp, level,
+// text) into its thread's lock-free single-producer ring; a background
+// writer drains every ring, formats records with a timestamp string cached
+// per second, and writes them in batches. A full ring drops the record
+// (counted and reported) instead of blocking the caller. Threads' rings are
+// retired when they exit and freed once drained.
+namespace Logger {
+    enum class Level : int { Info = 0, Error = 1, Off = 2 };
+
+    // Records below this level are skipped before their text is even built
+    std::atomic<int> min_level{static_cast<int>(Level::Info)};
+    // Binary records instead of text lines (see README for the layout)
+    std::atomic<bool> binary{false};
+    std::atomic<uint64_t> dropped{0};
+
+    inline bool enabled(Level level) {
+        return static_cast<int>(level) >= min_level.load(std::memory_order_relaxed);
+    }
+
+    // Per-thread ring capacity, and the longest message text kept per record
+    constexpr size_t RING_BYTES = 64 * 1024;
+    constexpr size_t MAX_TEXT = 4096;
+
+    // Stored in the rings and, with --log-format binary, written as is
+    // (16 bytes, native byte order) followed by length bytes of text
+    struct RecordHeader {
+        int64_t time;     // Seconds since the epoch
+        uint16_t level;   // Level::Info or Level::Error
+        uint16_t length;  // Text bytes that follow
+        uint32_t thread;  // Logging thread, numbered in order of first use
+    };
+
+    // Byte ring written by one thread and read by the writer; positions only grow
+    struct Ring {
+        explicit Ring(uint32_t thread) : data(new char[RING_BYTES]), thread(thread) {}
+        std::unique_ptr<char[]> data;
+        uint32_t thread;
+        std::atomic<uint64_t> head{0};  // Written by the owning thread
+        std::atomic<uint64_t> tail{0};  // Written by the writer thread
+        std::atomic<bool> retired{false};
+
+        void copy_in(uint64_t pos, const void* src, size_t len) {
+            size_t offset = pos % RING_BYTES;
+            size_t first = std::min(len, RING_BYTES - offset);
+            memcpy(data.get() + offset, src, first);
+            memcpy(data.get(), static_cast<const char*>(src) + first, len - first);
+        }
+
+        void copy_out(uint64_t pos, void* dst, size_t len) const {
+            size_t offset = pos % RING_BYTES;
+            size_t first = std::min(len, RING_BYTES - offset);
+            memcpy(dst, data.get() + offset, first);
+            memcpy(static_cast<char*>(dst) + first, data.get(), len - first);
+        }
+    };
+
+    class Writer {
+    public:
+        ~Writer() {
+            // Static destruction at exit: write whatever is still queued
+            stop = true;
+            if (thread.joinable()) thread.join();
+        }
+
+        std::shared_ptr<Ring> register_ring() {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            auto ring = std::make_shared<Ring>(next_thread++);
+            rings.push_back(ring);
+            if (!thread.joinable()) {
+                thread = std::thread(&Writer::run, this);
+            }
+            return ring;
+        }
+
+    private:
+        void run() {
+            while (true) {
+                bool stopping = stop.load();
+                if (!drain() && !stopping) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                if (stopping) return;
+            }
+        }
+
+        // Formats everything queued in all rings; false if there was nothing
+        bool drain() {
+            {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                snapshot = rings;
+            }
+            out.clear();
+            err.clear();
+            for (const auto& ring : snapshot) {
+                uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+                uint64_t head = ring->head.load(std::memory_order_acquire);
+                while (tail < head) {
+                    RecordHeader header;
+                    ring->copy_out(tail, &header, sizeof(header));
+                    text.resize(header.length);
+                    ring->copy_out(tail + sizeof(header), text.data(), header.length);
+                    tail += sizeof(header) + header.length;
+                    append(header, text);
+                }
+                ring->tail.store(tail, std::memory_order_release);
+            }
+            uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+            if (lost > 0) {
+                std::string notice = std::to_string(lost) + " log records dropped";
+                append(RecordHeader{std::time(nullptr), static_cast<uint16_t>(Level::Error),
+                                    static_cast<uint16_t>(notice.size()), 0}, notice);
+            }
+            {
+                // Drained rings of exited threads are freed
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                rings.erase(std::remove_if(rings.begin(), rings.end(), [](const std::shared_ptr<Ring>& ring) {
+                    return ring->retired.load(std::memory_order_acquire) &&
+                           ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire);
+                }), rings.end());
+            }
+            snapshot.clear();
+            write_all(STDOUT_FILENO, out);
+            write_all(STDERR_FILENO, err);
+            return !out.empty() || !err.empty();
+        }
+
+        void append(const RecordHeader& header, const std::string& message) {
+            if (binary.load(std::memory_order_relaxed)) {
+                // All records go to stdout: the header as stored, then the text
+                out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+                out.append(message);
+                return;
+            }
+            std::string& target = header.level == static_cast<uint16_t>(Level::Error) ? err : out;
+            target += "[";
+            target += timestamp(header.time);
+            target += header.level == static_cast<uint16_t>(Level::Error) ? "] [ERROR] " : "] [INFO] ";
+            target += message;
+            target += '\n';
+        }
+
+        // ctime()-style local time, formatted once per second
+        const std::string& timestamp(int64_t time) {
+            if (time != cached_time) {
+                std::time_t t = time;
+                std::tm local{};
+                localtime_r(&t, &local);
+                char formatted[64];
+                strftime(formatted, sizeof(formatted), "%a %b %e %H:%M:%S %Y", &local);
+                cached_time = time;
+                cached_timestamp = formatted;
+            }
+            return cached_timestamp;
+        }
+
+        static void write_all(int fd, const std::string& data) {
+            size_t offset = 0;
+            while (offset < data.size()) {
+                ssize_t written = write(fd, data.data() + offset, data.size() - offset);
+                if (written < 0 && errno == EINTR) continue;
+                if (written <= 0) return;
+                offset += written;
+            }
+        }
+
+        std::mutex rings_mutex;  // Only taken when a thread logs for the first time, and by the writer
+        std::vector<std::shared_ptr<Ring>> rings;
+        std::vector<std::shared_ptr<Ring>> snapshot;  // Reused so that idle drains do not allocate
+        uint32_t next_thread = 0;
+        std::thread thread;
+        std::atomic<bool> stop{false};
+        std::string out, err, text;
+        int64_t cached_time = -1;
+        std::string cached_timestamp;
+    };
+
+    Writer writer;
+
+    // Owns the calling thread's ring and retires it when the thread exits
+    struct ThreadRing {
+        std::shared_ptr<Ring> ring;
+        ~ThreadRing() {
+            if (ring) ring->retired.store(true, std::memory_order_release);
+        }
+    };
+    thread_local ThreadRing thread_ring;
+
+    // The message is the concatenation of parts, copied piece by piece into
+    // the ring, so hot call sites log without building a string
+    void log(Level level, std::initializer_list<std::string_view> parts) {
+        Ring* ring = thread_ring.ring.get();
+        if (!ring) {
+            thread_ring.ring = writer.register_ring();
+            ring = thread_ring.ring.get();
+        }
+        size_t length = 0;
+        for (std::string_view part : parts) length += part.size();
+        length = std::min(length, MAX_TEXT);
+        RecordHeader header{std::time(nullptr), static_cast<uint16_t>(level), static_cast<uint16_t>(length), ring->thread};
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        if (RING_BYTES - (head - tail) < sizeof(header) + length) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        ring->copy_in(head, &header, sizeof(header));
+        uint64_t pos = head + sizeof(header);
+        size_t left = length;
+        for (std::string_view part : parts) {
+            size_t take = std::min(part.size(), left);
+            ring->copy_in(pos, part.data(), take);
+            pos += take;
+            left -= take;
+        }
+        ring->head.store(pos, std::memory_order_release);
+    }
+
+    void log_info(std::initializer_list<std::string_view> parts) {
+        log(Level::Info, parts);
+    }
+    void log_error(std::initializer_list<std::string_view> parts) {
+        log(Level::Error, parts);
+    }
+}
+
+// Level-filtered logging: when the level is disabled the message expression is
+// not evaluated. Several arguments are logged as their concatenation.
+#define LOG_INFO(...) do { if (Logger::enabled(Logger::Level::Info)) Logger::log_info({__VA_ARGS__}); } while (0)
+#define LOG_ERROR(...) do { if (Logger::enabled(Logger::Level::Error)) Logger::log_error({__VA_ARGS__}); } while (0)
+
+// Hash for string-keyed maps that can be searched with a string_view without building a std::string
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view text) const { return std::hash<std::string_view>{}(text); }
+};
+
+// Builds a string from pieces with a single allocation
+std::string concat(std::initializer_list<std::string_view> parts) {
+    size_t length = 0;
+    for (std::string_view part : parts) length += part.size();
+    std::string result;
+    result.reserve(length);
+    for (std::string_view part : parts) result.append(part);
+    return result;
+}
+
+// Global mutexes for thread safety over shared data structures
+std::mutex clients_mutex;
+
+// Global data structures:
+// clients: mapping of client socket to username
+// user_sockets: reverse index of clients, username to the sockets it is logged in on
+std::unordered_map<int, std::string> clients;
+std::unordered_map<std::string, std::unordered_set<int>, StringHash, std::equal_to<>> user_sockets;
+// Size of clients, readable without clients_mutex (broadcast fan-out metric)
+std::atomic<size_t> clients_online{0};
+
+// Credentials are an immutable table behind an atomic pointer. A reload builds
+// a whole new table on the watcher thread and publishes it with one store;
+// logins load the pointer and keep that table alive while they check it, so
+// they never take clients_mutex and never see a half-built table.
+using UserTable = std::unordered_map<std::string, std::string, StringHash, std::equal_to<>>;
+
+// One published credential source: a text user file parsed into a table, or
+// a compiled index (build_user_index) mapped read-only
+struct Credentials {
+    UserTable table;
+    user_index::Index index;
+    bool mapped = false;
+
+    size_t size() const { return mapped ? index.size() : table.size(); }
+
+    bool contains(std::string_view username) const {
+        return mapped ? index.contains(username) : table.count(username) > 0;
+    }
+
+    bool verify(std::string_view username, std::string_view password) const {
+        if (mapped) {
+            return index.verify(username, password);
+        }
+        auto entry = table.find(username);
+        return entry != table.end() && entry->second == password;
+    }
+};
+std::atomic<std::shared_ptr<const Credentials>> users{std::make_shared<const Credentials>()};
+std::atomic<uint64_t> user_reloads{0};
+
+// An immutable snapshot of a group's member sockets
+using MemberList = std::shared_ptr<const std::unordered_set<int>>;
+
+// Group registry built for /group_msg, which only reads membership.
+// Group names are spread over GROUP_INDEX_SHARDS index shards, each behind a
+// shared_mutex that is held exclusively only to create or remove a group.
+// Every group publishes its members as an immutable snapshot: readers only
+// copy the snapshot pointer and fan out from it; join/leave copy the set
+// under the group's own mutex and publish the new snapshot. Senders therefore never
+// wait for membership changes, and different groups never contend.
+// A second index, sharded by socket, lists the groups each socket is in, so
+// a disconnect removes the socket from exactly its groups without a scan.
+// Lock order: a group's mutex before its index shard or a membership shard;
+// a membership shard's mutex is taken last and never held while locking another.
+#define GROUP_INDEX_SHARDS 64
+#define MEMBERSHIP_SHARDS 64
+
+// Defined with the cluster below: tells the other nodes that this one now
+// has, or no longer has, members of a group
+void announce_group(std::string_view name, bool present);
+
+class GroupRegistry {
+public:
+    enum class Result { Ok, NoGroup, Exists, AlreadyMember, NotMember };
+    using Members = MemberList;
+
+    Result create(std::string_view name, int creator) {
+        IndexShard& shard = shard_for(name);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto [it, inserted] = shard.groups.try_emplace(std::string(name));
+        if (!inserted) {
+            return Result::Exists;
+        }
+        it->second = std::make_shared<Group>();
+        it->second->publish(std::make_shared<const std::unordered_set<int>>(std::unordered_set<int>{creator}));
+        add_membership(creator, name);
+        announce_group(name, true);
+        return Result::Ok;
+    }
+
+    // On success members is the membership including the new member
+    Result join(std::string_view name, int member, MemberList& members) {
+        std::shared_ptr<Group> group = find(name);
+        if (!group) {
+            return Result::NoGroup;
+        }
+        std::lock_guard<std::mutex> lock(group->mutex);
+        if (group->removed) {
+            return Result::NoGroup;
+        }
+        MemberList current = group->snapshot();
+        if (current->count(member)) {
+            return Result::AlreadyMember;
+        }
+        auto updated = std::make_shared<std::unordered_set<int>>(*current);
+        updated->insert(member);
+        members = updated;
+        group->publish(members);
+        add_membership(member, name);
+        return Result::Ok;
+    }
+
+    // On success members is the remaining membership; an emptied group is removed
+    Result leave(std::string_view name, int member, MemberList& members) {
+        std::shared_ptr<Group> group = find(name);
+        if (!group) {
+            return Result::NoGroup;
+        }
+        std::lock_guard<std::mutex> lock(group->mutex);
+        if (group->removed) {
+            return Result::NoGroup;
+        }
+        MemberList current = group->snapshot();
+        if (!current->count(member)) {
+            return Result::NotMember;
+        }
+        auto updated = std::make_shared<std::unordered_set<int>>(*current);
+        updated->erase(member);
+        members = updated;
+        group->publish(members);
+        remove_membership(member, name);
+        if (members->empty()) {
+            remove(name, *group);
+        }
+        return Result::Ok;
+    }
+
+    // Takes departing sockets out of every group they are in. Each affected
+    // group is copied and republished once for the whole batch, however many
+    // of its members are leaving; groups left empty are removed.
+    void leave_all(const std::vector<int>& sockets) {
+        std::unordered_map<std::string, std::vector<int>> leaving;
+        for (int member : sockets) {
+            MembershipShard& shard = membership_for(member);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.groups_of.find(member);
+            if (it == shard.groups_of.end()) continue;
+            for (std::string& name : it->second) {
+                leaving[std::move(name)].push_back(member);
+            }
+            shard.groups_of.erase(it);
+        }
+        for (const auto& [name, members] : leaving) {
+            std::shared_ptr<Group> group = find(name);
+            if (!group) continue;
+            std::lock_guard<std::mutex> lock(group->mutex);
+            if (group->removed) continue;
+            auto updated = std::make_shared<std::unordered_set<int>>(*group->snapshot());
+            for (int member : members) {
+                updated->erase(member);
+            }
+            bool empty = updated->empty();
+            group->publish(std::move(updated));
+            if (empty) {
+                remove(name, *group);
+            }
+        }
+    }
+
+    // Current membership snapshot, or nullptr if the group does not exist
+    MemberList members(std::string_view name) const {
+        std::shared_ptr<Group> group = find(name);
+        return group ? group->snapshot() : nullptr;
+    }
+
+private:
+    struct Group {
+        std::mutex mutex;  // Serializes membership changes
+        bool removed = false;
+
+        MemberList snapshot() const {
+            std::lock_guard<std::mutex> lock(snapshot_mutex);
+            return members;
+        }
+        void publish(MemberList updated) {
+            std::lock_guard<std::mutex> lock(snapshot_mutex);
+            members.swap(updated);
+        }
+
+    private:
+        // Held only to copy or swap the pointer, never while building a new set
+        mutable std::mutex snapshot_mutex;
+        MemberList members;
+    };
+
+    struct IndexShard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Group>, StringHash, std::equal_to<>> groups;
+    };
+
+    struct MembershipShard {
+        std::mutex mutex;
+        std::unordered_map<int, std::vector<std::string>> groups_of;
+    };
+
+    IndexShard& shard_for(std::string_view name) {
+        return index[StringHash{}(name) % GROUP_INDEX_SHARDS];
+    }
+
+    MembershipShard& membership_for(int member) {
+        return membership[static_cast<unsigned>(member) % MEMBERSHIP_SHARDS];
+    }
+
+    void add_membership(int member, std::string_view name) {
+        MembershipShard& shard = membership_for(member);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.groups_of[member].emplace_back(name);
+    }
+
+    void remove_membership(int member, std::string_view name) {
+        MembershipShard& shard = membership_for(member);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.groups_of.find(member);
+        if (it == shard.groups_of.end()) return;
+        std::vector<std::string>& names = it->second;
+        auto found = std::find(names.begin(), names.end(), name);
+        if (found != names.end()) {
+            *found = std::move(names.back());
+            names.pop_back();
+        }
+        if (names.empty()) {
+            shard.groups_of.erase(it);
+        }
+    }
+
+    // Called with the group's mutex held once its last member has left
+    void remove(std::string_view name, Group& group) {
+        group.removed = true;
+        IndexShard& shard = shard_for(name);
+        std::unique_lock<std::shared_mutex> index_lock(shard.mutex);
+        shard.groups.erase(shard.groups.find(name));
+        announce_group(name, false);
+    }
+
+    std::shared_ptr<Group> find(std::string_view name) const {
+        const IndexShard& shard = index[StringHash{}(name) % GROUP_INDEX_SHARDS];
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.groups.find(name);
+        return it == shard.groups.end() ? nullptr : it->second;
+    }
+
+    IndexShard index[GROUP_INDEX_SHARDS];
+    MembershipShard membership[MEMBERSHIP_SHARDS];
+};
+
+// groups: group name to its member sockets
+GroupRegistry groups;
+
+// The groups one reactor shard owns with --groups owned. Only the owning
+// shard's thread touches them, so there are no locks and no snapshots:
+// /group_msg fans out from the member set itself. Members are recorded with
+// the session of the connection that joined, since a departure reaches the
+// owner through a mailbox while a new connection may already have reused the
+// descriptor; a request or departure of an older session than the one known
+// for a descriptor is stale. Groups carry a load count for rebalancing, and
+// move between owners whole.
+class OwnedGroups {
+public:
+    using Result = GroupRegistry::Result;
+    using Members = const std::unordered_set<int>*;
+
+    // A group handed to another owner
+    struct Moved {
+        std::vector<std::pair<int, uint64_t>> members;  // Socket and session
+        uint64_t load = 0;
+    };
+
+    // Records the session a request comes from; false if it is older than
+    // the one known for the socket. A newer session first takes the socket
+    // out of the groups its previous connection was in.
+    bool claim(int member, uint64_t session) {
+        Socket& socket = sockets[member];
+        if (session < socket.session) return false;
+        if (session > socket.session) {
+            drop(member, socket);
+            socket.session = session;
+        }
+        return true;
+    }
+
+    Result create(std::string_view name, int creator) {
+        auto [it, inserted] = groups.try_emplace(std::string(name));
+        if (!inserted) {
+            return Result::Exists;
+        }
+        it->second.members.insert(creator);
+        sockets[creator].groups.push_back(it->first);
+        announce_group(name, true);
+        return Result::Ok;
+    }
+
+    // On success members is the membership including the new member
+    Result join(std::string_view name, int member, Members& members) {
+        auto it = groups.find(name);
+        if (it == groups.end()) {
+            return Result::NoGroup;
+        }
+        if (!it->second.members.insert(member).second) {
+            return Result::AlreadyMember;
+        }
+        sockets[member].groups.push_back(it->first);
+        members = &it->second.members;
+        return Result::Ok;
+    }
+
+    // On success members is the remaining membership; an emptied group is removed
+    Result leave(std::string_view name, int member, Members& members) {
+        auto it = groups.find(name);
+        if (it == groups.end()) {
+            return Result::NoGroup;
+        }
+        if (!it->second.members.erase(member)) {
+            return Result::NotMember;
+        }
+        forget_group(member, name);
+        members = &it->second.members;
+        if (it->second.members.empty()) {
+            members = &no_members;
+            announce_group(name, false);
+            groups.erase(it);
+        }
+        return Result::Ok;
+    }
+
+    Members members(std::string_view name) const {
+        auto it = groups.find(name);
+        return it == groups.end() ? nullptr : &it->second.members;
+    }
+
+    // The socket's connection closed: it leaves every group it is in here
+    void depart(int member, uint64_t session) {
+        auto it = sockets.find(member);
+        if (it == sockets.end() || it->second.session > session) return;
+        drop(member, it->second);
+        sockets.erase(it);
+    }
+
+    // Adds work done for a group to its load
+    void charge(std::string_view name, uint64_t units) {
+        auto it = groups.find(name);
+        if (it != groups.end()) it->second.load += units;
+    }
+
+    // The group with the highest load below limit (empty if none), for
+    // moving to a less busy owner; then every load starts over
+    std::string hottest_below(uint64_t limit) {
+        std::string hottest;
+        uint64_t highest = 0;
+        for (auto& [name, group] : groups) {
+            if (group.load > highest && group.load < limit) {
+                highest = group.load;
+                hottest = name;
+            }
+            group.load = 0;
+        }
+        return hottest;
+    }
+
+    void cool() {
+        for (auto& [name, group] : groups) group.load = 0;
+    }
+
+    // Takes a group out, with its members' sessions, to be adopted elsewhere
+    std::unique_ptr<Moved> release(std::string_view name) {
+        auto it = groups.find(name);
+        if (it == groups.end()) return nullptr;
+        auto moved = std::make_unique<Moved>();
+        moved->load = it->second.load;
+        for (int member : it->second.members) {
+            moved->members.emplace_back(member, sockets[member].session);
+            forget_group(member, name);
+        }
+        groups.erase(it);
+        return moved;
+    }
+
+    // Takes over a group released by another owner. Members whose socket is
+    // known here with a newer session have left already and are dropped.
+    void adopt(std::string_view name, const Moved& moved) {
+        Group& group = groups[std::string(name)];
+        group.load = moved.load;
+        for (const auto& [member, session] : moved.members) {
+            if (!claim(member, session)) continue;
+            if (group.members.insert(member).second) sockets[member].groups.emplace_back(name);
+        }
+        if (group.members.empty()) {
+            groups.erase(groups.find(name));
+            announce_group(name, false);
+        }
+    }
+
+    size_t size() const { return groups.size(); }
+
+private:
+    struct Group {
+        std::unordered_set<int> members;
+        uint64_t load = 0;  // Work since the last rebalancing check
+    };
+
+    struct Socket {
+        uint64_t session = 0;
+        std::vector<std::string> groups;
+    };
+
+    // Takes the socket out of all its groups, removing those left empty
+    void drop(int member, Socket& socket) {
+        for (const std::string& name : socket.groups) {
+            auto it = groups.find(name);
+            if (it == groups.end()) continue;
+            it->second.members.erase(member);
+            if (it->second.members.empty()) {
+                announce_group(name, false);
+                groups.erase(it);
+            }
+        }
+        socket.groups.clear();
+    }
+
+    void forget_group(int member, std::string_view name) {
+        auto it = sockets.find(member);
+        if (it == sockets.end()) return;
+        std::vector<std::string>& names = it->second.groups;
+        auto found = std::find(names.begin(), names.end(), name);
+        if (found != names.end()) {
+            *found = std::move(names.back());
+            names.pop_back();
+        }
+    }
+
+    std::unordered_map<std::string, Group, StringHash, std::equal_to<>> groups;
+    std::unordered_map<int, Socket> sockets;
+    std::unordered_set<int> no_members;  // What leave() reports for a group it removed
+};
+
+// Group and private messages on disk, numbered per group and per recipient
+// (message_log.hpp); only used with --log-dir
+message_log::Log history;
+
+// Private messages to known users who are offline, handed over at their
+// next login (offline_inbox.hpp); off with --offline-ttl 0
+offline_inbox::Inbox offline;
+
+// What a reactor connection does when its outbound queue is full
+enum class OverflowPolicy { DropOldest, Disconnect };
+
+// Server configuration parsed from the command line
+struct ServerConfig {
+    std::string mode = "thread";  // "thread": one thread per client, "reactor": epoll event loops
+    int shards = 4;               // Number of reactor threads, each with its own listener
+    std::string io = "epoll";     // Reactor I/O backend: "epoll" or "uring"
+    std::string groups = "shared";  // "shared": any thread changes a group under its lock; "owned": one shard per group
+    size_t fanout_threshold = 1024;  // Thread mode: recipients from which a fan-out is split over the pool; 0 never
+    int fanout_workers = 0;       // Fan-out pool threads; 0 is one per core
+    int hash_workers = 2;         // Reactor: threads checking passwords against a compiled index; 0 checks on the shards
+    size_t queue_limit = 1 << 20; // Bytes a reactor connection may have queued for sending
+    int flush_cap_us = 1000;      // Epoll reactor: longest output waits for the end of its tick; 0 waits for it
+    OverflowPolicy overflow = OverflowPolicy::DropOldest;
+    int port = 12345;
+    int admin_port = 0;           // Loopback port serving /metrics; 0 disables it
+    std::string users_file = "users.txt";  // Credentials, reloaded whenever the file changes
+    int login_timeout = 10;       // Seconds a connection may take to log in; 0 waits forever
+    int idle_timeout = 0;         // Seconds of silence before a client is pinged; 0 never pings
+    int ping_timeout = 0;         // Seconds a pinged client has to send anything before it is evicted; 0 is the default
+    std::string log_dir;          // Durable group and inbox history; empty keeps none
+    int offline_ttl = 86400;      // Seconds a message to an offline user is kept; 0 refuses them
+    size_t offline_memory_mb = 128;  // Memory for offline messages before they spill or are refused
+    std::string offline_dir;      // Where offline messages spill past the memory budget; empty refuses them
+    std::vector<std::string> cluster;  // Link address (IPv4:port) of every cluster node, by node id; empty runs alone
+    int node_id = 0;              // This server's entry in cluster
+};
+ServerConfig config;
+
+// Reactor shard routing. Every reactor socket is owned by exactly one shard;
+// socket_owner maps a descriptor to that shard (-1 in thread mode or when unowned)
+// and current_shard is the shard running on this thread (-1 off the reactor).
+std::unique_ptr<std::atomic<int>[]> socket_owner;
+size_t socket_owner_size = 0;
+thread_local int current_shard = -1;
+// The session of each reactor socket's current connection, from a counter
+// that only grows, so that a later connection on a reused descriptor is told
+// apart from an earlier one; read only on the socket's own shard
+std::unique_ptr<uint64_t[]> socket_session;
+std::atomic<uint64_t> next_session{1};
+
+int owner_of(int client_socket) {
+    if (client_socket < 0 || static_cast<size_t>(client_socket) >= socket_owner_size) {
+        return -1;
+    }
+    return socket_owner[client_socket].load(std::memory_order_acquire);
+}
+
+// Outgoing messages are pooled, reference-counted Payloads (message_pool.hpp)
+Payload make_payload(std::string_view text) {
+    return Payload({text});
+}
+
+// Formats a message from pieces directly into its payload
+Payload make_payload(std::initializer_list<std::string_view> parts) {
+    return Payload(parts);
+}
+
+// Defined with the reactor below
+void deliver_on_shard(int shard, int client_socket, const Payload& message);
+void broadcast_to_shards(const Payload& message, int exclude_socket);
+void broadcast_from_outside(const Payload& message, std::vector<int> excluded = {});
+void deliver_from_outside(std::vector<std::pair<int, Payload>>& sends);
+
+// Defined with group ownership below; each returns false when groups are
+// shared (--groups shared) and the caller does the work itself
+bool route_group_command(int client_socket, CommandId command, const CommandArgs& args, std::string_view message,
+                         const std::string& username);
+bool depart_groups(const std::vector<int>& sockets);
+bool post_group_line(std::string_view group, std::string_view line);
+void run_group_requests();    // On a shard: what its group mailboxes hold
+void flush_group_requests();  // On a shard at the end of a tick: wakes the owners it sent to
+void processStats(int client_socket, const std::string& username);
+
+// Function to load users from a file; nullopt if it cannot be opened
+std::optional<UserTable> load_users(const std::string& file_name) {
+    UserTable loaded_users;
+    std::ifstream file(file_name);
+    std::string line;
+    if (!file.is_open()) {
+        LOG_ERROR("Failed to open user file: " + file_name);
+        return std::nullopt;
+    }
+    while (std::getline(file, line)) {
+        std::stringstream ss(line);
+        std::string username, password;
+        if (std::getline(ss, username, ':') && std::getline(ss, password)) {
+            loaded_users[username] = password;
+        }
+    }
+    LOG_INFO("Loaded " + std::to_string(loaded_users.size()) + " users from " + file_name);
+    return loaded_users;
+}
+
+// Publishes the file's current contents as the credential table; an
+// unreadable file keeps the table that is already published. A compiled
+// index is recognised by its magic and mapped instead of parsed.
+bool publish_users(const std::string& file_name) {
+    auto credentials = std::make_shared<Credentials>();
+    if (user_index::is_index_file(file_name)) {
+        std::string error;
+        if (!credentials->index.open(file_name, error)) {
+            LOG_ERROR("Failed to map user index: " + error);
+            return false;
+        }
+        credentials->mapped = true;
+        LOG_INFO("Mapped " + std::to_string(credentials->index.size()) + " users from " + file_name);
+    } else {
+        std::optional<UserTable> loaded = load_users(file_name);
+        if (!loaded) {
+            return false;
+        }
+        credentials->table = std::move(*loaded);
+    }
+    users.store(std::move(credentials), std::memory_order_release);
+    user_reloads.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Reloads the user file on its own thread whenever it changes. The directory
+// is watched rather than the file, so a file replaced by rename (as editors
+// and atomic deploys do) is seen as well as one rewritten in place. Events
+// arriving in a burst are folded into one reload once the file has been
+// quiet for USER_RELOAD_SETTLE_MS.
+bool start_user_watcher(const std::string& file_name) {
+    size_t slash = file_name.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : file_name.substr(0, std::max<size_t>(slash, 1));
+    std::string name = slash == std::string::npos ? file_name : file_name.substr(slash + 1);
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        LOG_ERROR("Failed to watch user file: " + file_name);
+        if (inotify_fd >= 0) close(inotify_fd);
+        return false;
+    }
+    std::thread([inotify_fd, file_name, name] {
+        alignas(inotify_event) char buffer[4096];
+        bool changed = false;
+        while (true) {
+            pollfd ready{inotify_fd, POLLIN, 0};
+            int count = poll(&ready, 1, changed ? USER_RELOAD_SETTLE_MS : -1);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("User file watcher stopped.");
+                return;
+            }
+            if (count == 0) {
+                publish_users(file_name);
+                changed = false;
+                continue;
+            }
+            ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < length;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                if (event->len > 0 && name == event->name) {
+                    changed = true;
+                }
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+    }).detach();
+    return true;
+}
+
+// --- Wire framing ---
+// First line a client sends to switch its connection to the line protocol
+const std::string PROTOCOL_REQUEST = "/protocol line";
+
+// Splits a connection's byte stream into commands. Connections start in
+// legacy framing, where every recv() is exactly one command (what
+// client_grp sends). A client whose first bytes are "/protocol line\n"
+// switches to line framing: input is buffered across reads and every
+// complete newline-terminated line is a command, so commands may be
+// pipelined, coalesced by TCP or longer than one read.
+//
+// Received bytes stay in one buffer and commands are handed out as views
+// into it; the buffer and the command list keep their capacity, so once a
+// connection has warmed up decoding allocates nothing.
+class FrameDecoder {
+public:
+    // Adds received bytes; returns false if a line grows beyond MAX_LINE_LENGTH.
+    // Views returned by next() are invalidated.
+    bool feed(const char* data, size_t len) {
+        if (first_read) {
+            first_read = false;
+            size_t request_len = PROTOCOL_REQUEST.size();
+            if (len > request_len && memcmp(data, PROTOCOL_REQUEST.data(), request_len) == 0 &&
+                (data[request_len] == '\n' || data[request_len] == '\r')) {
+                line_framing = true;
+            }
+        }
+        // Drop what has been consumed: commands already handed out and,
+        // in line framing, complete lines before the partial one
+        if (ready_head == ready.size()) {
+            ready.clear();
+            ready_head = 0;
+            buffer.erase(0, line_start);
+            line_start = 0;
+        }
+        if (!line_framing) {
+            size_t start = buffer.size();
+            buffer.append(data, strnlen(data, len));
+            ready.emplace_back(start, buffer.size() - start);
+            line_start = buffer.size();
+            return true;
+        }
+        size_t scan = buffer.size();
+        buffer.append(data, len);
+        for (size_t i = scan; i < buffer.size(); i++) {
+            if (buffer[i] != '\n') continue;
+            size_t end = i > line_start && buffer[i - 1] == '\r' ? i - 1 : i;
+            // A line completed in the same read is held to the limit too
+            if (end - line_start > MAX_LINE_LENGTH) return false;
+            ready.emplace_back(line_start, end - line_start);
+            line_start = i + 1;
+        }
+        return buffer.size() - line_start <= MAX_LINE_LENGTH;
+    }
+
+    // Next complete command, if any; the view is valid until the next feed()
+    bool next(std::string_view& command) {
+        if (ready_head == ready.size()) return false;
+        const auto& [start, length] = ready[ready_head++];
+        command = std::string_view(buffer).substr(start, length);
+        return true;
+    }
+
+    bool line_mode() const { return line_framing; }
+
+private:
+    bool first_read = true;
+    bool line_framing = false;
+    std::string buffer;
+    size_t line_start = 0;  // Start of the first byte not yet part of a command
+    std::vector<std::pair<size_t, size_t>> ready;  // (offset, length) of complete commands
+    size_t ready_head = 0;  // Commands before this one have been handed out
+};
+
+// Writes messages directly to a socket with error checking, gathering up to
+// IOV_BATCH of them into each sendmsg. A full send buffer is waited on with
+// poll() for at most SEND_TIMEOUT_MS, so a reader that stopped reading cannot
+// block the writer forever.
+void write_gathered(int client_socket, const Payload* messages, size_t count) {
+    size_t index = 0;   // First message not completely written
+    size_t offset = 0;  // Bytes of it already written
+    while (index < count) {
+        iovec iov[IOV_BATCH];
+        size_t batch = 0;
+        for (; batch < IOV_BATCH && index + batch < count; batch++) {
+            const Payload& message = messages[index + batch];
+            size_t skip = batch == 0 ? offset : 0;
+            iov[batch] = iovec{const_cast<char*>(message.data()) + skip, message.size() - skip};
+        }
+        ssize_t sent;
+        if (batch == 1) {
+            sent = send(client_socket, iov[0].iov_base, iov[0].iov_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } else {
+            msghdr header{};
+            header.msg_iov = iov;
+            header.msg_iovlen = batch;
+            sent = sendmsg(client_socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        metrics::add(metrics::Counter::SendCalls);
+        if (sent >= 0) {
+            metrics::add(metrics::Counter::BytesSent, sent);
+            for (size_t left = sent; left > 0 && index < count;) {
+                size_t rest = messages[index].size() - offset;
+                if (left < rest) {
+                    offset += left;
+                    break;
+                }
+                left -= rest;
+                index++;
+                offset = 0;
+            }
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            pollfd pfd{client_socket, POLLOUT, 0};
+            if (poll(&pfd, 1, SEND_TIMEOUT_MS) > 0) {
+                continue;
+            }
+        }
+        LOG_ERROR("Failed to send message to socket " + std::to_string(client_socket));
+        return;
+    }
+}
+
+// Thread mode output coalescing. Threads that send to the same socket take
+// turns: the first one writes its message, then everything the others queued
+// for the socket meanwhile, and only then lets go. A thread that finds the
+// socket busy queues its message and returns at once. An idle socket thus
+// gets a message without delay, and a burst for a busy one goes out in a few
+// gathered writes instead of one send() per message. Messages to a socket
+// are also written whole and in the order they were queued.
+struct SocketOutput {
+    std::mutex mutex;
+    std::vector<Payload> pending;  // Queued while another thread writes
+    bool writing = false;
+};
+
+// The SocketOutput of each descriptor, in blocks allocated when a descriptor
+// in them is first written to; a later connection on the descriptor reuses it
+class SocketOutputs {
+public:
+    static constexpr size_t BLOCK = 1024;
+    static constexpr size_t MAX_BLOCKS = 4096;  // Descriptors above BLOCK * MAX_BLOCKS write directly
+
+    ~SocketOutputs() {
+        for (auto& block : blocks) delete[] block.load();
+    }
+
+    SocketOutput* get(int fd) {
+        size_t index = static_cast<size_t>(fd) / BLOCK;
+        if (fd < 0 || index >= MAX_BLOCKS) return nullptr;
+        SocketOutput* block = blocks[index].load(std::memory_order_acquire);
+        if (!block) {
+            std::lock_guard<std::mutex> lock(grow_mutex);
+            block = blocks[index].load(std::memory_order_relaxed);
+            if (!block) {
+                block = new SocketOutput[BLOCK];
+                blocks[index].store(block, std::memory_order_release);
+            }
+        }
+        return &block[fd % BLOCK];
+    }
+
+private:
+    std::atomic<SocketOutput*> blocks[MAX_BLOCKS] = {};
+    std::mutex grow_mutex;
+};
+SocketOutputs socket_outputs;
+
+void write_message(int client_socket, const Payload& message) {
+    SocketOutput* output = socket_outputs.get(client_socket);
+    if (!output) {
+        write_gathered(client_socket, &message, 1);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(output->mutex);
+        if (output->writing) {
+            output->pending.push_back(message);
+            metrics::add(metrics::Counter::SendsCoalesced);
+            return;
+        }
+        output->writing = true;
+    }
+    write_gathered(client_socket, &message, 1);
+    // Swapped with the socket's queue, so both keep their capacity
+    thread_local std::vector<Payload> batch;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(output->mutex);
+            if (output->pending.empty()) {
+                output->writing = false;
+                return;
+            }
+            batch.swap(output->pending);
+        }
+        write_gathered(client_socket, batch.data(), batch.size());
+        batch.clear();
+    }
+}
+
+// Thread mode: a fan-out to at least --fanout-threshold recipients is cut
+// into chunks and written by the work-stealing fan-out pool
+// (fanout_pool.hpp) together with the sending thread, which returns once
+// every recipient has been written to. Its later messages thus still follow
+// the fan-out, and a slow recipient holds up only its own chunk.
+fanout_pool::Pool fanout;
+
+void write_sends(const std::vector<std::pair<int, Payload>>& sends) {
+    if (config.fanout_threshold == 0 || sends.size() < config.fanout_threshold) {
+        for (const auto& [sock, message] : sends) {
+            write_message(sock, message);
+        }
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    fanout_pool::Job job;
+    job.write = [](const void* context, size_t begin, size_t end) {
+        const auto& sends = *static_cast<const std::vector<std::pair<int, Payload>>*>(context);
+        for (size_t i = begin; i < end; i++) {
+            write_message(sends[i].first, sends[i].second);
+        }
+    };
+    job.context = &sends;
+    fanout.run(job, sends.size(), std::clamp<size_t>(config.fanout_threshold / 4, 1, FANOUT_CHUNK));
+    metrics::local().fanout_completion.observe(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+// Thread mode: while a DeferredSends is alive on this thread, send_message
+// only collects messages; they are written when it goes out of scope, after
+// the handler has released clients_mutex. The outermost one collects into a
+// per-thread list that keeps its capacity from command to command.
+thread_local std::vector<std::pair<int, Payload>>* deferred_sends = nullptr;
+thread_local std::vector<std::pair<int, Payload>> deferred_buffer;
+
+class DeferredSends {
+public:
+    DeferredSends() : outer(deferred_sends) { deferred_sends = outer ? &nested : &deferred_buffer; }
+    ~DeferredSends() {
+        std::vector<std::pair<int, Payload>>& sends = *deferred_sends;
+        deferred_sends = outer;
+        write_sends(sends);
+        sends.clear();
+    }
+    DeferredSends(const DeferredSends&) = delete;
+    DeferredSends& operator=(const DeferredSends&) = delete;
+
+private:
+    std::vector<std::pair<int, Payload>>* outer;
+    std::vector<std::pair<int, Payload>> nested;
+};
+
+// Utility function to send a message to a client socket. Reactor sockets
+// only get the message queued on their shard; no socket I/O happens here.
+void send_message(int client_socket, const Payload& message) {
+    int owner = owner_of(client_socket);
+    if (owner >= 0) {
+        deliver_on_shard(owner, client_socket, message);
+    } else if (deferred_sends) {
+        deferred_sends->emplace_back(client_socket, message);
+    } else {
+        write_message(client_socket, message);
+    }
+}
+
+void send_message(int client_socket, std::string_view message) {
+    send_message(client_socket, make_payload(message));
+}
+
+// Sends a message to every authenticated client except exclude_socket
+void broadcast_message(const Payload& payload, int exclude_socket) {
+    if (current_shard >= 0) {
+        broadcast_to_shards(payload, exclude_socket);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    for (const auto& [sock, user] : clients) {
+        if (sock != exclude_socket) {
+            send_message(sock, payload);
+        }
+    }
+}
+
+// --- Cluster mode ---
+// Several server processes serve one chat. Every node tells every other which
+// users have sessions on it and which groups have members on it, and keeps
+// what the others told it in a directory: a node mask per user and per
+// group. A message for a user or group with sessions elsewhere is forwarded
+// to exactly those nodes over a binary link (cluster_wire.hpp); a group
+// message crosses to a node once, however many members it has there, and
+// that node fans it out. Broadcasts and presence deltas go to every node.
+//
+// Each node dials every other one and only ever writes on that connection;
+// a connection a peer dialled is only read. Each direction thus has a socket
+// of its own, and nodes need not agree on who dials. A link starts with a
+// Hello and the sender's whole state, so a node that restarts or reconnects
+// is brought up to date, and a node whose link closes is forgotten.
+// Frames for a peer are queued in one buffer and its writer thread sends
+// whatever has built up in one send(), so load batches itself per node.
+#define CLUSTER_MAX_NODES 64          // Nodes are the bits of a uint64_t mask
+#define CLUSTER_RETRY_MS 500          // Wait between attempts to reach a peer
+#define CLUSTER_QUEUE_BYTES (32 << 20)  // Queued for one peer before frames to it are dropped
+#define CLUSTER_READ_BYTES 65536
+
+class Cluster {
+public:
+    // Listens on addresses[self] and starts dialling every other address;
+    // false if an address is invalid or the listener cannot be opened
+    bool start(int self_id, const std::vector<std::string>& addresses) {
+        if (addresses.size() > CLUSTER_MAX_NODES || self_id < 0 || self_id >= static_cast<int>(addresses.size())) {
+            LOG_ERROR("Cluster node id must index at most " + std::to_string(CLUSTER_MAX_NODES) + " addresses");
+            return false;
+        }
+        self = self_id;
+        std::vector<sockaddr_in> resolved(addresses.size());
+        for (size_t node = 0; node < addresses.size(); node++) {
+            size_t colon = addresses[node].rfind(':');
+            resolved[node].sin_family = AF_INET;
+            if (colon == std::string::npos ||
+                inet_pton(AF_INET, addresses[node].substr(0, colon).c_str(), &resolved[node].sin_addr) != 1) {
+                LOG_ERROR("Invalid cluster address " + addresses[node] + ", expected IPv4:port");
+                return false;
+            }
+            resolved[node].sin_port = htons(std::atoi(addresses[node].c_str() + colon + 1));
+        }
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (listener < 0 || bind(listener, (sockaddr*)&resolved[self], sizeof(resolved[self])) < 0 ||
+            listen(listener, CLUSTER_MAX_NODES) < 0) {
+            LOG_ERROR("Failed to open cluster link port " + addresses[self]);
+            return false;
+        }
+        for (size_t node = 0; node < addresses.size(); node++) {
+            peers.push_back(std::make_unique<Peer>());
+        }
+        for (size_t node = 0; node < addresses.size(); node++) {
+            if (static_cast<int>(node) != self) {
+                std::thread([this, node, address = resolved[node]] { dial(node, address); }).detach();
+            }
+        }
+        std::thread([this, listener] {
+            while (true) {
+                int link = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (link >= 0) {
+                    std::thread([this, link] { read_link(link); }).detach();
+                } else if (errno != EINTR) {
+                    LOG_ERROR("Error accepting cluster link.");
+                }
+            }
+        }).detach();
+        LOG_INFO("Cluster node " + std::to_string(self) + " of " + std::to_string(addresses.size()) + " on " +
+                 addresses[self]);
+        return true;
+    }
+
+    bool enabled() const { return !peers.empty(); }
+
+    // A local user's first session opened or last one closed; called with clients_mutex held
+    void user_changed(std::string_view username, bool online) {
+        send_all(online ? cluster_wire::Type::UserOnline : cluster_wire::Type::UserOffline, {username});
+    }
+
+    // A group got its first local member or lost its last. Called by the
+    // thread that changed the group, under the group's index shard lock or on
+    // its owning shard, so the changes of one group arrive in order.
+    void group_changed(std::string_view name, bool present) {
+        std::lock_guard<std::mutex> lock(local_groups_mutex);
+        if (present) {
+            local_groups.emplace(name);
+        } else if (auto it = local_groups.find(name); it != local_groups.end()) {
+            local_groups.erase(it);
+        }
+        send_all(present ? cluster_wire::Type::GroupPresent : cluster_wire::Type::GroupAbsent, {name});
+    }
+
+    // Other nodes the user has sessions on
+    uint64_t nodes_of_user(std::string_view username) const {
+        std::shared_lock<std::shared_mutex> lock(directory_mutex);
+        auto it = user_nodes.find(username);
+        return it == user_nodes.end() ? 0 : it->second;
+    }
+
+    bool group_elsewhere(std::string_view name) const {
+        std::shared_lock<std::shared_mutex> lock(directory_mutex);
+        return group_nodes.count(name) > 0;
+    }
+
+    void forward_private(uint64_t nodes, std::string_view recipient, const Payload& line) {
+        for (int node = 0; nodes; node++, nodes >>= 1) {
+            if (nodes & 1) send(node, cluster_wire::Type::Private, {recipient, line.view()});
+        }
+    }
+
+    // One frame to every other node with members of the group
+    void forward_group(std::string_view name, const Payload& line) {
+        uint64_t nodes;
+        {
+            std::shared_lock<std::shared_mutex> lock(directory_mutex);
+            auto it = group_nodes.find(name);
+            if (it == group_nodes.end()) return;
+            nodes = it->second;
+        }
+        for (int node = 0; nodes; node++, nodes >>= 1) {
+            if (nodes & 1) send(node, cluster_wire::Type::Group, {name, line.view()});
+        }
+    }
+
+    void forward_broadcast(const Payload& line) {
+        send_all(cluster_wire::Type::Broadcast, {line.view()});
+    }
+
+    size_t links_up() const {
+        size_t up = 0;
+        for (const auto& peer : peers) up += peer->connected.load(std::memory_order_relaxed);
+        return up;
+    }
+
+    std::atomic<uint64_t> frames_sent{0};
+    std::atomic<uint64_t> batches_sent{0};  // send() calls; frames_sent / batches_sent is the batching
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> frames_received{0};
+    std::atomic<uint64_t> frames_dropped{0};  // The link was down or its queue full
+
+private:
+    using NodeMap = std::unordered_map<std::string, uint64_t, StringHash, std::equal_to<>>;
+
+    struct Peer {
+        std::mutex mutex;  // queued and connected; taken last, after clients_mutex or a group index shard
+        std::condition_variable wakeup;
+        std::atomic<bool> connected{false};
+        std::string queued;  // Frames not yet handed to the socket
+        uint64_t link = 0;   // Incremented by each Hello read from the node, under directory_mutex
+    };
+
+    void send(int node, cluster_wire::Type type, std::initializer_list<std::string_view> fields) {
+        Peer& peer = *peers[node];
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(peer.mutex);
+            if (!peer.connected.load(std::memory_order_relaxed) || peer.queued.size() > CLUSTER_QUEUE_BYTES) {
+                frames_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            wake = peer.queued.empty();
+            cluster_wire::append(peer.queued, type, fields);
+        }
+        frames_sent.fetch_add(1, std::memory_order_relaxed);
+        if (wake) peer.wakeup.notify_one();
+    }
+
+    void send_all(cluster_wire::Type type, std::initializer_list<std::string_view> fields) {
+        for (int node = 0; node < static_cast<int>(peers.size()); node++) {
+            if (node != self) send(node, type, fields);
+        }
+    }
+
+    // Keeps a link to the node open, reconnecting whenever it drops, and
+    // writes everything queued for it
+    void dial(int node, sockaddr_in address) {
+        Peer& peer = *peers[node];
+        std::string sending;
+        while (true) {
+            int link = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (link < 0 || connect(link, (sockaddr*)&address, sizeof(address)) < 0) {
+                if (link >= 0) close(link);
+                std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_RETRY_MS));
+                continue;
+            }
+            int one = 1;
+            setsockopt(link, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            introduce(peer);
+            LOG_INFO("Cluster link to node " + std::to_string(node) + " is up");
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(peer.mutex);
+                    peer.wakeup.wait(lock, [&peer] { return !peer.queued.empty(); });
+                    sending.swap(peer.queued);
+                }
+                if (!write_all(link, sending)) break;
+                batches_sent.fetch_add(1, std::memory_order_relaxed);
+                bytes_sent.fetch_add(sending.size(), std::memory_order_relaxed);
+                sending.clear();
+            }
+            {
+                std::lock_guard<std::mutex> lock(peer.mutex);
+                peer.connected.store(false, std::memory_order_relaxed);
+                peer.queued.clear();
+            }
+            sending.clear();
+            close(link);
+            LOG_ERROR("Cluster link to node " + std::to_string(node) + " lost");
+        }
+    }
+
+    // Opens a link with Hello and this node's users and groups. Changes
+    // made from here on are queued behind them: users are listed under
+    // clients_mutex and groups under local_groups_mutex, the locks their
+    // changes are announced under.
+    void introduce(Peer& peer) {
+        {
+            std::lock_guard<std::mutex> clients_lock(clients_mutex);
+            std::lock_guard<std::mutex> lock(peer.mutex);
+            peer.queued.clear();
+            peer.connected.store(true, std::memory_order_relaxed);
+            cluster_wire::append(peer.queued, cluster_wire::Type::Hello, {std::to_string(self)});
+            for (const auto& [username, sessions] : user_sockets) {
+                cluster_wire::append(peer.queued, cluster_wire::Type::UserOnline, {username});
+            }
+        }
+        {
+            std::lock_guard<std::mutex> groups_lock(local_groups_mutex);
+            std::lock_guard<std::mutex> lock(peer.mutex);
+            for (const std::string& name : local_groups) {
+                cluster_wire::append(peer.queued, cluster_wire::Type::GroupPresent, {name});
+            }
+        }
+        peer.wakeup.notify_one();
+    }
+
+    static bool write_all(int link, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t sent = ::send(link, data.data(), data.size(), MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            data.remove_prefix(sent);
+        }
+        return true;
+    }
+
+    // Reads the frames a peer sends on a link it dialled. The deliveries of
+    // everything one recv() brought in are handed to the shards together.
+    void read_link(int link) {
+        std::string buffer;
+        size_t start = 0;
+        int node = -1;
+        uint64_t generation = 0;
+        std::vector<std::pair<int, Payload>> sends;
+        bool broken = false;
+        while (!broken) {
+            size_t filled = buffer.size();
+            buffer.resize(filled + CLUSTER_READ_BYTES);
+            ssize_t received = recv(link, buffer.data() + filled, CLUSTER_READ_BYTES, 0);
+            if (received < 0 && errno == EINTR) {
+                buffer.resize(filled);
+                continue;
+            }
+            if (received <= 0) break;
+            buffer.resize(filled + received);
+            cluster_wire::Frame frame;
+            while (size_t used = cluster_wire::parse(buffer.data() + start, buffer.size() - start, frame)) {
+                if (used == SIZE_MAX || (node < 0) != (frame.type == cluster_wire::Type::Hello) ||
+                    (node < 0 && !hello(frame.fields[0], node, generation))) {
+                    broken = true;
+                    break;
+                }
+                if (frame.type != cluster_wire::Type::Hello) apply(node, frame, sends);
+                start += used;
+                frames_received.fetch_add(1, std::memory_order_relaxed);
+            }
+            deliver_from_outside(sends);
+            buffer.erase(0, start);
+            start = 0;
+        }
+        close(link);
+        if (node >= 0) {
+            std::unique_lock<std::shared_mutex> lock(directory_mutex);
+            // A newer link from a restarted node may already have replaced this one
+            if (peers[node]->link == generation) forget(node);
+            LOG_ERROR("Cluster link from node " + std::to_string(node) + " closed");
+        }
+    }
+
+    // Accepts a link's Hello: the node starts over, as its state follows
+    bool hello(std::string_view id_text, int& node, uint64_t& generation) {
+        int id = -1;
+        std::from_chars(id_text.data(), id_text.data() + id_text.size(), id);
+        if (id < 0 || id >= static_cast<int>(peers.size()) || id == self) {
+            LOG_ERROR("Cluster link with an invalid node id");
+            return false;
+        }
+        node = id;
+        std::unique_lock<std::shared_mutex> lock(directory_mutex);
+        generation = ++peers[node]->link;
+        forget(node);
+        LOG_INFO("Cluster link from node " + std::to_string(node) + " is up");
+        return true;
+    }
+
+    // Drops everything known about a node; called with directory_mutex held
+    void forget(int node) {
+        uint64_t bit = uint64_t{1} << node;
+        for (NodeMap* map : {&user_nodes, &group_nodes}) {
+            for (auto it = map->begin(); it != map->end();) {
+                it->second &= ~bit;
+                it = it->second ? std::next(it) : map->erase(it);
+            }
+        }
+    }
+
+    static void mark(NodeMap& map, std::string_view name, uint64_t bit, bool present) {
+        auto it = map.find(name);
+        if (present) {
+            if (it == map.end()) it = map.emplace(std::string(name), 0).first;
+            it->second |= bit;
+        } else if (it != map.end() && !(it->second &= ~bit)) {
+            map.erase(it);
+        }
+    }
+
+    void apply(int node, const cluster_wire::Frame& frame, std::vector<std::pair<int, Payload>>& sends) {
+        uint64_t bit = uint64_t{1} << node;
+        std::string_view name = frame.fields[0];
+        switch (frame.type) {
+        case cluster_wire::Type::UserOnline:
+        case cluster_wire::Type::UserOffline: {
+            std::unique_lock<std::shared_mutex> lock(directory_mutex);
+            mark(user_nodes, name, bit, frame.type == cluster_wire::Type::UserOnline);
+            break;
+        }
+        case cluster_wire::Type::GroupPresent:
+        case cluster_wire::Type::GroupAbsent: {
+            std::unique_lock<std::shared_mutex> lock(directory_mutex);
+            mark(group_nodes, name, bit, frame.type == cluster_wire::Type::GroupPresent);
+            break;
+        }
+        case cluster_wire::Type::Private: {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            auto it = user_sockets.find(name);
+            if (it != user_sockets.end()) {
+                Payload line = make_payload(frame.fields[1]);
+                for (int sock : it->second) sends.emplace_back(sock, line);
+            } else if (offline.enabled()) {
+                offline.push(name, frame.fields[1]);  // Logged out while the message was on its way
+            }
+            break;
+        }
+        case cluster_wire::Type::Group:
+            if (post_group_line(name, frame.fields[1])) {
+                // Owned groups: the owning shard fans the line out
+            } else if (MemberList members = groups.members(name)) {
+                Payload line = make_payload(frame.fields[1]);
+                for (int sock : *members) sends.emplace_back(sock, line);
+                metrics::local().fanout[static_cast<size_t>(metrics::Fanout::Group)].observe(members->size());
+            }
+            break;
+        case cluster_wire::Type::Broadcast:
+            broadcast_from_outside(make_payload(name));
+            break;
+        case cluster_wire::Type::Hello:
+            break;
+        }
+    }
+
+    int self = -1;
+    std::vector<std::unique_ptr<Peer>> peers;  // By node id; this node's own entry is unused
+    mutable std::shared_mutex directory_mutex;
+    NodeMap user_nodes;   // Other nodes each user has sessions on
+    NodeMap group_nodes;  // Other nodes each group has members on
+    std::mutex local_groups_mutex;  // Taken before a peer's mutex
+    std::unordered_set<std::string, StringHash, std::equal_to<>> local_groups;  // Groups with members here
+};
+Cluster cluster;
+
+void announce_group(std::string_view name, bool present) {
+    if (cluster.enabled()) cluster.group_changed(name, present);
+}
+
+// Presence: who is online, announced in batches. A user comes online with
+// their first session and goes offline with their last; each change is
+// recorded under clients_mutex and netted per user, so someone who drops
+// and reconnects within an interval is not announced at all. A background
+// thread sends everyone one delta per PRESENCE_INTERVAL_MS that had changes,
+// rather than one notice to every client per login and logout, and applies
+// it to the roster. The roster is kept serialized as the payload new
+// sessions are sent, so a login sends it by reference instead of walking clients.
+class Presence {
+public:
+    // Both called with clients_mutex held, which orders them
+    void joined(std::string_view username) { record(username, true); }
+    void left(std::string_view username) { record(username, false); }
+
+    // "Currently online users: ..." as of the last delta, without username,
+    // who is listed if they had a session already or came back within the
+    // interval; empty while nobody else is online. Only then is the line copied,
+    // with the name cut out at its recorded offset.
+    Payload roster(std::string_view username) const {
+        std::shared_ptr<const Roster> current;
+        {
+            std::lock_guard<std::mutex> lock(roster_mutex);
+            current = published;
+        }
+        if (!current) return Payload();
+        auto it = current->offsets.find(username);
+        if (it == current->offsets.end()) return current->text;
+        std::string_view text = current->text.view();
+        size_t start = it->second;
+        size_t end = start + username.size();
+        if (end + 1 < text.size()) {
+            return make_payload({text.substr(0, start), text.substr(end + 2)});  // Drops "name, "
+        }
+        if (start == ROSTER_HEADING.size()) return Payload();  // The only name
+        return make_payload({text.substr(0, start - 2), "\n"});  // The last name and the ", " before it
+    }
+
+    void start() {
+        std::thread([this] { run(); }).detach();
+    }
+
+private:
+    using Changes = std::unordered_map<std::string, bool, StringHash, std::equal_to<>>;
+
+    static constexpr std::string_view ROSTER_HEADING = "Currently online users: ";
+
+    // The published roster line and where each name starts in it; the keys
+    // are views into the line
+    struct Roster {
+        Payload text;
+        std::unordered_map<std::string_view, size_t> offsets;
+    };
+
+    void record(std::string_view username, bool online) {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto it = pending.find(username);
+            if (it != pending.end()) {
+                pending.erase(it);  // Undoes the opposite change from this interval
+            } else {
+                pending.emplace(username, online);
+            }
+        }
+        wakeup.notify_one();
+    }
+
+    void run() {
+        Changes changes;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(pending_mutex);
+                wakeup.wait(lock, [this] { return !pending.empty(); });
+            }
+            // Whatever else changes during the interval joins this delta
+            std::this_thread::sleep_for(std::chrono::milliseconds(PRESENCE_INTERVAL_MS));
+            {
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                changes.swap(pending);
+            }
+            if (!changes.empty()) {
+                flush(changes);
+                changes.clear();
+            }
+        }
+    }
+
+    void flush(const Changes& changes) {
+        std::vector<std::string_view> joins, leaves;
+        for (const auto& [username, online] : changes) {
+            if (online) {
+                joins.push_back(username);
+                positions[username] = names.size();
+                names.push_back(username);
+            } else {
+                leaves.push_back(username);
+                auto it = positions.find(username);
+                if (it == positions.end()) continue;
+                size_t position = it->second;
+                positions.erase(it);
+                if (position + 1 != names.size()) {
+                    names[position] = std::move(names.back());
+                    positions[names[position]] = position;
+                }
+                names.pop_back();
+            }
+        }
+        std::shared_ptr<Roster> roster;
+        if (!names.empty()) {
+            std::string serialized(ROSTER_HEADING);
+            for (const std::string& username : names) {
+                serialized.append(username).append(", ");
+            }
+            serialized.replace(serialized.size() - 2, 2, "\n");
+            roster = std::make_shared<Roster>();
+            roster->text = make_payload(serialized);
+            roster->offsets.reserve(names.size());
+            size_t offset = ROSTER_HEADING.size();
+            for (const std::string& username : names) {
+                roster->offsets.emplace(roster->text.view().substr(offset, username.size()), offset);
+                offset += username.size() + 2;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(roster_mutex);
+            published = std::move(roster);
+        }
+        std::sort(joins.begin(), joins.end());
+        std::sort(leaves.begin(), leaves.end());
+        std::string delta;
+        append_names(delta, "Joined the chat: ", joins);
+        append_names(delta, "Left the chat: ", leaves);
+        Payload payload = make_payload(delta);
+        // A joining user's sessions are not told of their own join: they get
+        // the delta without their name, if anything is left of it
+        joining.clear();
+        if (!joins.empty()) {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            for (size_t i = 0; i < joins.size(); i++) {
+                auto it = user_sockets.find(joins[i]);
+                if (it == user_sockets.end()) continue;
+                for (int sock : it->second) joining.emplace_back(sock, i);
+            }
+        }
+        std::vector<int> joined_sockets;
+        sends.clear();
+        Payload own;
+        for (size_t i = 0; i < joining.size(); i++) {
+            auto [sock, join] = joining[i];
+            joined_sockets.push_back(sock);
+            if (i == 0 || joining[i - 1].second != join) {
+                std::string text;
+                append_names(text, "Joined the chat: ", joins, joins[join]);
+                append_names(text, "Left the chat: ", leaves);
+                own = text.empty() ? Payload() : make_payload(text);
+            }
+            if (own) sends.emplace_back(sock, own);
+        }
+        broadcast_from_outside(payload, std::move(joined_sockets));
+        deliver_from_outside(sends);
+        if (cluster.enabled()) cluster.forward_broadcast(payload);
+        metrics::add(metrics::Counter::PresenceUpdates);
+    }
+
+    // One line of sorted names but skip, the ones past PRESENCE_MAX_NAMES only counted
+    static void append_names(std::string& out, std::string_view heading, const std::vector<std::string_view>& names,
+                             std::string_view skip = {}) {
+        size_t count = names.size() - (!skip.empty() && std::binary_search(names.begin(), names.end(), skip));
+        if (count == 0) return;
+        out.append(heading);
+        size_t shown = std::min<size_t>(count, PRESENCE_MAX_NAMES);
+        size_t written = 0;
+        for (std::string_view name : names) {
+            if (written == shown) break;
+            if (name == skip) continue;
+            out.append(name).append(++written < shown ? ", " : "");
+        }
+        if (shown < count) {
+            out.append(" and ").append(std::to_string(count - shown)).append(" more");
+        }
+        out.append("\n");
+    }
+
+    std::mutex pending_mutex;  // Taken inside clients_mutex
+    std::condition_variable wakeup;
+    Changes pending;
+    // The roster, touched only by the presence thread, and its published form
+    std::vector<std::string> names;
+    std::unordered_map<std::string, size_t, StringHash, std::equal_to<>> positions;
+    mutable std::mutex roster_mutex;
+    std::shared_ptr<const Roster> published;
+    // Sessions of the joining users, by index into the sorted joins, and their own deltas
+    std::vector<std::pair<int, size_t>> joining;
+    std::vector<std::pair<int, Payload>> sends;
+};
+Presence presence;
+
+// --- Command processing functions ---
+// Each handler gets the command already split by parse_command(); the
+// arguments are views into the received line.
+void processPrivateMessage(int client_socket, const CommandArgs& args, const std::string& username) {
+    if (!args.has_text) {
+        send_message(client_socket, "Invalid /msg syntax. Use: /msg <username> <message>\n");
+        LOG_ERROR("Invalid /msg syntax from user " + username);
+        return;
+    }
+    std::string_view recipient = args.target;
+    auto format = [&] {
+        return history.enabled()
+            ? history.append(message_log::Kind::Inbox, recipient, [&](std::string_view seq) {
+                  return make_payload({"#", seq, " [", username, "]: ", args.text, "\n"});
+              })
+            : make_payload({"[", username, "]: ", args.text, "\n"});
+    };
+
+    // Other cluster nodes the recipient has sessions on get one copy each
+    uint64_t remote_nodes = cluster.enabled() ? cluster.nodes_of_user(recipient) : 0;
+    bool user_found = remote_nodes != 0;
+    Payload formatted;
+    std::optional<offline_inbox::Result> queued;
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        auto it = user_sockets.find(recipient);
+        if (it != user_sockets.end()) {
+            // Delivered to every session the recipient is logged in on
+            formatted = format();
+            for (int sock : it->second) {
+                send_message(sock, formatted);
+            }
+            metrics::local().fanout[static_cast<size_t>(metrics::Fanout::Private)].observe(it->second.size());
+            user_found = true;
+            LOG_INFO("Private message from ", username, " to ", recipient);
+        } else if (!remote_nodes && offline.enabled() && users.load(std::memory_order_acquire)->contains(recipient)) {
+            // Queued under clients_mutex, so the recipient's login either
+            // takes it with the rest of the queue or was already live for it
+            queued = offline.push(recipient, format().view());
+        }
+    }
+    if (remote_nodes) {
+        cluster.forward_private(remote_nodes, recipient, formatted ? formatted : format());
+        LOG_INFO("Private message from ", username, " to ", recipient, " forwarded to other nodes");
+    }
+    if (queued) {
+        if (*queued == offline_inbox::Result::Full) {
+            send_message(client_socket, concat({"User ", recipient, " is offline and their inbox is full.\n"}));
+            LOG_ERROR("Offline inbox of ", recipient, " full for private message from ", username);
+        } else {
+            send_message(client_socket,
+                         concat({"User ", recipient, " is offline; the message will be delivered at their next login.\n"}));
+            LOG_INFO("Private message from ", username, " to ", recipient, " queued offline");
+        }
+    } else if (!user_found) {
+        send_message(client_socket, "User not found.\n");
+        LOG_ERROR("User ", recipient, " not found for private message from ", username);
+    }
+}
+
+void processBroadcastMessage(int client_socket, const CommandArgs& args, const std::string& username) {
+    Payload formatted = make_payload({"[", username, "]: ", args.rest, "\n"});
+    broadcast_message(formatted, client_socket);
+    if (cluster.enabled()) cluster.forward_broadcast(formatted);
+    size_t online = clients_online.load(std::memory_order_relaxed);
+    metrics::local().fanout[static_cast<size_t>(metrics::Fanout::Broadcast)].observe(online > 0 ? online - 1 : 0);
+    LOG_INFO("Broadcast message from ", username);
+}
+
+// The group handlers run against the shared registry, or with --groups owned
+// against the owning shard's OwnedGroups
+template <typename Registry>
+void processCreateGroup(Registry& registry, int client_socket, const CommandArgs& args, const std::string& username) {
+    if (!args.has_rest) {
+        send_message(client_socket, "Invalid syntax. Use: /create_group <group_name>\n");
+        LOG_ERROR("Invalid /create_group syntax from " + username);
+        return;
+    }
+    std::string group_name(args.rest);
+    // A group with members on other cluster nodes exists as well; it is joined, not created
+    if ((cluster.enabled() && cluster.group_elsewhere(group_name)) ||
+        registry.create(group_name, client_socket) == GroupRegistry::Result::Exists) {
+        send_message(client_socket, "Group " + group_name + " already exists.\n");
+        LOG_ERROR("Group creation failed: " + group_name + " already exists. User: " + username);
+    } else {
+        // Creator is the first member
+        send_message(client_socket, "Group " + group_name + " created.\n");
+        LOG_INFO("Group " + group_name + " created by " + username);
+    }
+}
+
+template <typename Registry>
+void processJoinGroup(Registry& registry, int client_socket, const CommandArgs& args, const std::string& username) {
+    if (!args.has_rest) {
+        send_message(client_socket, "Invalid syntax. Use: /join_group <group_name>\n");
+        LOG_ERROR("Invalid /join_group syntax from " + username);
+        return;
+    }
+    std::string group_name(args.rest);
+    typename Registry::Members members;
+    GroupRegistry::Result result = registry.join(group_name, client_socket, members);
+    // The first member on this node of a group that has members on other nodes
+    if (result == GroupRegistry::Result::NoGroup && cluster.enabled() && cluster.group_elsewhere(group_name) &&
+        registry.create(group_name, client_socket) == GroupRegistry::Result::Ok) {
+        result = GroupRegistry::Result::Ok;
+        members = registry.members(group_name);
+    }
+    switch (result) {
+    case GroupRegistry::Result::AlreadyMember:
+        send_message(client_socket, "You are already in group " + group_name + ".\n");
+        LOG_INFO(username + " attempted to rejoin group " + group_name);
+        break;
+    case GroupRegistry::Result::Ok: {
+        send_message(client_socket, "You joined the group " + group_name + ".\n");
+        LOG_INFO(username + " joined group " + group_name);
+        // Notify existing group members about the new member
+        Payload notice = make_payload({username, " has joined the group ", group_name, ".\n"});
+        for (int member_socket : *members) {
+            if (member_socket != client_socket) {
+                send_message(member_socket, notice);
+            }
+        }
+        if (cluster.enabled()) cluster.forward_group(group_name, notice);
+        break;
+    }
+    default:
+        send_message(client_socket, "Group " + group_name + " does not exist.\n");
+        LOG_ERROR("Join group failed: Group " + group_name + " does not exist for user " + username);
+        break;
+    }
+}
+
+template <typename Registry>
+void processLeaveGroup(Registry& registry, int client_socket, const CommandArgs& args, const std::string& username) {
+    if (!args.has_rest) {
+        send_message(client_socket, "Invalid syntax. Use: /leave_group <group_name>\n");
+        LOG_ERROR("Invalid /leave_group syntax from " + username);
+        return;
+    }
+    std::string group_name(args.rest);
+    typename Registry::Members members;
+    switch (registry.leave(group_name, client_socket, members)) {
+    case GroupRegistry::Result::NotMember:
+        send_message(client_socket, "You are not in group " + group_name + ".\n");
+        LOG_ERROR(username + " attempted to leave group " + group_name + " but was not a member");
+        break;
+    case GroupRegistry::Result::Ok: {
+        send_message(client_socket, "You left the group " + group_name + ".\n");
+        LOG_INFO(username + " left group " + group_name);
+        // Notify remaining members in the group
+        Payload notice = make_payload({username, " has left the group ", group_name, ".\n"});
+        for (int member_socket : *members) {
+            send_message(member_socket, notice);
+        }
+        // The registry removes a group when it becomes empty
+        if (members->empty()) {
+            LOG_INFO("Group " + group_name + " removed as it became empty.");
+        }
+        break;
+    }
+    default:
+        send_message(client_socket, "Group " + group_name + " does not exist.\n");
+        LOG_ERROR("Leave group failed: Group " + group_name + " does not exist for user " + username);
+        break;
+    }
+}
+
+template <typename Registry>
+void processGroupMessage(Registry& registry, int client_socket, const CommandArgs& args, const std::string& username) {
+    if (!args.has_text) {
+        send_message(client_socket, "Invalid syntax. Use: /group_msg <group_name> <message>\n");
+        LOG_ERROR("Invalid /group_msg syntax from " + username);
+        return;
+    }
+    std::string_view group_name = args.target;
+
+    // Fans out from a membership snapshot (or the owner's own set); no lock is held while sending
+    typename Registry::Members members = registry.members(group_name);
+    if (!members) {
+        send_message(client_socket, concat({"Group ", group_name, " does not exist.\n"}));
+        LOG_ERROR("Group message failed: Group ", group_name, " does not exist for user ", username);
+    } else if (!members->count(client_socket)) {
+        send_message(client_socket, concat({"You are not a member of group ", group_name, ".\n"}));
+        LOG_ERROR(username, " attempted to send a group message to ", group_name, " but is not a member");
+    } else {
+        Payload formatted = history.enabled()
+            ? history.append(message_log::Kind::Group, group_name, [&](std::string_view seq) {
+                  return make_payload({"#", seq, " [", username, "][Group ", group_name, "]: ", args.text, "\n"});
+              })
+            : make_payload({"[", username, "][Group ", group_name, "]: ", args.text, "\n"});
+        for (int sock : *members) {
+            if (sock != client_socket) {
+                send_message(sock, formatted);
+            }
+        }
+        metrics::local().fanout[static_cast<size_t>(metrics::Fanout::Group)].observe(members->size() - 1);
+        if (cluster.enabled()) cluster.forward_group(group_name, formatted);
+        LOG_INFO(username, " sent a group message to group ", group_name);
+    }
+}
+
+// Sends the logged messages of a stream after sequence number after_text in
+// one payload: whole runs of records copied from the log's segments, then a
+// line saying where the replay ended
+void replay_history(int client_socket, message_log::Kind kind, std::string_view name, std::string_view after_text,
+                    std::string_view resume_command) {
+    uint64_t after = 0;
+    if (std::from_chars(after_text.data(), after_text.data() + after_text.size(), after).ptr !=
+        after_text.data() + after_text.size()) {
+        send_message(client_socket, concat({"Invalid sequence number. Use: ", resume_command, "<last_seen>\n"}));
+        return;
+    }
+    std::string replayed;
+    size_t limit = std::min<size_t>(REPLAY_MAX_BYTES, config.queue_limit / 2);
+    uint64_t last = history.read(kind, name, after, limit, [&](std::string_view records) { replayed.append(records); });
+    std::string end = std::to_string(last);
+    if (last < history.last_seq(kind, name)) {
+        replayed.append(concat({"Replay paused at #", end, "; send ", resume_command, end, " for more.\n"}));
+    } else {
+        replayed.append(concat({"Replay complete at #", end, ".\n"}));
+    }
+    send_message(client_socket, make_payload(replayed));
+}
+
+// /resume_group <group_name> <last_seen>: the group's messages after last_seen, for members
+template <typename Registry>
+void processResumeGroup(Registry& registry, int client_socket, const CommandArgs& args, const std::string& username) {
+    if (!args.has_text) {
+        send_message(client_socket, "Invalid syntax. Use: /resume_group <group_name> <last_seen>\n");
+        LOG_ERROR("Invalid /resume_group syntax from " + username);
+        return;
+    }
+    if (!history.enabled()) {
+        send_message(client_socket, "Message history is disabled on this server.\n");
+        return;
+    }
+    typename Registry::Members members = registry.members(args.target);
+    if (!members || !members->count(client_socket)) {
+        send_message(client_socket, concat({"You are not a member of group ", args.target, ".\n"}));
+        LOG_ERROR(username, " attempted to replay group ", args.target, " without being a member");
+        return;
+    }
+    replay_history(client_socket, message_log::Kind::Group, args.target, args.text,
+                   concat({"/resume_group ", args.target, " "}));
+    LOG_INFO(username, " replayed group ", args.target, " after #", args.text);
+}
+
+// /resume_inbox <last_seen>: the private messages sent to this user after last_seen
+void processResumeInbox(int client_socket, const CommandArgs& args, const std::string& username) {
+    if (!args.has_rest) {
+        send_message(client_socket, "Invalid syntax. Use: /resume_inbox <last_seen>\n");
+        LOG_ERROR("Invalid /resume_inbox syntax from " + username);
+        return;
+    }
+    if (!history.enabled()) {
+        send_message(client_socket, "Message history is disabled on this server.\n");
+        return;
+    }
+    replay_history(client_socket, message_log::Kind::Inbox, username, args.rest, "/resume_inbox ");
+    LOG_INFO(username, " replayed their inbox after #", args.rest);
+}
+
+// Finishes a login whose password has been checked; on success registers
+// the client, sends it the roster and, for a user's first session, queues the
+// join announcement and hands over the messages that arrived while the user
+// was offline
+bool finish_login(int client_socket, const std::string& username, bool verified) {
+    if (verified) {
+        offline_inbox::Batch waiting;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients[client_socket] = username;
+            std::unordered_set<int>& sessions = user_sockets[username];
+            sessions.insert(client_socket);
+            clients_online.store(clients.size(), std::memory_order_relaxed);
+            if (sessions.size() == 1) {
+                presence.joined(username);
+                if (cluster.enabled()) cluster.user_changed(username, true);
+                if (offline.enabled()) waiting = offline.take(username);
+            }
+        }
+        metrics::add(metrics::Counter::AuthSuccess);
+        LOG_INFO("User " + username + " authenticated successfully.");
+
+        send_message(client_socket, "Welcome to the chat server!\n");
+        Payload roster = presence.roster(username);
+        if (roster) {
+            send_message(client_socket, roster);
+        }
+        // All of them in one write; reading a spill file happens here, outside clients_mutex
+        if (size_t count = offline.collect(waiting)) {
+            send_message(client_socket, make_payload(waiting.text));
+            LOG_INFO("Delivered ", std::to_string(count), " offline messages to ", username);
+        }
+        return true;
+    } else {
+        send_message(client_socket, "Authentication failed.\n");
+        metrics::add(metrics::Counter::AuthFailure);
+        LOG_ERROR("Authentication failed for user " + username);
+        return false;
+    }
+}
+
+// Validates credentials and finishes the login
+bool login_client(int client_socket, const std::string& username, const std::string& password) {
+    // Checked against a snapshot of the credentials, before and without clients_mutex
+    return finish_login(client_socket, username, users.load(std::memory_order_acquire)->verify(username, password));
+}
+
+// Thread mode: a blocking socket's receive timeout in seconds (0 blocks forever)
+void set_receive_timeout(int client_socket, int seconds) {
+    timeval timeout{seconds, 0};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Thread mode: blocks until the decoder has a complete command; false on disconnect,
+// oversized input or an unanswered ping. The command is a view into the decoder,
+// valid until the next read. With an idle timeout set as the socket's receive
+// timeout, a client that stays silent that long is sent "/ping" and gets
+// ping_timeout seconds to send anything at all.
+bool read_command(int client_socket, FrameDecoder& decoder, std::string_view& command) {
+    char buffer[BUFFER_SIZE];
+    bool pinged = false;
+    while (!decoder.next(command)) {
+        ssize_t recv_size = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (recv_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (pinged) {
+                metrics::add(metrics::Counter::IdleEvictions);
+                LOG_ERROR("No reply to ping on socket " + std::to_string(client_socket));
+                return false;
+            }
+            send_message(client_socket, "/ping\n");
+            metrics::add(metrics::Counter::PingsSent);
+            set_receive_timeout(client_socket, config.ping_timeout);
+            pinged = true;
+            continue;
+        }
+        if (recv_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (recv_size <= 0) {
+            return false;
+        }
+        if (pinged) {
+            set_receive_timeout(client_socket, config.idle_timeout);
+            pinged = false;
+        }
+        metrics::add(metrics::Counter::BytesReceived, recv_size);
+        if (!decoder.feed(buffer, recv_size)) {
+            send_message(client_socket, "Message too long.\n");
+            LOG_ERROR("Oversized command from socket " + std::to_string(client_socket));
+            return false;
+        }
+    }
+    return true;
+}
+
+// One-command login for clients that do not wait for the prompts:
+// "/login <username> <password>", sent as the first command
+const std::string LOGIN_COMMAND = "/login ";
+
+// The login dialogue of one connection, driven by its commands as they
+// arrive, so it can run on an event loop instead of a blocked thread. It
+// sends the password prompt itself; the caller checks the credentials.
+struct LoginDialogue {
+    enum class Stage { AwaitUsername, AwaitPassword };
+    Stage stage = Stage::AwaitUsername;
+    std::string username;
+    std::string password;
+
+    // Consumes one command; true once both username and password are known
+    bool advance(int client_socket, std::string_view chunk, bool line_mode) {
+        std::string_view line = chunk.substr(0, chunk.find_first_of("\r\n"));
+        if (stage == Stage::AwaitPassword) {
+            password = line;
+            return true;
+        }
+        if (line_mode && line == PROTOCOL_REQUEST) {
+            send_message(client_socket, "Line protocol enabled.\n");
+            return false;
+        }
+        if (line.rfind(LOGIN_COMMAND, 0) == 0) {
+            std::string_view credentials = line.substr(LOGIN_COMMAND.size());
+            size_t space = credentials.find(' ');
+            username = credentials.substr(0, space);
+            password = space == std::string_view::npos ? std::string_view() : credentials.substr(space + 1);
+            return true;
+        }
+        username = line;
+        stage = Stage::AwaitPassword;
+        send_message(client_socket, "Enter password: ");
+        return false;
+    }
+};
+
+// The timers of one event loop: a timing wheel that a periodic timerfd
+// advances every TIMER_TICK_MS. Login deadlines, idle checks and ping
+// timeouts are all wheel timers embedded in their connections, so arming,
+// moving or cancelling one costs a few pointer writes however many are
+// armed, and the loop wakes once per tick rather than once per deadline.
+// The timerfd only runs while some timer is armed.
+class LoopTimers {
+public:
+    bool open() {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        return timer_fd >= 0;
+    }
+
+    int fd() const { return timer_fd; }
+
+    // Wheel time in ticks, advanced when the timerfd fires
+    uint64_t now() const { return wheel.now(); }
+
+    static uint64_t ticks(int seconds) { return static_cast<uint64_t>(seconds) * 1000 / TIMER_TICK_MS; }
+
+    void schedule(TimerWheel::Timer& timer, uint64_t delay_ticks) {
+        if (wheel.size() == 0) {
+            // The wheel stood still while the timerfd was off
+            wheel.advance(clock_tick(), [](TimerWheel::Timer&) {});
+            run(true);
+        }
+        wheel.schedule(timer, delay_ticks);
+    }
+
+    void cancel(TimerWheel::Timer& timer) { wheel.cancel(timer); }
+
+    // Runs when the timerfd fires: passes every expired timer to on_expired
+    template <typename OnExpired>
+    void expire(OnExpired&& on_expired) {
+        uint64_t count;
+        while (read(timer_fd, &count, sizeof(count)) > 0) {}
+        wheel.advance(clock_tick(), on_expired);
+        if (wheel.size() == 0) {
+            run(false);
+        }
+    }
+
+private:
+    static uint64_t clock_tick() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count() / TIMER_TICK_MS;
+    }
+
+    void run(bool on) {
+        itimerspec spec{};
+        if (on) {
+            spec.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+            spec.it_value = spec.it_interval;
+        }
+        timerfd_settime(timer_fd, 0, &spec, nullptr);
+    }
+
+    int timer_fd = -1;
+    TimerWheel wheel{clock_tick()};
+};
+
+void record_login_latency(std::chrono::steady_clock::time_point accepted_at) {
+    metrics::local().login_latency.observe(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - accepted_at).count());
+}
+
+// Removes authenticated clients from clients and from their groups, and
+// queues the leave announcement of users whose last session this was. A
+// batch (e.g. every session evicted in one timer tick) takes clients_mutex
+// once and republishes each affected group once.
+void disconnect_clients(const std::vector<std::pair<int, std::string>>& departing) {
+    std::vector<int> sockets;
+    sockets.reserve(departing.size());
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (const auto& [client_socket, username] : departing) {
+            sockets.push_back(client_socket);
+            clients.erase(client_socket);
+            auto it = user_sockets.find(username);
+            if (it != user_sockets.end()) {
+                it->second.erase(client_socket);
+                if (it->second.empty()) {
+                    user_sockets.erase(it);
+                    presence.left(username);
+                    if (cluster.enabled()) cluster.user_changed(username, false);
+                }
+            }
+        }
+        clients_online.store(clients.size(), std::memory_order_relaxed);
+    }
+    if (!depart_groups(sockets)) {
+        groups.leave_all(sockets);
+    }
+    for (const auto& [client_socket, username] : departing) {
+        LOG_INFO("User " + username + " disconnected.");
+    }
+}
+
+void disconnect_client(int client_socket, const std::string& username) {
+    disconnect_clients({{client_socket, username}});
+}
+
+template <typename Registry>
+void run_group_command(Registry& registry, CommandId command, int client_socket, const CommandArgs& args,
+                       const std::string& username) {
+    switch (command) {
+    case CommandId::CreateGroup:
+        processCreateGroup(registry, client_socket, args, username);
+        break;
+    case CommandId::JoinGroup:
+        processJoinGroup(registry, client_socket, args, username);
+        break;
+    case CommandId::LeaveGroup:
+        processLeaveGroup(registry, client_socket, args, username);
+        break;
+    case CommandId::GroupMessage:
+        processGroupMessage(registry, client_socket, args, username);
+        break;
+    case CommandId::ResumeGroup:
+        processResumeGroup(registry, client_socket, args, username);
+        break;
+    default:
+        break;
+    }
+}
+
+// New function to process a client message using token splitting
+void processClientMessage(int client_socket, std::string_view message, const std::string & username) {
+    CommandArgs args;
+    CommandId command = parse_command(message, args);
+    if (args.name.empty()) {
+        send_message(client_socket, "Empty command received.\n");
+        LOG_ERROR("Empty command received from ", username);
+        return;
+    }
+    auto started = std::chrono::steady_clock::now();
+    // Dispatch on the command resolved by the compile-time perfect hash
+    switch (command) {
+    case CommandId::PrivateMessage:
+        processPrivateMessage(client_socket, args, username);
+        break;
+    case CommandId::Broadcast:
+        processBroadcastMessage(client_socket, args, username);
+        break;
+    case CommandId::CreateGroup:
+    case CommandId::JoinGroup:
+    case CommandId::LeaveGroup:
+    case CommandId::GroupMessage:
+    case CommandId::ResumeGroup:
+        // With --groups owned these run on the shard that owns the group
+        if (!route_group_command(client_socket, command, args, message, username)) {
+            run_group_command(groups, command, client_socket, args, username);
+        }
+        break;
+    case CommandId::Stats:
+        processStats(client_socket, username);
+        break;
+    case CommandId::Pong:
+        break;  // Answers a keepalive ping; receiving it already reset the idle timer
+    case CommandId::ResumeInbox:
+        processResumeInbox(client_socket, args, username);
+        break;
+    case CommandId::Unknown:
+        send_message(client_socket, "Unknown command.\n");
+        LOG_ERROR("Unknown command received from ", username, ": ", message);
+        break;
+    }
+    // Handler time only: thread mode writes after returning, the reactor at the end of its tick
+    metrics::ThreadMetrics& thread_metrics = metrics::local();
+    size_t kind = static_cast<size_t>(command);
+    thread_metrics.commands[kind].add(1);
+    thread_metrics.command_latency[kind].observe(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+}
+
+// Main client handler function. Runs on the client's own thread, which the
+// login loop starts once the credentials have arrived; the decoder may
+// already hold commands pipelined behind them.
+void handle_client(int client_socket, FrameDecoder decoder, LoginDialogue login,
+                   std::chrono::steady_clock::time_point accepted_at) {
+    std::string username = std::move(login.username);
+    bool authenticated;
+    {
+        DeferredSends sends;
+        authenticated = login_client(client_socket, username, login.password);
+    }
+    if (!authenticated) {
+        close(client_socket);
+        metrics::add(metrics::Counter::ConnectionsClosed);
+        return;
+    }
+    record_login_latency(accepted_at);
+    // Keepalive: this thread blocks in recv(), so the idle timer is the socket's receive timeout
+    set_receive_timeout(client_socket, config.idle_timeout);
+
+    // Handle incoming messages
+    std::string_view message;
+    while (read_command(client_socket, decoder, message)) {
+        DeferredSends sends;
+        processClientMessage(client_socket, message, username);
+    }
+
+    // Cleanup after the client disconnects; the socket is closed last so its
+    // descriptor cannot be reused by a new client while still in the clients map
+    {
+        DeferredSends sends;
+        disconnect_client(client_socket, username);
+    }
+    close(client_socket);
+    metrics::add(metrics::Counter::ConnectionsClosed);
+}
+
+// --- Reactor mode ---
+// Per-connection state: the authenticate/recv/dispatch flow of handle_client()
+// driven by readiness events instead of blocking calls on a dedicated thread
+struct Connection {
+    enum class State { LoggingIn, Authenticated, Closing };
+    int fd;
+    State state = State::LoggingIn;
+    LoginDialogue login;
+    std::string username;
+    std::chrono::steady_clock::time_point accepted_at;
+    FrameDecoder decoder;
+    uint32_t generation = 0;  // Tells a reused descriptor apart from its previous owner
+    bool verifying = false;   // Password out on the hashing pool; commands wait in the decoder
+    // The login deadline while logging in, then the idle check or ping
+    // timeout; its data points back at the connection
+    TimerWheel::Timer timer;
+    uint64_t last_input_tick = 0;
+    bool awaiting_pong = false;
+    // Bounded outbound queue, flushed when the socket is writable. out_offset is
+    // how much of the front message is already written; outbound_bytes counts
+    // everything not yet accepted by the kernel, including an in-flight io_uring send.
+    RingQueue<Payload> outbound;
+    size_t outbound_bytes = 0;
+    size_t out_offset = 0;
+    bool flush_pending = false;   // Already on the shard's dirty list this tick
+    bool closing = false;         // Evicted by the overflow policy, closed at the end of the tick
+    bool send_in_flight = false;  // io_uring backend only
+    // MSG_ZEROCOPY (epoll backend): payloads handed to the kernel by reference
+    // stay pinned here until the socket's error queue reports them done.
+    // Each zerocopy sendmsg gets the next id, as numbered by the kernel.
+    bool zerocopy = false;
+    uint32_t zerocopy_next_id = 0;
+    std::deque<std::pair<uint32_t, std::vector<Payload>>> zerocopy_pinned;
+};
+
+// --- io_uring backend ---
+// A minimal io_uring on top of the raw system calls (no liburing): a
+// submission/completion ring pair plus a group of provided receive buffers
+// that multishot recv picks from.
+class IoUring {
+public:
+    ~IoUring() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (ring_ptr) munmap(ring_ptr, ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            return false;
+        }
+        ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                             params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_SQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_SQES);
+        if (ring_ptr == MAP_FAILED || sqes_ptr == MAP_FAILED) {
+            ring_ptr = ring_ptr == MAP_FAILED ? nullptr : ring_ptr;
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqes_ptr);
+        char* base = static_cast<char*>(ring_ptr);
+        sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+        unsigned* sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++) {
+            sq_array[i] = i;
+        }
+        local_tail = *sq_tail;
+        // Multishot accept (5.19) and multishot recv (6.0) show no opcode of
+        // their own; IORING_OP_SEND_ZC arrived with the latter and stands in
+        // for both. Without it the shard falls back to epoll.
+        return probe() && supports(IORING_OP_SEND_ZC);
+    }
+
+    // Whether the kernel implements opcode, as probed by init()
+    bool supports(unsigned opcode) const { return opcode < PROBE_OPS && supported[opcode]; }
+
+    // Hands count buffers of size bytes to the kernel as provided buffer group `group`.
+    // Buffers are provided with IORING_OP_PROVIDE_BUFFERS rather than a registered
+    // buffer ring: it works on every kernel with multishot recv, and recycling a
+    // buffer is just one more entry in the next submission.
+    bool setup_buffers(unsigned count, unsigned size, uint16_t group) {
+        buf_count = count;
+        buf_size = size;
+        buf_group = group;
+        buffers = std::make_unique<char[]>(static_cast<size_t>(count) * size);
+        return provide_buffers(0, count);
+    }
+
+    char* buffer(unsigned bid) { return buffers.get() + static_cast<size_t>(bid) * buf_size; }
+
+    // Hands a receive buffer back to the kernel once its contents have been consumed
+    bool provide_buffer(unsigned bid) { return provide_buffers(bid, 1); }
+
+    // Returns a zeroed submission entry, flushing the queue first if it is full
+    io_uring_sqe* get_sqe() {
+        if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit(0);
+            if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                return nullptr;
+            }
+        }
+        io_uring_sqe* sqe = &sqes[local_tail & sq_mask];
+        local_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submits everything queued and waits for at least wait_nr completions, in one system call
+    int submit(unsigned wait_nr) {
+        unsigned to_submit = local_tail - *sq_tail;
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, nullptr, 0);
+        } while (ret < 0 && errno == EINTR && wait_nr == 0);
+        return ret;
+    }
+
+    // Calls handle(cqe) for every available completion
+    template <typename Handler>
+    void drain_completions(Handler&& handle) {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            handle(cqe);
+        }
+    }
+
+private:
+    int ring_fd = -1;
+    void* ring_ptr = nullptr;
+    size_t ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned local_tail = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    static constexpr unsigned PROBE_OPS = 256;
+    bool supported[PROBE_OPS] = {};
+
+    // Asks the kernel which opcodes it implements (IORING_REGISTER_PROBE, 5.6)
+    bool probe() {
+        alignas(io_uring_probe) char buffer[sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op)] = {};
+        io_uring_probe* result = reinterpret_cast<io_uring_probe*>(buffer);
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, result, PROBE_OPS) < 0) {
+            return false;
+        }
+        for (unsigned i = 0; i < result->ops_len && i < PROBE_OPS; i++) {
+            supported[result->ops[i].op] = result->ops[i].flags & IO_URING_OP_SUPPORTED;
+        }
+        return true;
+    }
+
+    bool provide_buffers(unsigned first_bid, unsigned count) {
+        io_uring_sqe* sqe = get_sqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = count;
+        sqe->addr = reinterpret_cast<uintptr_t>(buffer(first_bid));
+        sqe->len = buf_size;
+        sqe->off = first_bid;
+        sqe->buf_group = buf_group;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        return true;
+    }
+
+    unsigned buf_count = 0;
+    unsigned buf_size = 0;
+    uint16_t buf_group = 0;
+    std::unique_ptr<char[]> buffers;
+};
+
+// A send submitted to the ring; owns the payloads until the kernel reports
+// completion. Sends live in reusable slots, so their vectors keep their capacity.
+struct UringSend {
+    int fd;
+    uint32_t generation;
+    bool in_use = false;
+    size_t offset = 0;  // Already-written bytes of the first payload
+    std::vector<Payload> payloads;
+    std::vector<iovec> iov;
+    msghdr header{};
+};
+
+// A message handed from one shard to another. fd == -1 means "every
+// authenticated client of the receiving shard except exclude_fd".
+struct ShardMessage {
+    int fd;
+    int exclude_fd;
+    Payload payload;
+};
+
+// A password check done on the hashing pool, for the connection's shard
+struct LoginResult {
+    int fd;
+    uint32_t generation;
+    bool verified;
+};
+
+// Defined with the hashing pool below: queues the password check of a
+// shard's connection when it is costly; false when the shard checks it itself
+bool verify_on_pool(int shard, int client_socket, uint32_t generation, const std::string& username,
+                    const std::string& password);
+
+// One reactor thread: its own SO_REUSEPORT listener, edge-triggered epoll
+// set and connection table. The kernel spreads new connections over the
+// listeners, and everything about a connection happens on its shard. Sends
+// to sockets of other shards are batched per destination while an event
+// batch is processed and handed over through the destination's inbox.
+//
+// With --io uring the shard drives the same state machine from io_uring
+// completions instead: multishot accept, multishot recv into provided
+// buffers, and sends queued per connection and submitted together with the
+// wait for the next completions, i.e. one system call per loop iteration.
+class Shard {
+public:
+    explicit Shard(int id) : id(id), outgoing(config.shards) {}
+
+    bool open(int port) {
+        if (config.io == "uring") {
+            use_uring = ring.init(URING_ENTRIES) && ring.setup_buffers(URING_BUFFERS, BUFFER_SIZE, 0);
+            uring_zerocopy = use_uring && ring.supports(IORING_OP_SENDMSG_ZC);
+            if (!use_uring) {
+                LOG_ERROR("io_uring unavailable or older than Linux 6.0 in shard " + std::to_string(id) + ", falling back to epoll");
+            }
+        }
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (epoll_fd < 0 || wake_fd < 0 || listen_fd < 0 || !timers.open()) {
+            LOG_ERROR("Failed to create shard " + std::to_string(id));
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+        sockaddr_in server_address{};
+        server_address.sin_family = AF_INET;
+        server_address.sin_port = htons(port);
+        server_address.sin_addr.s_addr = INADDR_ANY;
+        if (bind(listen_fd, (sockaddr*)&server_address, sizeof(server_address)) < 0 ||
+            listen(listen_fd, SOMAXCONN) < 0) {
+            LOG_ERROR("Shard " + std::to_string(id) + " failed to listen on port " + std::to_string(port));
+            return false;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+        ev.data.fd = listen_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+        ev.data.fd = timers.fd();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timers.fd(), &ev);
+        return true;
+    }
+
+    // Called from other shards with a batch of messages for this shard's
+    // sockets. The batch is swapped into the inbox when that is empty, and the
+    // caller gets the inbox's spare vector back, so batch storage circulates
+    // between shards instead of being reallocated every tick.
+    void post(std::vector<ShardMessage>& messages) {
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            if (inbox.empty()) {
+                inbox.swap(messages);
+            } else {
+                std::move(messages.begin(), messages.end(), std::back_inserter(inbox));
+                messages.clear();
+            }
+        }
+        wake();
+    }
+
+    // A broadcast to this shard's clients but the excluded sockets, sorted.
+    // An inbox message excludes at most one, so longer lists wait beside it.
+    void post_broadcast(const Payload& message, std::vector<int> excluded) {
+        if (excluded.size() <= 1) {
+            std::vector<ShardMessage> batch{ShardMessage{-1, excluded.empty() ? -1 : excluded[0], message}};
+            post(batch);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            inbox_broadcasts.emplace_back(message, std::move(excluded));
+        }
+        wake();
+    }
+
+    // Called from the hashing pool when a connection's password is checked
+    void post_login(const LoginResult& result) {
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            inbox_logins.push_back(result);
+        }
+        wake();
+    }
+
+    // Makes the shard's loop drain its inbox and group mailboxes
+    void wake() {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_ERROR("Failed to wake shard " + std::to_string(id));
+        }
+    }
+
+    // Queues a message for a socket owned by another shard (runs on this shard's thread)
+    void queue_remote(int shard, int client_socket, int exclude_socket, const Payload& message) {
+        outgoing[shard].push_back(ShardMessage{client_socket, exclude_socket, message});
+    }
+
+    // Delivers to every authenticated connection of this shard (runs on this shard's thread)
+    void broadcast_local(const Payload& message, int exclude_socket) {
+        for (const auto& [fd, conn] : connections) {
+            if (fd != exclude_socket && conn->state == Connection::State::Authenticated) {
+                deliver_local(*conn, message);
+            }
+        }
+    }
+
+    // Writes to a socket owned by this shard (runs on this shard's thread)
+    void deliver_local(int client_socket, const Payload& message) {
+        auto it = connections.find(client_socket);
+        if (it != connections.end()) {
+            deliver_local(*it->second, message);
+        }
+    }
+
+    void run() {
+        current_shard = id;
+        if (use_uring) {
+            run_uring();
+        } else {
+            run_epoll();
+        }
+    }
+
+    std::string stats() const {
+        return "Shard " + std::to_string(id) + " (" + (use_uring ? "uring" : "epoll") + "): connections=" +
+               std::to_string(connection_count.load()) + " accepted=" + std::to_string(accepted.load()) +
+               " commands=" + std::to_string(commands.load()) + " deliveries=" + std::to_string(deliveries.load()) +
+               " cross_shard_in=" + std::to_string(cross_shard_in.load()) + " dropped=" +
+               std::to_string(dropped.load()) + " slow_disconnects=" + std::to_string(slow_disconnects.load()) +
+               " zerocopy_sends=" + std::to_string(zerocopy_sends.load()) +
+               " send_calls=" + std::to_string(send_calls.load()) +
+               " heap_allocations=" + std::to_string(allocations.load());
+    }
+
+    std::atomic<uint64_t> deliveries{0};
+
+private:
+    void accept_connections() {
+        while (true) {
+            sockaddr_in client_address{};
+            socklen_t client_address_size = sizeof(client_address);
+            int client_socket = accept4(listen_fd, (sockaddr*)&client_address, &client_address_size,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Error accepting connection.");
+                }
+                return;
+            }
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = client_socket;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+                LOG_ERROR("Failed to register socket " + std::to_string(client_socket) + " with shard");
+                close(client_socket);
+                continue;
+            }
+            add_connection(client_socket);
+        }
+    }
+
+    Connection& add_connection(int client_socket) {
+        LOG_INFO("New connection accepted. Waiting for authentication...");
+        auto conn = std::make_unique<Connection>();
+        conn->fd = client_socket;
+        conn->generation = ++next_generation;
+        conn->accepted_at = std::chrono::steady_clock::now();
+        if (!use_uring) {
+            int enable = 1;
+            conn->zerocopy = setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+        }
+        Connection& added = *conn;
+        socket_owner[client_socket].store(id, std::memory_order_release);
+        socket_session[client_socket] = next_session.fetch_add(1, std::memory_order_relaxed);
+        connections[client_socket] = std::move(conn);
+        accepted.fetch_add(1, std::memory_order_relaxed);
+        connection_count.fetch_add(1, std::memory_order_relaxed);
+        metrics::ThreadMetrics& thread_metrics = metrics::local();
+        thread_metrics[metrics::Counter::ConnectionsAccepted].add(1);
+        thread_metrics[metrics::Counter::LoginsPending].add(1);
+        added.timer.data = reinterpret_cast<uintptr_t>(&added);
+        if (config.login_timeout > 0) {
+            timers.schedule(added.timer, LoopTimers::ticks(config.login_timeout));
+        }
+        deliver_local(added, "Enter username: ");
+        return added;
+    }
+
+    void deliver_local(Connection& conn, std::string_view message) {
+        deliver_local(conn, make_payload(message));
+    }
+
+    // Queues a message on a connection; it is written at the end of the tick
+    void deliver_local(Connection& conn, const Payload& message) {
+        if (conn.closing) return;
+        if (conn.outbound_bytes + message.size() > config.queue_limit && !make_room(conn, message.size())) {
+            return;
+        }
+        conn.outbound.push_back(message);
+        conn.outbound_bytes += message.size();
+        deliveries.fetch_add(1, std::memory_order_relaxed);
+        metrics::ThreadMetrics& thread_metrics = metrics::local();
+        thread_metrics[metrics::Counter::QueuedBytes].add(message.size());
+        thread_metrics.queue_depth.observe(conn.outbound_bytes);
+        mark_dirty(conn);
+    }
+
+    void mark_dirty(Connection& conn) {
+        if (!conn.flush_pending) {
+            conn.flush_pending = true;
+            dirty.push_back(conn.fd);
+        }
+    }
+
+    // Applies the overflow policy to a full queue; false if the new message must be dropped
+    bool make_room(Connection& conn, size_t needed) {
+        if (config.overflow == OverflowPolicy::Disconnect) {
+            LOG_ERROR("Disconnecting slow consumer on socket " + std::to_string(conn.fd));
+            conn.closing = true;
+            to_close.emplace_back(conn.fd, conn.generation);
+            slow_disconnects.fetch_add(1, std::memory_order_relaxed);
+            metrics::add(metrics::Counter::SlowDisconnects);
+            return false;
+        }
+        // Drop whole messages from the front, except one that is partly written
+        size_t keep = conn.out_offset > 0 ? 1 : 0;
+        while (conn.outbound.size() > keep && conn.outbound_bytes + needed > config.queue_limit) {
+            conn.outbound_bytes -= conn.outbound[keep].size();
+            metrics::local()[metrics::Counter::QueuedBytes].sub(conn.outbound[keep].size());
+            conn.outbound.erase(keep);
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            metrics::add(metrics::Counter::OutboundDropped);
+        }
+        if (conn.outbound_bytes + needed > config.queue_limit) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            metrics::add(metrics::Counter::OutboundDropped);
+            return false;
+        }
+        return true;
+    }
+
+    // Writes queued output until the socket would block; false on a fatal error.
+    // Large batches go out with MSG_ZEROCOPY: the kernel reads the shared
+    // payloads in place, and they are pinned until it reports completion.
+    // A batch with more queued behind it is sent with MSG_MORE, so that the
+    // kernel fills segments across the sendmsg calls of one flush.
+    bool flush_connection(Connection& conn) {
+        while (!conn.outbound.empty()) {
+            iovec iov[IOV_BATCH];
+            size_t count = 0;
+            size_t bytes = 0;
+            for (; count < conn.outbound.size() && count < IOV_BATCH; count++) {
+                const Payload& payload = conn.outbound[count];
+                size_t skip = count == 0 ? conn.out_offset : 0;
+                iov[count] = iovec{const_cast<char*>(payload.data()) + skip, payload.size() - skip};
+                bytes += iov[count].iov_len;
+            }
+            msghdr header{};
+            header.msg_iov = iov;
+            header.msg_iovlen = count;
+            bool zerocopy = conn.zerocopy && bytes >= ZEROCOPY_THRESHOLD;
+            int more = count < conn.outbound.size() ? MSG_MORE : 0;
+            ssize_t sent = sendmsg(conn.fd, &header, MSG_NOSIGNAL | more | (zerocopy ? MSG_ZEROCOPY : 0));
+            send_calls.fetch_add(1, std::memory_order_relaxed);
+            metrics::add(metrics::Counter::SendCalls);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true;  // Resumed on EPOLLOUT
+                if (zerocopy && errno == ENOBUFS) {
+                    // Out of pinned-page budget (optmem); copy from now on
+                    conn.zerocopy = false;
+                    continue;
+                }
+                LOG_ERROR("Failed to send message to socket " + std::to_string(conn.fd));
+                return false;
+            }
+            if (zerocopy) {
+                std::vector<Payload> pinned;
+                pinned.reserve(count);
+                for (size_t i = 0; i < count; i++) {
+                    pinned.push_back(conn.outbound[i]);
+                }
+                conn.zerocopy_pinned.emplace_back(conn.zerocopy_next_id++, std::move(pinned));
+                zerocopy_sends.fetch_add(1, std::memory_order_relaxed);
+            }
+            consume_output(conn, sent);
+        }
+        return true;
+    }
+
+    // Releases payloads whose zerocopy sends the kernel has finished with
+    void reap_zerocopy(Connection& conn) {
+        while (true) {
+            char control[CMSG_SPACE(sizeof(sock_extended_err)) + 64];
+            msghdr header{};
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+            if (recvmsg(conn.fd, &header, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+                if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) continue;
+                sock_extended_err error;
+                memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+                if (error.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                // Notifications cover the id range [ee_info, ee_data] and arrive in order
+                while (!conn.zerocopy_pinned.empty() &&
+                       static_cast<int32_t>(conn.zerocopy_pinned.front().first - error.ee_data) <= 0) {
+                    conn.zerocopy_pinned.pop_front();
+                }
+            }
+        }
+    }
+
+    void consume_output(Connection& conn, size_t sent) {
+        conn.outbound_bytes -= sent;
+        metrics::ThreadMetrics& thread_metrics = metrics::local();
+        thread_metrics[metrics::Counter::QueuedBytes].sub(sent);
+        thread_metrics[metrics::Counter::BytesSent].add(sent);
+        while (sent > 0) {
+            size_t left = conn.outbound.front().size() - conn.out_offset;
+            if (sent < left) {
+                conn.out_offset += sent;
+                return;
+            }
+            sent -= left;
+            conn.outbound.pop_front();
+            conn.out_offset = 0;
+        }
+    }
+
+    // End of a tick: write everything queued this tick (epoll backend)
+    void flush_dirty() {
+        for (int fd : dirty) {
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            Connection& conn = *it->second;
+            conn.flush_pending = false;
+            if (!conn.closing && !flush_connection(conn)) {
+                conn.closing = true;
+                to_close.emplace_back(conn.fd, conn.generation);
+            }
+        }
+        dirty.clear();
+    }
+
+    // Stops reading from a connection and closes it once its queued output
+    // (e.g. "Authentication failed.") has been written
+    void close_after_flush(Connection& conn) {
+        leave_login(conn);
+        conn.state = Connection::State::Closing;
+        to_close.emplace_back(conn.fd, conn.generation);
+    }
+
+    // End of a tick: closes evicted connections and finished graceful closes.
+    // Closing announces the departure, which can evict more slow consumers,
+    // hence the loop; graceful closes with output left wait for a later tick.
+    void close_pending() {
+        std::vector<std::pair<int, uint32_t>> lingering;
+        while (!to_close.empty()) {
+            std::vector<std::pair<int, uint32_t>> batch;
+            batch.swap(to_close);
+            for (const auto& [fd, generation] : batch) {
+                auto it = connections.find(fd);
+                if (it == connections.end() || it->second->generation != generation) continue;
+                Connection& conn = *it->second;
+                if (conn.closing || (conn.outbound.empty() && !conn.send_in_flight)) {
+                    close_connection(conn);
+                } else {
+                    lingering.emplace_back(fd, generation);
+                }
+            }
+        }
+        to_close.swap(lingering);
+    }
+
+    void drain_inbox() {
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) > 0) {}
+        {
+            // The inbox takes over the (empty) vector drained last time
+            std::lock_guard<std::mutex> lock(inbox_mutex);
+            draining.swap(inbox);
+            draining_broadcasts.swap(inbox_broadcasts);
+            draining_logins.swap(inbox_logins);
+        }
+        for (const LoginResult& result : draining_logins) {
+            auto it = connections.find(result.fd);
+            if (it == connections.end() || it->second->generation != result.generation || !it->second->verifying) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            conn.verifying = false;
+            if (conn.state != Connection::State::LoggingIn) continue;  // Timed out meanwhile
+            if (!complete_login(conn, result.verified) || !run_commands(conn)) {
+                close_after_flush(conn);
+            }
+        }
+        draining_logins.clear();
+        for (const auto& [message, excluded] : draining_broadcasts) {
+            for (const auto& [fd, conn] : connections) {
+                if (conn->state == Connection::State::Authenticated &&
+                    !std::binary_search(excluded.begin(), excluded.end(), fd)) {
+                    deliver_local(*conn, message);
+                }
+            }
+        }
+        draining_broadcasts.clear();
+        cross_shard_in.fetch_add(draining.size(), std::memory_order_relaxed);
+        for (const ShardMessage& message : draining) {
+            if (message.fd < 0) {
+                broadcast_local(message.payload, message.exclude_fd);
+            } else {
+                deliver_local(message.fd, message.payload);
+            }
+        }
+        draining.clear();
+        run_group_requests();
+    }
+
+    // Hands everything queued for other shards over, one inbox lock per shard
+    void flush_outgoing() {
+        flush_group_requests();
+        for (size_t shard = 0; shard < outgoing.size(); shard++) {
+            if (!outgoing[shard].empty()) {
+                post_batch(shard, outgoing[shard]);
+            }
+        }
+    }
+
+    static void post_batch(size_t shard, std::vector<ShardMessage>& messages);
+
+    // Edge-triggered: drain the socket until recv() would block. Legacy
+    // connections read BUFFER_SIZE at a time since each read is one command;
+    // line-protocol connections read large blocks of pipelined commands.
+    void handle_readable(Connection& conn) {
+        static thread_local char buffer[LINE_READ_SIZE];
+        while (true) {
+            size_t read_size = conn.decoder.line_mode() ? sizeof(buffer) : BUFFER_SIZE;
+            ssize_t recv_size = recv(conn.fd, buffer, read_size, 0);
+            if (recv_size < 0 && errno == EINTR) continue;
+            if (recv_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (recv_size <= 0) {
+                close_connection(conn);
+                return;
+            }
+            if (!handle_input(conn, buffer, recv_size)) {
+                close_after_flush(conn);
+                return;
+            }
+        }
+    }
+
+    // Runs every complete command in the received bytes; false when the connection must be closed
+    bool handle_input(Connection& conn, const char* data, size_t len) {
+        if (conn.state == Connection::State::Closing) {
+            return true;
+        }
+        metrics::add(metrics::Counter::BytesReceived, len);
+        // Any input proves the peer alive and answers an outstanding ping
+        conn.last_input_tick = timers.now();
+        conn.awaiting_pong = false;
+        if (!conn.decoder.feed(data, len)) {
+            deliver_local(conn, "Message too long.\n");
+            LOG_ERROR("Oversized command from socket " + std::to_string(conn.fd));
+            return false;
+        }
+        return run_commands(conn);
+    }
+
+    // Runs the complete commands the decoder holds, stopping while the
+    // password is being checked; false when the connection must be closed
+    bool run_commands(Connection& conn) {
+        std::string_view command;
+        while (conn.state != Connection::State::Closing && !conn.verifying && conn.decoder.next(command)) {
+            if (!handle_command(conn, command)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Advances the connection state machine; returns false when it must be closed
+    bool handle_command(Connection& conn, std::string_view chunk) {
+        switch (conn.state) {
+        case Connection::State::LoggingIn:
+            if (!conn.login.advance(conn.fd, chunk, conn.decoder.line_mode())) {
+                return true;
+            }
+            conn.username = std::move(conn.login.username);
+            if (verify_on_pool(id, conn.fd, conn.generation, conn.username, conn.login.password)) {
+                conn.verifying = true;  // drain_inbox() finishes the login
+                return true;
+            }
+            return complete_login(
+                conn, users.load(std::memory_order_acquire)->verify(conn.username, conn.login.password));
+        case Connection::State::Authenticated:
+            commands.fetch_add(1, std::memory_order_relaxed);
+            processClientMessage(conn.fd, chunk, conn.username);
+            return true;
+        case Connection::State::Closing:
+            return true;  // Input after a failed login is ignored until the close
+        }
+        return false;
+    }
+
+    // Finishes a login once the password is checked; false when it failed
+    bool complete_login(Connection& conn, bool verified) {
+        if (!finish_login(conn.fd, conn.username, verified)) {
+            return false;
+        }
+        leave_login(conn);
+        conn.login = LoginDialogue();
+        conn.state = Connection::State::Authenticated;
+        record_login_latency(conn.accepted_at);
+        if (config.idle_timeout > 0) {
+            timers.schedule(conn.timer, LoopTimers::ticks(config.idle_timeout));
+        } else {
+            timers.cancel(conn.timer);
+        }
+        return true;
+    }
+
+    // Takes a connection out of the pending-logins gauge when it stops logging in
+    void leave_login(Connection& conn) {
+        if (conn.state == Connection::State::LoggingIn) {
+            metrics::local()[metrics::Counter::LoginsPending].sub(1);
+        }
+    }
+
+    // Runs the connection timers due this tick. A login deadline closes the
+    // connection after a notice. An idle check either finds recent input and
+    // waits out the rest of the idle timeout, or pings the client; a ping
+    // still unanswered at its timeout evicts the session. The tick's
+    // evictions leave clients and groups together in one batch.
+    void expire_timers() {
+        timers.expire([this](TimerWheel::Timer& timer) {
+            Connection& conn = *reinterpret_cast<Connection*>(timer.data);
+            if (conn.state == Connection::State::LoggingIn) {
+                deliver_local(conn, "Login timed out.\n");
+                metrics::add(metrics::Counter::AuthTimeout);
+                LOG_ERROR("Login timed out on socket " + std::to_string(conn.fd));
+                close_after_flush(conn);
+            } else if (conn.state == Connection::State::Authenticated && conn.awaiting_pong) {
+                LOG_ERROR("No reply to ping on socket " + std::to_string(conn.fd));
+                evicting.emplace_back(conn.fd, std::move(conn.username));
+                conn.state = Connection::State::Closing;
+                conn.closing = true;
+                to_close.emplace_back(conn.fd, conn.generation);
+            } else if (conn.state == Connection::State::Authenticated) {
+                uint64_t idle = timers.now() - conn.last_input_tick;
+                uint64_t limit = LoopTimers::ticks(config.idle_timeout);
+                if (idle < limit) {
+                    timers.schedule(conn.timer, limit - idle);
+                    return;
+                }
+                deliver_local(conn, "/ping\n");
+                metrics::add(metrics::Counter::PingsSent);
+                conn.awaiting_pong = true;
+                timers.schedule(conn.timer, LoopTimers::ticks(config.ping_timeout));
+            }
+        });
+        if (!evicting.empty()) {
+            // Already Closing, so the departure notices skip the other evicted sessions
+            metrics::add(metrics::Counter::IdleEvictions, evicting.size());
+            disconnect_clients(evicting);
+            evicting.clear();
+        }
+    }
+
+    void close_connection(Connection& conn) {
+        int fd = conn.fd;
+        if (use_uring) {
+            // Completes the pending multishot recv; its late completion is
+            // recognised as stale by the connection generation
+            shutdown(fd, SHUT_RDWR);
+        } else {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        if (conn.state == Connection::State::Authenticated) {
+            disconnect_client(fd, conn.username);
+        }
+        leave_login(conn);
+        metrics::ThreadMetrics& thread_metrics = metrics::local();
+        thread_metrics[metrics::Counter::QueuedBytes].sub(conn.outbound_bytes);
+        thread_metrics[metrics::Counter::ConnectionsClosed].add(1);
+        connections.erase(fd);
+        connection_count.fetch_sub(1, std::memory_order_relaxed);
+        socket_owner[fd].store(-1, std::memory_order_release);
+        close(fd);
+    }
+
+    void run_epoll();
+
+    // io_uring completion kinds, kept in the top byte of user_data
+    enum UringOp : uint64_t { OpAccept = 1, OpRecv = 2, OpSend = 3, OpWake = 4, OpTimer = 5 };
+    static uint64_t uring_tag(UringOp op, uint64_t value) { return (static_cast<uint64_t>(op) << 56) | value; }
+    static uint64_t connection_tag(const Connection& conn) {
+        return (static_cast<uint64_t>(conn.fd) << 32) | conn.generation;
+    }
+
+    void run_uring();
+    void handle_completion(const io_uring_cqe& cqe);
+    void arm_accept();
+    void arm_recv(const Connection& conn);
+    void arm_wake();
+    void arm_timer();
+    void submit_sends();
+    void complete_send(const io_uring_cqe& cqe);
+    uint32_t acquire_send();
+    void release_send(uint32_t slot);
+
+    int id;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    int listen_fd = -1;
+    bool use_uring = false;
+    bool uring_zerocopy = false;  // The ring has IORING_OP_SENDMSG_ZC (Linux 6.1)
+    IoUring ring;
+    uint64_t wake_value = 0;
+    uint64_t timer_value = 0;
+    LoopTimers timers;
+    uint32_t next_generation = 0;
+    std::vector<int> dirty;  // Connections with output queued this tick
+    std::vector<std::pair<int, uint32_t>> to_close;  // (fd, generation) to close at the end of the tick
+    std::vector<std::pair<int, std::string>> evicting;  // Sessions evicted by this tick's timers
+    // io_uring sends by slot; the slot number is the completion's user_data
+    std::vector<std::unique_ptr<UringSend>> send_slots;
+    std::vector<uint32_t> free_send_slots;
+    std::mutex inbox_mutex;
+    std::vector<ShardMessage> inbox;
+    std::vector<ShardMessage> draining;  // Inbox contents being delivered, touched only by this thread
+    std::vector<std::pair<Payload, std::vector<int>>> inbox_broadcasts;  // post_broadcast() with several exclusions
+    std::vector<std::pair<Payload, std::vector<int>>> draining_broadcasts;
+    std::vector<LoginResult> inbox_logins;  // Password checks back from the hashing pool
+    std::vector<LoginResult> draining_logins;
+    std::vector<std::vector<ShardMessage>> outgoing;  // Per destination shard, touched only by this thread
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::atomic<uint64_t> connection_count{0};
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> commands{0};
+    std::atomic<uint64_t> cross_shard_in{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> slow_disconnects{0};
+    std::atomic<uint64_t> zerocopy_sends{0};
+    std::atomic<uint64_t> send_calls{0};
+    // This thread's heap allocation count, published once per loop iteration
+    std::atomic<uint64_t> allocations{0};
+};
+
+std::vector<std::unique_ptr<Shard>> shards;
+
+void Shard::post_batch(size_t shard, std::vector<ShardMessage>& messages) {
+    shards[shard]->post(messages);
+}
+
+// Reactor: a password checked against a compiled index costs a PBKDF2 hash
+// (user_index.hpp), which on a shard would stall all of its other
+// connections. --hash-workers threads do those checks instead and post each
+// result back to the connection's shard, which finishes the login there.
+// Passwords from a text user file are compared on the shard.
+class HashPool {
+public:
+    // Lets the workers finish the check in hand and joins them
+    ~HashPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    void start(int worker_count) {
+        for (int i = 0; i < worker_count; i++) workers.emplace_back([this] { run(); });
+    }
+
+    bool running() const { return !workers.empty(); }
+
+    struct Job {
+        int shard = 0;
+        LoginResult result{};
+        std::string username;
+        std::string password;
+        std::shared_ptr<const Credentials> credentials;
+    };
+
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        work.notify_one();
+    }
+
+private:
+    void run() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job.result.verified = job.credentials->verify(job.username, job.password);
+            shards[job.shard]->post_login(job.result);
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable work;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+HashPool hashing;
+
+bool verify_on_pool(int shard, int client_socket, uint32_t generation, const std::string& username,
+                    const std::string& password) {
+    if (!hashing.running()) return false;
+    std::shared_ptr<const Credentials> credentials = users.load(std::memory_order_acquire);
+    if (!credentials->mapped) return false;
+    hashing.submit({shard, {client_socket, generation, false}, username, password, std::move(credentials)});
+    return true;
+}
+
+// Output queued during a tick is written at its end, one sendmsg per
+// connection; a tick that runs longer than --flush-cap-us writes what it has
+// queued so far before going on
+void Shard::run_epoll() {
+    epoll_event events[MAX_EVENTS];
+    auto flush_cap = std::chrono::microseconds(config.flush_cap_us);
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("epoll_wait failed in shard " + std::to_string(id));
+            return;
+        }
+        auto flushed_at = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++) {
+            if (flush_cap.count() > 0 && !dirty.empty() && std::chrono::steady_clock::now() - flushed_at >= flush_cap) {
+                flush_dirty();
+                flushed_at = std::chrono::steady_clock::now();
+            }
+            int fd = events[i].data.fd;
+            if (fd == wake_fd) {
+                drain_inbox();
+            } else if (fd == timers.fd()) {
+                expire_timers();
+            } else if (fd == listen_fd) {
+                accept_connections();
+            } else {
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                if ((events[i].events & EPOLLERR) && !it->second->zerocopy_pinned.empty()) {
+                    // Zerocopy completions are reported through the error queue
+                    reap_zerocopy(*it->second);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    // Read errors and hangups surface through recv() returning <= 0
+                    handle_readable(*it->second);
+                    it = connections.find(fd);
+                }
+                if ((events[i].events & EPOLLOUT) && it != connections.end() && !it->second->outbound.empty()) {
+                    mark_dirty(*it->second);
+                }
+            }
+        }
+        flush_dirty();
+        flush_outgoing();
+        close_pending();
+        allocations.store(metrics::thread_allocations.get(), std::memory_order_relaxed);
+    }
+}
+
+void Shard::run_uring() {
+    arm_accept();
+    arm_wake();
+    arm_timer();
+    while (true) {
+        submit_sends();
+        if (ring.submit(1) < 0 && errno != EINTR && errno != EBUSY) {
+            LOG_ERROR("io_uring_enter failed in shard " + std::to_string(id));
+            return;
+        }
+        ring.drain_completions([this](const io_uring_cqe& cqe) { handle_completion(cqe); });
+        flush_outgoing();
+        close_pending();
+        allocations.store(metrics::thread_allocations.get(), std::memory_order_relaxed);
+    }
+}
+
+// Accept errors that concern one connection or a passing shortage; anything
+// else (EINVAL from a kernel without multishot accept, EBADF, ...) would
+// recur on every attempt
+static bool accept_error_transient(int error) {
+    switch (error) {
+    case EAGAIN: case EINTR: case ECONNABORTED: case EPROTO: case EPERM:
+    case EMFILE: case ENFILE: case ENOBUFS: case ENOMEM:
+    case ENETDOWN: case ENOPROTOOPT: case EHOSTDOWN: case ENONET: case EHOSTUNREACH: case ENETUNREACH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Shard::arm_accept() {
+    io_uring_sqe* sqe = ring.get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_tag(OpAccept, 0);
+}
 
-// Logger namespace to provide thread-safe logging functionality
-namespace Logger {
-    std::mutex log_mutex;
-    void log_info(const std::string& message) {
-        std::lock_guard<std::mutex> lock(log_mutex);
-        auto now = std::chrono::system_clock::now();
-        std::time_t currentTime = std::chrono::system_clock::to_time_t(now);
-        std::string time_str = std::string(std::ctime(&currentTime));
-        if (!time_str.empty() && time_str.back() == '\n') {
-            time_str.pop_back();
+void Shard::arm_recv(const Connection& conn) {
+    io_uring_sqe* sqe = ring.get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uring_tag(OpRecv, connection_tag(conn));
+}
+
+void Shard::arm_wake() {
+    io_uring_sqe* sqe = ring.get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&wake_value);
+    sqe->len = sizeof(wake_value);
+    sqe->user_data = uring_tag(OpWake, 0);
+}
+
+void Shard::arm_timer() {
+    io_uring_sqe* sqe = ring.get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = timers.fd();
+    sqe->addr = reinterpret_cast<uintptr_t>(&timer_value);
+    sqe->len = sizeof(timer_value);
+    sqe->user_data = uring_tag(OpTimer, 0);
+}
+
+// Gathers each dirty connection's queued output into one sendmsg, so a
+// fan-out to N local clients becomes N queued entries and no extra syscalls
+void Shard::submit_sends() {
+    for (int fd : dirty) {
+        auto it = connections.find(fd);
+        if (it == connections.end()) continue;
+        Connection& conn = *it->second;
+        conn.flush_pending = false;
+        if (conn.closing || conn.send_in_flight || conn.outbound.empty()) continue;
+        io_uring_sqe* sqe = ring.get_sqe();
+        if (!sqe) {
+            conn.flush_pending = true;
+            break;
         }
-        std::cout << "[" << time_str << "] [INFO] " << message << std::endl;
-    }
-    void log_error(const std::string& message) {
-        std::lock_guard<std::mutex> lock(log_mutex);
-        auto now = std::chrono::system_clock::now();
-        std::time_t currentTime = std::chrono::system_clock::to_time_t(now);
-        std::string time_str = std::string(std::ctime(&currentTime));
-        if (!time_str.empty() && time_str.back() == '\n') {
-            time_str.pop_back();
+        uint32_t slot = acquire_send();
+        UringSend* send = send_slots[slot].get();
+        send->fd = fd;
+        send->generation = conn.generation;
+        send->offset = conn.out_offset;
+        conn.out_offset = 0;
+        size_t bytes = 0;
+        while (!conn.outbound.empty() && send->payloads.size() < IOV_BATCH) {
+            const Payload& payload = conn.outbound.front();
+            size_t skip = send->payloads.empty() ? send->offset : 0;
+            send->iov.push_back(iovec{const_cast<char*>(payload.data()) + skip, payload.size() - skip});
+            bytes += payload.size() - skip;
+            send->payloads.push_back(std::move(conn.outbound.front()));
+            conn.outbound.pop_front();
         }
-        std::cerr << "[" << time_str << "] [ERROR] " << message << std::endl;
+        send->header.msg_iov = send->iov.data();
+        send->header.msg_iovlen = send->iov.size();
+        // Zerocopy sends complete twice: the result, then a notification once
+        // the kernel no longer references the payloads. Kernels before 6.1
+        // lack the opcode and get a plain sendmsg.
+        bool zerocopy = uring_zerocopy && bytes >= ZEROCOPY_THRESHOLD;
+        if (zerocopy) zerocopy_sends.fetch_add(1, std::memory_order_relaxed);
+        sqe->opcode = zerocopy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(&send->header);
+        // The rest goes in the next send, once this one completes
+        sqe->msg_flags = MSG_NOSIGNAL | (conn.outbound.empty() ? 0 : MSG_MORE);
+        sqe->user_data = uring_tag(OpSend, slot);
+        send_calls.fetch_add(1, std::memory_order_relaxed);
+        metrics::add(metrics::Counter::SendCalls);
+        conn.send_in_flight = true;
     }
+    // Connections not reached because the submission queue filled up stay for the next tick
+    dirty.erase(std::remove_if(dirty.begin(), dirty.end(), [this](int fd) {
+        auto it = connections.find(fd);
+        return it == connections.end() || !it->second->flush_pending;
+    }), dirty.end());
 }
 
-// Global mutexes for thread safety over shared data structures
-std::mutex clients_mutex;
-std::mutex groups_mutex;
+// Takes a free send slot, growing the table when all are in flight
+uint32_t Shard::acquire_send() {
+    if (free_send_slots.empty()) {
+        free_send_slots.push_back(send_slots.size());
+        send_slots.push_back(std::make_unique<UringSend>());
+    }
+    uint32_t slot = free_send_slots.back();
+    free_send_slots.pop_back();
+    send_slots[slot]->in_use = true;
+    return slot;
+}
 
-// Global data structures:
-// clients: mapping of client socket to username
-// users: allowed username-password pairs loaded from file
-// groups: mapping of group names to a set of client sockets (its members)
-std::unordered_map<int, std::string> clients;
-std::unordered_map<std::string, std::string> users;
-std::unordered_map<std::string, std::unordered_set<int>> groups;
+// Drops the payload references; the vectors keep their capacity for the next send
+void Shard::release_send(uint32_t slot) {
+    UringSend& send = *send_slots[slot];
+    send.in_use = false;
+    send.payloads.clear();
+    send.iov.clear();
+    free_send_slots.push_back(slot);
+}
 
-// Helper function to split a string by whitespace
-std::vector<std::string> split(const std::string& s) {
-    std::istringstream iss(s);
-    std::vector<std::string> tokens;
-    std::string token;
-    while (iss >> token) {
-        tokens.push_back(token);
+void Shard::complete_send(const io_uring_cqe& cqe) {
+    uint64_t slot = cqe.user_data & ((1ULL << 56) - 1);
+    if (slot >= send_slots.size() || !send_slots[slot]->in_use) return;
+    if (cqe.flags & IORING_CQE_F_NOTIF) {
+        // Zerocopy notification: the kernel is done with the payloads
+        release_send(slot);
+        return;
+    }
+    // A zerocopy send keeps its slot until the notification arrives
+    bool done = !(cqe.flags & IORING_CQE_F_MORE);
+    UringSend& send = *send_slots[slot];
+    auto it = connections.find(send.fd);
+    if (it == connections.end() || it->second->generation != send.generation) {
+        if (done) release_send(slot);
+        return;
+    }
+    Connection& conn = *it->second;
+    conn.send_in_flight = false;
+    // Byte positions are relative to the start of the first payload
+    size_t submitted = 0;
+    for (const Payload& payload : send.payloads) {
+        submitted += payload.size();
+    }
+    if (cqe.res < 0) {
+        // As on the epoll path, a failed send closes the connection rather
+        // than going on after a gap
+        LOG_ERROR("Failed to send message to socket " + std::to_string(send.fd));
+        conn.outbound_bytes -= submitted - send.offset;
+        metrics::local()[metrics::Counter::QueuedBytes].sub(submitted - send.offset);
+        if (!conn.closing) {
+            conn.closing = true;
+            to_close.emplace_back(conn.fd, conn.generation);
+        }
+    } else {
+        // A short send puts the unsent payloads back in front of anything
+        // queued since, with out_offset marking how much of the first is written
+        size_t sent = send.offset + cqe.res;
+        conn.outbound_bytes -= cqe.res;
+        metrics::ThreadMetrics& thread_metrics = metrics::local();
+        thread_metrics[metrics::Counter::QueuedBytes].sub(cqe.res);
+        thread_metrics[metrics::Counter::BytesSent].add(cqe.res);
+        for (auto payload = send.payloads.rbegin(); payload != send.payloads.rend(); ++payload) {
+            size_t start = submitted - payload->size();
+            submitted = start;
+            if (start + payload->size() <= sent) break;
+            conn.outbound.push_front(*payload);
+            conn.out_offset = start >= sent ? 0 : sent - start;
+        }
+    }
+    if (!conn.outbound.empty()) {
+        mark_dirty(conn);
     }
-    return tokens;
+    if (done) release_send(slot);
 }
 
-// Function to load users from a file
-std::unordered_map<std::string, std::string> load_users(const std::string& file_name) {
-    std::unordered_map<std::string, std::string> loaded_users;
-    std::ifstream file(file_name);
-    std::string line;
-    if (!file.is_open()) {
-        Logger::log_error("Failed to open user file: " + file_name);
-        return loaded_users;
-    }
-    while (std::getline(file, line)) {
-        std::stringstream ss(line);
-        std::string username, password;
-        if (std::getline(ss, username, ':') && std::getline(ss, password)) {
-            loaded_users[username] = password;
+void Shard::handle_completion(const io_uring_cqe& cqe) {
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    switch (cqe.user_data >> 56) {
+    case OpAccept:
+        if (cqe.res >= 0) {
+            arm_recv(add_connection(cqe.res));
+        } else if (!accept_error_transient(-cqe.res)) {
+            // Re-arming would fail the same way at once, in a loop
+            LOG_ERROR("Error accepting connection; shard " + std::to_string(id) + " stops accepting.");
+            break;
+        } else {
+            LOG_ERROR("Error accepting connection.");
+        }
+        if (!more) arm_accept();
+        break;
+    case OpRecv: {
+        int fd = static_cast<int>((cqe.user_data >> 32) & 0xFFFFFF);
+        uint32_t generation = static_cast<uint32_t>(cqe.user_data);
+        bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        auto it = connections.find(fd);
+        if (it == connections.end() || it->second->generation != generation) {
+            if (has_buffer) ring.provide_buffer(bid);
+            break;
+        }
+        Connection& conn = *it->second;
+        if (cqe.res == -ENOBUFS) {
+            // All provided buffers were busy; resume once they are recycled
+            if (!more) arm_recv(conn);
+        } else if (cqe.res <= 0) {
+            close_connection(conn);
+        } else if (!handle_input(conn, ring.buffer(bid), cqe.res)) {
+            close_after_flush(conn);
+        } else if (!more) {
+            arm_recv(conn);
         }
+        if (has_buffer) ring.provide_buffer(bid);
+        break;
+    }
+    case OpSend:
+        complete_send(cqe);
+        break;
+    case OpWake:
+        drain_inbox();
+        arm_wake();
+        break;
+    case OpTimer:
+        expire_timers();
+        arm_timer();
+        break;
     }
-    Logger::log_info("Loaded " + std::to_string(loaded_users.size()) + " users from " + file_name);
-    return loaded_users;
 }
 
-// Utility function to send a message to a client socket with error checking
-void send_message(int client_socket, const std::string& message) {
-    ssize_t sent = send(client_socket, message.c_str(), message.size(), 0);
-    if (sent < 0) {
-        Logger::log_error("Failed to send message to socket " + std::to_string(client_socket));
+void deliver_on_shard(int shard, int client_socket, const Payload& message) {
+    if (shard == current_shard) {
+        shards[shard]->deliver_local(client_socket, message);
+    } else {
+        shards[current_shard]->queue_remote(shard, client_socket, -1, message);
     }
 }
 
-// --- Command processing functions ---
-void processPrivateMessage(int client_socket, const std::string& message, const std::string& username) {
-    size_t space1 = message.find(' ');
-    size_t space2 = message.find(' ', space1 + 1);
-    if (space1 == std::string::npos || space2 == std::string::npos) {
-        send_message(client_socket, "Invalid /msg syntax. Use: /msg <username> <message>\n");
-        Logger::log_error("Invalid /msg syntax from user " + username);
-        return;
+void broadcast_to_shards(const Payload& message, int exclude_socket) {
+    for (size_t shard = 0; shard < shards.size(); shard++) {
+        if (static_cast<int>(shard) == current_shard) {
+            shards[shard]->broadcast_local(message, exclude_socket);
+        } else {
+            shards[current_shard]->queue_remote(shard, -1, exclude_socket, message);
+        }
     }
-    std::string recipient = message.substr(space1 + 1, space2 - space1 - 1);
-    std::string private_message = message.substr(space2 + 1);
+}
 
-    bool user_found = false;
-    {
+// Sends to every authenticated client but the excluded sockets from a thread
+// that is not a shard (the presence thread); in reactor mode the message
+// goes through every inbox
+void broadcast_from_outside(const Payload& message, std::vector<int> excluded) {
+    std::sort(excluded.begin(), excluded.end());
+    if (shards.empty()) {
+        DeferredSends sends;
         std::lock_guard<std::mutex> lock(clients_mutex);
         for (const auto& [sock, user] : clients) {
-            if (user == recipient) {
-                send_message(sock, "[" + username + "]: " + private_message + "\n");
-                user_found = true;
-                Logger::log_info("Private message from " + username + " to " + recipient);
-                break;
-            }
+            if (!std::binary_search(excluded.begin(), excluded.end(), sock)) send_message(sock, message);
         }
+        return;
     }
-    if (!user_found) {
-        send_message(client_socket, "User not found.\n");
-        Logger::log_error("User " + recipient + " not found for private message from " + username);
+    std::vector<std::vector<int>> by_shard(shards.size());
+    for (int sock : excluded) {
+        int owner = owner_of(sock);
+        if (owner >= 0) by_shard[owner].push_back(sock);
+    }
+    for (size_t shard = 0; shard < shards.size(); shard++) {
+        shards[shard]->post_broadcast(message, std::move(by_shard[shard]));
     }
 }
 
-void processBroadcastMessage(int client_socket, const std::string& message, const std::string& username) {
-    std::string broadcast_message = message.substr(11); // Skip the command part
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        for (const auto& [sock, user] : clients) {
-            if (sock != client_socket) {
-                send_message(sock, "[" + username + "]: " + broadcast_message + "\n");
+// Sends to particular sockets from a thread that is not a shard (cluster link
+// readers); in reactor mode each owning shard is posted one batch
+void deliver_from_outside(std::vector<std::pair<int, Payload>>& sends) {
+    if (shards.empty()) {
+        DeferredSends deferred;
+        for (const auto& [sock, message] : sends) {
+            send_message(sock, message);
+        }
+    } else if (!sends.empty()) {
+        std::vector<std::vector<ShardMessage>> batches(shards.size());
+        for (auto& [sock, message] : sends) {
+            int owner = owner_of(sock);
+            if (owner >= 0) {
+                batches[owner].push_back(ShardMessage{sock, -1, std::move(message)});
             }
         }
+        for (size_t shard = 0; shard < shards.size(); shard++) {
+            if (!batches[shard].empty()) shards[shard]->post(batches[shard]);
+        }
     }
-    Logger::log_info("Broadcast message from " + username);
+    sends.clear();
 }
 
-void processCreateGroup(int client_socket, const std::string& message, const std::string& username) {
-    size_t space = message.find(' ');
-    if (space == std::string::npos) {
-        send_message(client_socket, "Invalid syntax. Use: /create_group <group_name>\n");
-        Logger::log_error("Invalid /create_group syntax from " + username);
-        return;
+// --- Group ownership (--groups owned) ---
+// Every group is owned by one reactor shard, placed by consistent hashing of
+// its name (group_owners.hpp). Only the owner's thread reads or changes the
+// group, so group commands run without locks on data that stays in one
+// core's cache. A shard that receives a command for a group it does not own
+// passes the command line to the owner through a single-producer
+// single-consumer mailbox, one per ordered pair of shards, and the owner runs
+// it as if it had arrived there: replies and fan-out reach the members'
+// shards through their inboxes as usual. A closing connection is announced
+// to every owner. Mailboxes are FIFO, so one client's commands for a group
+// run in the order they were sent.
+//
+// Owners rebalance. Every GROUP_REBALANCE_MS an owner compares the work it
+// has done (a unit per command, plus one per member a message reaches) with
+// the others'. Past 1.5 times the average it hands its busiest group that
+// still fits to the least busy owner. A move keeps commands in order:
+//   - the old owner sends the group to the new one and forwards anything it
+//     still receives for it;
+//   - the new owner tells every shard to send to it from now on;
+//   - each shard answers through the old owner, behind whatever it sent
+//     there earlier;
+//   - the new owner holds back a shard's own requests until that answer is in.
+#define GROUP_MAILBOX_SLOTS 512         // Requests one mailbox holds before the sender keeps them back
+#define GROUP_REBALANCE_MS 1000         // How often an owner compares its load with the others'
+#define GROUP_REBALANCE_MIN_LOAD 1000   // Below this much work in an interval an owner sheds nothing
+#define GROUP_MAX_ROUTES 4096           // Groups placed away from their hash owner, at most
+
+struct GroupRequest {
+    enum class Kind : uint8_t {
+        Command,   // A client's group command, from the client's shard
+        Line,      // A line from another cluster node for the group's members
+        Depart,    // A connection closed
+        Adopt,     // The group itself, from its previous owner
+        Route,     // From the new owner: send the group's requests to it from now on
+        Switched,  // A shard sends to the new owner now; goes through the old owner
+    };
+    Kind kind = Kind::Command;
+    bool forwarded = false;  // Passed on by the group's previous owner; never held back
+    CommandId command = CommandId::Unknown;
+    int fd = -1;             // Command, Depart
+    int from = -1;           // Route: the previous owner; Switched: the shard that switched
+    uint64_t session = 0;    // Command, Depart
+    std::string group;       // All but Command (parsed from text) and Depart
+    std::string username;    // Command
+    Payload text;            // Command: the command line; Line: the line
+    std::unique_ptr<OwnedGroups::Moved> moved;  // Adopt
+};
+
+class GroupOwner;
+std::vector<std::unique_ptr<GroupOwner>> owners;  // By shard; empty when groups are shared
+group_owners::HashRing group_ring;
+
+// The group a command names, or empty when its syntax is wrong
+std::string_view group_argument(CommandId command, const CommandArgs& args) {
+    if (command == CommandId::GroupMessage || command == CommandId::ResumeGroup) {
+        return args.has_text ? args.target : std::string_view();
     }
-    std::string group_name = message.substr(space + 1);
-    group_name = group_name.substr(0, group_name.find_first_of("\r\n\0"));
-    {
-        std::lock_guard<std::mutex> lock(groups_mutex);
-        if (groups.find(group_name) != groups.end()) {
-            send_message(client_socket, "Group " + group_name + " already exists.\n");
-            Logger::log_error("Group creation failed: " + group_name + " already exists. User: " + username);
-        } else {
-            groups[group_name] = {client_socket}; // Add creator to the group
-            send_message(client_socket, "Group " + group_name + " created.\n");
-            Logger::log_info("Group " + group_name + " created by " + username);
+    return args.has_rest ? args.rest : std::string_view();
+}
+
+class GroupOwner {
+public:
+    using Mailbox = group_owners::SpscRing<GroupRequest>;
+
+    GroupOwner(int id, size_t shard_count)
+        : id(id), awaiting(shard_count), held(shard_count), backlog(shard_count), wake(shard_count),
+          seen_load(shard_count) {
+        for (size_t shard = 0; shard < shard_count; shard++) {
+            mailboxes.push_back(std::make_unique<Mailbox>(GROUP_MAILBOX_SLOTS));
         }
     }
-}
 
-void processJoinGroup(int client_socket, const std::string& message, const std::string& username) {
-    size_t space = message.find(' ');
-    if (space == std::string::npos) {
-        send_message(client_socket, "Invalid syntax. Use: /join_group <group_name>\n");
-        Logger::log_error("Invalid /join_group syntax from " + username);
-        return;
+    // On a client's shard: runs the command here or sends it to the group's owner
+    void route(int client_socket, CommandId command, std::string_view group, std::string_view line,
+               const std::string& username) {
+        GroupRequest request;
+        request.command = command;
+        request.fd = client_socket;
+        request.session = socket_session[client_socket];
+        request.username = username;
+        request.text = make_payload(line);
+        size_t owner = group.empty() ? id : owner_for(group);
+        if (owner != static_cast<size_t>(id)) hops.fetch_add(1, std::memory_order_relaxed);
+        send(owner, std::move(request));
     }
-    std::string group_name = message.substr(space + 1);
-    group_name = group_name.substr(0, group_name.find_first_of("\r\n\0"));
-    {
-        std::lock_guard<std::mutex> lock(groups_mutex);
-        if (groups.find(group_name) != groups.end()) {
-            if (groups[group_name].find(client_socket) != groups[group_name].end()) {
-                send_message(client_socket, "You are already in group " + group_name + ".\n");
-                Logger::log_info(username + " attempted to rejoin group " + group_name);
-            } else {
-                groups[group_name].insert(client_socket);
-                send_message(client_socket, "You joined the group " + group_name + ".\n");
-                Logger::log_info(username + " joined group " + group_name);
-                // Notify existing group members about the new member
-                for (int member_socket : groups[group_name]) {
-                    if (member_socket != client_socket) {
-                        send_message(member_socket, username + " has joined the group " + group_name + ".\n");
-                    }
+
+    // On the closing connections' shard: every owner drops them from its groups
+    void depart(const std::vector<int>& sockets) {
+        for (int sock : sockets) {
+            for (size_t shard = 0; shard < mailboxes.size(); shard++) {
+                GroupRequest request;
+                request.kind = GroupRequest::Kind::Depart;
+                request.fd = sock;
+                request.session = socket_session[sock];
+                send(shard, std::move(request));
+            }
+        }
+    }
+
+    // From a thread that is not a shard: a line for the members of a group
+    // this shard is the hash owner of; passed on from here if it moved
+    void post_line(std::string_view group, std::string_view line) {
+        GroupRequest request;
+        request.kind = GroupRequest::Kind::Line;
+        request.group = group;
+        request.text = make_payload(line);
+        {
+            std::lock_guard<std::mutex> lock(outside_mutex);
+            outside.push_back(std::move(request));
+        }
+        shards[id]->wake();
+    }
+
+    // On this shard, when woken: runs what the mailboxes and the outside queue hold
+    void run() {
+        GroupRequest request;
+        for (size_t from = 0; from < mailboxes.size(); from++) {
+            Mailbox& mailbox = *mailboxes[from];
+            while (mailbox.pop(request)) {
+                dispatch(request, from);
+            }
+            if (mailbox.producer_waiting.load(std::memory_order_relaxed) && mailbox.producer_waiting.exchange(false)) {
+                shards[from]->wake();  // It has requests kept back for this mailbox
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(outside_mutex);
+            outside_draining.swap(outside);
+        }
+        for (GroupRequest& line : outside_draining) {
+            send(owner_for(line.group), std::move(line));
+        }
+        outside_draining.clear();
+    }
+
+    // On this shard at the end of a tick: hands kept-back requests to their
+    // mailboxes, wakes the owners sent to, and checks the balance
+    void flush() {
+        for (size_t to = 0; to < backlog.size(); to++) {
+            std::vector<GroupRequest>& waiting = backlog[to];
+            if (!waiting.empty()) {
+                Mailbox& mailbox = *owners[to]->mailboxes[id];
+                size_t sent = 0;
+                while (sent < waiting.size() && mailbox.push(waiting[sent])) sent++;
+                if (sent < waiting.size()) {
+                    // Retried once after raising the flag, in case the owner emptied it in between
+                    mailbox.producer_waiting.store(true);
+                    while (sent < waiting.size() && mailbox.push(waiting[sent])) sent++;
                 }
+                waiting.erase(waiting.begin(), waiting.begin() + sent);
+                wake[to] = wake[to] || sent > 0;
             }
+            if (wake[to]) {
+                wake[to] = false;
+                shards[to]->wake();
+            }
+        }
+        rebalance();
+    }
+
+    std::string stats() const {
+        return "groups=" + std::to_string(owned.load(std::memory_order_relaxed)) +
+               " group_load=" + std::to_string(total_load.load(std::memory_order_relaxed));
+    }
+
+    std::atomic<uint64_t> hops{0};         // Commands sent to another shard's owner
+    std::atomic<uint64_t> forwarded{0};    // Requests passed on after their group moved
+    std::atomic<uint64_t> kept_back{0};    // Requests that found their mailbox full
+    std::atomic<uint64_t> moves{0};
+    std::atomic<uint64_t> total_load{0};
+    std::atomic<size_t> owned{0};
+
+private:
+    struct Forward {
+        size_t to;
+        size_t markers;  // Switched answers still to pass on
+    };
+
+    size_t owner_for(std::string_view group) const {
+        if (!routes.empty()) {
+            auto it = routes.find(group);
+            if (it != routes.end()) return it->second;
+        }
+        return group_ring.owner(StringHash{}(group));
+    }
+
+    void set_route(std::string_view group, size_t owner) {
+        if (owner == group_ring.owner(StringHash{}(group))) {
+            if (auto it = routes.find(group); it != routes.end()) routes.erase(it);
         } else {
-            send_message(client_socket, "Group " + group_name + " does not exist.\n");
-            Logger::log_error("Join group failed: Group " + group_name + " does not exist for user " + username);
+            routes.insert_or_assign(std::string(group), owner);
         }
     }
-}
 
-void processLeaveGroup(int client_socket, const std::string& message, const std::string& username) {
-    size_t space = message.find(' ');
-    if (space == std::string::npos) {
-        send_message(client_socket, "Invalid syntax. Use: /leave_group <group_name>\n");
-        Logger::log_error("Invalid /leave_group syntax from " + username);
-        return;
+    void send(size_t to, GroupRequest&& request) {
+        if (to == static_cast<size_t>(id)) {
+            dispatch(request, to);
+            return;
+        }
+        std::vector<GroupRequest>& waiting = backlog[to];
+        if (waiting.empty() && owners[to]->mailboxes[id]->push(request)) {
+            wake[to] = true;
+            return;
+        }
+        kept_back.fetch_add(1, std::memory_order_relaxed);
+        waiting.push_back(std::move(request));
     }
-    std::string group_name = message.substr(space + 1);
-    group_name = group_name.substr(0, group_name.find_first_of("\r\n\0"));
-    {
-        std::lock_guard<std::mutex> lock(groups_mutex);
-        if (groups.find(group_name) != groups.end()) {
-            if (groups[group_name].find(client_socket) == groups[group_name].end()) {
-                send_message(client_socket, "You are not in group " + group_name + ".\n");
-                Logger::log_error(username + " attempted to leave group " + group_name + " but was not a member");
+
+    // Requests a shard sent straight here wait while one of its answers to a
+    // move into this shard is outstanding, so that everything it sent through
+    // the old owner runs first
+    void dispatch(GroupRequest& request, size_t source) {
+        if (!request.forwarded && awaiting[source] > 0) {
+            held[source].push_back(std::move(request));
+            return;
+        }
+        execute(request, source);
+    }
+
+    // Passes a request for a group that moved away on to its new owner
+    bool forward(std::string_view group, GroupRequest& request) {
+        if (forwards.empty()) return false;
+        auto it = forwards.find(group);
+        if (it == forwards.end()) return false;
+        request.forwarded = true;
+        forwarded.fetch_add(1, std::memory_order_relaxed);
+        send(it->second.to, std::move(request));
+        return true;
+    }
+
+    void execute(GroupRequest& request, size_t source) {
+        switch (request.kind) {
+        case GroupRequest::Kind::Command: {
+            CommandArgs args;
+            parse_command(request.text.view(), args);
+            std::string_view group = group_argument(request.command, args);
+            if (forward(group, request) || !local.claim(request.fd, request.session)) {
+                break;  // Moved on, or sent by a connection that has closed since
+            }
+            run_group_command(local, request.command, request.fd, args, request.username);
+            OwnedGroups::Members members = local.members(group);
+            charge(group, 1 + (request.command == CommandId::GroupMessage && members ? members->size() : 0));
+            break;
+        }
+        case GroupRequest::Kind::Line:
+            if (forward(request.group, request)) break;
+            if (OwnedGroups::Members members = local.members(request.group)) {
+                for (int sock : *members) send_message(sock, request.text);
+                metrics::local().fanout[static_cast<size_t>(metrics::Fanout::Group)].observe(members->size());
+                charge(request.group, 1 + members->size());
+            }
+            break;
+        case GroupRequest::Kind::Depart: {
+            local.depart(request.fd, request.session);
+            // Requests the connection sent to a moved group may still be on their way there
+            std::vector<size_t> targets;
+            for (const auto& [group, move] : forwards) {
+                if (std::find(targets.begin(), targets.end(), move.to) == targets.end()) targets.push_back(move.to);
+            }
+            for (size_t to : targets) {
+                GroupRequest departure;
+                departure.kind = GroupRequest::Kind::Depart;
+                departure.forwarded = true;
+                departure.fd = request.fd;
+                departure.session = request.session;
+                send(to, std::move(departure));
+            }
+            break;
+        }
+        case GroupRequest::Kind::Adopt:
+            adopt(request, source);
+            break;
+        case GroupRequest::Kind::Route: {
+            set_route(request.group, source);
+            GroupRequest answer;
+            answer.kind = GroupRequest::Kind::Switched;
+            answer.group = std::move(request.group);
+            answer.from = id;
+            send(request.from, std::move(answer));
+            break;
+        }
+        case GroupRequest::Kind::Switched:
+            if (!request.forwarded) {
+                // At the old owner, behind everything the shard sent here before
+                auto it = forwards.find(request.group);
+                if (it == forwards.end()) break;
+                size_t to = it->second.to;
+                if (--it->second.markers == 0) forwards.erase(it);
+                request.forwarded = true;
+                send(to, std::move(request));
             } else {
-                groups[group_name].erase(client_socket);
-                send_message(client_socket, "You left the group " + group_name + ".\n");
-                Logger::log_info(username + " left group " + group_name);
-                // Notify remaining members in the group
-                for (int member_socket : groups[group_name]) {
-                    send_message(member_socket, username + " has left the group " + group_name + ".\n");
-                }
-                // Remove group if it becomes empty
-                if (groups[group_name].empty()) {
-                    groups.erase(group_name);
-                    Logger::log_info("Group " + group_name + " removed as it became empty.");
-                }
+                settle(request.group, request.from);
             }
-        } else {
-            send_message(client_socket, "Group " + group_name + " does not exist.\n");
-            Logger::log_error("Leave group failed: Group " + group_name + " does not exist for user " + username);
+            break;
         }
     }
-}
 
-void processGroupMessage(int client_socket, const std::string& message, const std::string& username) {
-    size_t space1 = message.find(' ');
-    size_t space2 = message.find(' ', space1 + 1);
-    if (space1 == std::string::npos || space2 == std::string::npos) {
-        send_message(client_socket, "Invalid syntax. Use: /group_msg <group_name> <message>\n");
-        Logger::log_error("Invalid /group_msg syntax from " + username);
-        return;
+    void charge(std::string_view group, uint64_t units) {
+        local.charge(group, units);
+        window_load += units;
+        total_load.fetch_add(units, std::memory_order_relaxed);
+        owned.store(local.size(), std::memory_order_relaxed);
     }
-    std::string group_name = message.substr(space1 + 1, space2 - space1 - 1);
-    group_name = group_name.substr(0, group_name.find_first_of("\r\n\0"));
-    std::string group_message = message.substr(space2 + 1);
-    group_message = group_message.substr(0, group_message.find_first_of("\r\n\0"));
 
-    {
-        std::lock_guard<std::mutex> lock(groups_mutex);
-        if (groups.find(group_name) != groups.end()) {
-            if (groups[group_name].find(client_socket) == groups[group_name].end()) {
-                send_message(client_socket, "You are not a member of group " + group_name + ".\n");
-                Logger::log_error(username + " attempted to send a group message to " + group_name + " but is not a member");
+    // Takes over a group from its previous owner (source) and announces the
+    // new route to every other shard, each of which answers through source
+    void adopt(GroupRequest& request, size_t source) {
+        local.adopt(request.group, *request.moved);
+        owned.store(local.size(), std::memory_order_relaxed);
+        set_route(request.group, id);
+        size_t markers = 0;
+        for (size_t shard = 0; shard < awaiting.size(); shard++) {
+            if (shard == source) continue;
+            awaiting[shard]++;
+            markers++;
+            GroupRequest message;
+            message.group = request.group;
+            if (shard == static_cast<size_t>(id)) {
+                // This shard switched just now; its answer goes through source as well
+                message.kind = GroupRequest::Kind::Switched;
+                message.from = id;
+                send(source, std::move(message));
             } else {
-                for (int sock : groups[group_name]) {
-                    if (sock != client_socket) {
-                        send_message(sock, "[" + username + "][Group " + group_name + "]: " + group_message + "\n");
-                    }
-                }
-                Logger::log_info(username + " sent a group message to group " + group_name);
+                message.kind = GroupRequest::Kind::Route;
+                message.from = static_cast<int>(source);
+                send(shard, std::move(message));
             }
-        } else {
-            send_message(client_socket, "Group " + group_name + " does not exist.\n");
-            Logger::log_error("Group message failed: Group " + group_name + " does not exist for user " + username);
         }
+        settling.insert_or_assign(std::move(request.group), markers);
     }
-}
 
-// Handling client authentication
-bool authenticate_client(int client_socket, std::string & username) {
-    char buffer[BUFFER_SIZE];
-    // Prompt for username
-    send_message(client_socket, "Enter username: ");
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(client_socket, buffer, sizeof(buffer), 0) <= 0) {
-        Logger::log_error("Failed to read username from socket " + std::to_string(client_socket));
-        return false;
+    // A shard's answer to a move into this shard arrived: once it has no
+    // more outstanding, its held requests run in the order they came
+    void settle(const std::string& group, int shard) {
+        if (auto it = settling.find(group); it != settling.end() && --it->second == 0) {
+            settling.erase(it);
+        }
+        if (--awaiting[shard] > 0 || held[shard].empty()) return;
+        std::vector<GroupRequest> replay;
+        replay.swap(held[shard]);
+        for (GroupRequest& request : replay) {
+            dispatch(request, shard);
+        }
     }
-    username = std::string(buffer);
-    username = username.substr(0, username.find_first_of("\r\n\0"));
 
-    // Prompt for password
-    send_message(client_socket, "Enter password: ");
-    memset(buffer, 0, sizeof(buffer));
-    if (recv(client_socket, buffer, sizeof(buffer), 0) <= 0) {
-        Logger::log_error("Failed to read password for user " + username);
-        return false;
+    // Hands the busiest group that fits to the least busy owner when this
+    // one did well over the average work in the last interval
+    void rebalance() {
+        auto now = std::chrono::steady_clock::now();
+        if (now < next_check) return;
+        next_check = now + std::chrono::milliseconds(GROUP_REBALANCE_MS);
+        uint64_t mine = window_load;
+        window_load = 0;
+        uint64_t sum = 0;
+        size_t least = id;
+        uint64_t least_load = mine;
+        for (size_t shard = 0; shard < seen_load.size(); shard++) {
+            uint64_t total = owners[shard]->total_load.load(std::memory_order_relaxed);
+            uint64_t load = total - seen_load[shard];
+            seen_load[shard] = total;
+            sum += load;
+            if (load < least_load) {
+                least = shard;
+                least_load = load;
+            }
+        }
+        // Only one move at a time, and none while the last one is settling
+        bool busy = mine >= GROUP_REBALANCE_MIN_LOAD && 2 * mine * seen_load.size() > 3 * sum;
+        if (!busy || least == static_cast<size_t>(id) || !forwards.empty() || !settling.empty() ||
+            routes.size() >= GROUP_MAX_ROUTES) {
+            local.cool();
+            return;
+        }
+        // A group carrying more than the gap would only move the hot spot
+        std::string group = local.hottest_below(mine - least_load);
+        if (group.empty()) return;
+        GroupRequest request;
+        request.kind = GroupRequest::Kind::Adopt;
+        request.forwarded = true;  // Leads the requests forwarded behind it
+        request.moved = local.release(group);
+        request.group = group;
+        owned.store(local.size(), std::memory_order_relaxed);
+        set_route(group, least);
+        forwards.insert_or_assign(group, Forward{least, seen_load.size() - 1});
+        send(least, std::move(request));
+        moves.fetch_add(1, std::memory_order_relaxed);
+        LOG_INFO("Group ", group, " moved from shard ", std::to_string(id), " to shard ", std::to_string(least));
     }
-    std::string password(buffer);
-    password = password.substr(0, password.find_first_of("\r\n\0"));
 
-    {
+    int id;
+    OwnedGroups local;
+    std::vector<std::unique_ptr<Mailbox>> mailboxes;  // By sending shard; this shard consumes them all
+    std::unordered_map<std::string, size_t, StringHash, std::equal_to<>> routes;  // Groups off their hash owner
+    std::unordered_map<std::string, Forward, StringHash, std::equal_to<>> forwards;  // Moved away, not yet settled
+    std::unordered_map<std::string, size_t, StringHash, std::equal_to<>> settling;  // Moved here: answers to come
+    std::vector<size_t> awaiting;                   // By shard: its answers to moves here still to come
+    std::vector<std::vector<GroupRequest>> held;    // By shard: its requests waiting for those answers
+    std::vector<std::vector<GroupRequest>> backlog; // By owner: requests its full mailbox could not take
+    std::vector<char> wake;                         // By owner: requests were sent to it this tick
+    std::mutex outside_mutex;
+    std::vector<GroupRequest> outside;              // Lines posted by threads that are not shards
+    std::vector<GroupRequest> outside_draining;
+    uint64_t window_load = 0;
+    std::vector<uint64_t> seen_load;                // Every owner's total_load at the last check
+    std::chrono::steady_clock::time_point next_check = std::chrono::steady_clock::now();
+};
+
+bool route_group_command(int client_socket, CommandId command, const CommandArgs& args, std::string_view message,
+                         const std::string& username) {
+    if (owners.empty()) return false;
+    owners[current_shard]->route(client_socket, command, group_argument(command, args), message, username);
+    return true;
+}
+
+bool depart_groups(const std::vector<int>& sockets) {
+    if (owners.empty()) return false;
+    owners[current_shard]->depart(sockets);
+    return true;
+}
+
+bool post_group_line(std::string_view group, std::string_view line) {
+    if (owners.empty()) return false;
+    owners[group_ring.owner(StringHash{}(group))]->post_line(group, line);
+    return true;
+}
+
+void run_group_requests() {
+    if (!owners.empty()) owners[current_shard]->run();
+}
+
+void flush_group_requests() {
+    if (!owners.empty()) owners[current_shard]->flush();
+}
+
+// Reports per-shard load to the requesting client
+void processStats(int client_socket, const std::string& username) {
+    std::string report;
+    if (shards.empty()) {
+        metrics::ThreadMetrics total;
+        metrics::registry.collect(total);
         std::lock_guard<std::mutex> lock(clients_mutex);
-        if (users.find(username) != users.end() && users[username] == password) {
-            // First add the client to our list
-            clients[client_socket] = username;
-            Logger::log_info("User " + username + " authenticated successfully.");
-            
-            // Send welcome message to the new client
-            send_message(client_socket, "Welcome to the chat server!\n");
-            
-            // Send the list of currently online users to the new client
-            if (clients.size() > 1) {  // If there are other users online
-                std::string online_users = "Currently online users: ";
-                for (const auto& [_, user] : clients) {
-                    if (user != username) {  // Don't include the new user
-                        online_users += user + ", ";
-                    }
-                }
-                // Remove the last comma and space
-                if (online_users.length() > 2) {
-                    online_users = online_users.substr(0, online_users.length() - 2);
+        report = "Thread mode: clients=" + std::to_string(clients.size()) +
+                 " send_calls=" + std::to_string(total[metrics::Counter::SendCalls].get()) +
+                 " coalesced=" + std::to_string(total[metrics::Counter::SendsCoalesced].get()) +
+                 " heap_allocations=" + std::to_string(total[metrics::Counter::HeapAllocations].get()) + "\n";
+    } else {
+        for (size_t shard = 0; shard < shards.size(); shard++) {
+            report += shards[shard]->stats();
+            if (!owners.empty()) report += " " + owners[shard]->stats();
+            report += "\n";
+        }
+    }
+    send_message(client_socket, report);
+    LOG_INFO("Stats requested by " + username);
+}
+
+// Accept and handle clients in separate threads
+// A thread mode connection that has not sent its credentials yet; it stays
+// in place in the login loop's map, which its deadline timer relies on
+struct PendingLogin {
+    FrameDecoder decoder;
+    LoginDialogue login;
+    TimerWheel::Timer deadline;  // data is the socket
+    std::chrono::steady_clock::time_point accepted_at;
+};
+
+// Thread mode's accept loop, which also runs every login dialogue on
+// non-blocking sockets. A client gets its own thread only once its
+// credentials have arrived, so clients that are slow to log in, or never
+// do, cost a map entry instead of a blocked thread until their deadline.
+class LoginLoop {
+public:
+    explicit LoginLoop(int server_socket) : server_socket(server_socket) {}
+
+    void run() {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0 || !timers.open()) {
+            LOG_ERROR("Failed to start the login loop.");
+            return;
+        }
+        fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+        watch(server_socket);
+        watch(timers.fd());
+        epoll_event events[MAX_EVENTS];
+        while (true) {
+            int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("epoll_wait failed in the login loop.");
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == server_socket) {
+                    accept_connections();
+                } else if (fd == timers.fd()) {
+                    timers.expire([this](TimerWheel::Timer& timer) { expire(static_cast<int>(timer.data)); });
+                } else {
+                    handle_readable(fd);
                 }
-                send_message(client_socket, online_users + "\n");
             }
-            
-            // Notify other clients that a new user has joined
-            for (const auto& [sock, user] : clients) {
-                if (sock != client_socket) {
-                    send_message(sock, username + " has joined the chat\n");
+        }
+    }
+
+private:
+    void watch(int fd) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void accept_connections() {
+        while (true) {
+            int client_socket = accept4(server_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Error accepting connection.");
                 }
+                return;
             }
-            return true;
-        } else {
-            send_message(client_socket, "Authentication failed.\n");
-            Logger::log_error("Authentication failed for user " + username);
-            return false;
+            LOG_INFO("New connection accepted. Waiting for authentication...");
+            metrics::ThreadMetrics& thread_metrics = metrics::local();
+            thread_metrics[metrics::Counter::ConnectionsAccepted].add(1);
+            thread_metrics[metrics::Counter::LoginsPending].add(1);
+            PendingLogin& login = pending[client_socket];
+            login.accepted_at = std::chrono::steady_clock::now();
+            watch(client_socket);
+            login.deadline.data = client_socket;
+            if (config.login_timeout > 0) {
+                timers.schedule(login.deadline, LoopTimers::ticks(config.login_timeout));
+            }
+            send_message(client_socket, "Enter username: ");
         }
     }
+
+    // Level-triggered: one read per event, as read_command() does
+    void handle_readable(int client_socket) {
+        auto it = pending.find(client_socket);
+        if (it == pending.end()) return;
+        PendingLogin& login = it->second;
+        char buffer[BUFFER_SIZE];
+        ssize_t recv_size = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (recv_size < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (recv_size <= 0) {
+            drop(it);
+            return;
+        }
+        metrics::add(metrics::Counter::BytesReceived, recv_size);
+        if (!login.decoder.feed(buffer, recv_size)) {
+            send_message(client_socket, "Message too long.\n");
+            LOG_ERROR("Oversized command from socket " + std::to_string(client_socket));
+            drop(it);
+            return;
+        }
+        std::string_view command;
+        while (login.decoder.next(command)) {
+            if (login.login.advance(client_socket, command, login.decoder.line_mode())) {
+                hand_off(it);
+                return;
+            }
+        }
+    }
+
+    // Credentials complete: the client's own thread checks them and serves it
+    void hand_off(std::unordered_map<int, PendingLogin>::iterator it) {
+        int client_socket = it->first;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_socket, nullptr);
+        fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) & ~O_NONBLOCK);
+        metrics::local()[metrics::Counter::LoginsPending].sub(1);
+        PendingLogin& login = it->second;
+        std::thread(handle_client, client_socket, std::move(login.decoder), std::move(login.login), login.accepted_at)
+            .detach();
+        pending.erase(it);  // Also cancels the deadline
+    }
+
+    void expire(int client_socket) {
+        auto it = pending.find(client_socket);
+        if (it == pending.end()) return;
+        send_message(client_socket, "Login timed out.\n");
+        metrics::add(metrics::Counter::AuthTimeout);
+        LOG_ERROR("Login timed out on socket " + std::to_string(client_socket));
+        drop(it);
+    }
+
+    void drop(std::unordered_map<int, PendingLogin>::iterator it) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+        close(it->first);
+        metrics::ThreadMetrics& thread_metrics = metrics::local();
+        thread_metrics[metrics::Counter::LoginsPending].sub(1);
+        thread_metrics[metrics::Counter::ConnectionsClosed].add(1);
+        pending.erase(it);
+    }
+
+    int server_socket;
+    int epoll_fd = -1;
+    LoopTimers timers;
+    std::unordered_map<int, PendingLogin> pending;
+};
+
+void run_thread_mode(int server_socket) {
+    LoginLoop(server_socket).run();
 }
 
-// New function to process a client message using token splitting
-void processClientMessage(int client_socket, const std::string & message, const std::string & username) {
-    std::vector<std::string> tokens = split(message);
-    if (tokens.empty()) {
-        send_message(client_socket, "Empty command received.\n");
-        Logger::log_error("Empty command received from " + username);
-        return;
+// Starts one shard per reactor thread; the main thread runs the last one
+bool run_reactor_mode() {
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    socket_owner_size = std::min<rlim_t>(limit.rlim_cur, MAX_OPEN_FILES);
+    socket_owner = std::make_unique<std::atomic<int>[]>(socket_owner_size);
+    socket_session = std::make_unique<uint64_t[]>(socket_owner_size);
+    for (size_t fd = 0; fd < socket_owner_size; fd++) {
+        socket_owner[fd].store(-1, std::memory_order_relaxed);
     }
-    // Dispatch based on the first token which is the command
-    if (tokens[0] == "/msg") {
-        processPrivateMessage(client_socket, message, username);
-    } else if (tokens[0] == "/broadcast") {
-        processBroadcastMessage(client_socket, message, username);
-    } else if (tokens[0] == "/create_group") {
-        processCreateGroup(client_socket, message, username);
-    } else if (tokens[0] == "/join_group") {
-        processJoinGroup(client_socket, message, username);
-    } else if (tokens[0] == "/leave_group") {
-        processLeaveGroup(client_socket, message, username);
-    } else if (tokens[0] == "/group_msg") {
-        processGroupMessage(client_socket, message, username);
-    } else {
-        send_message(client_socket, "Unknown command.\n");
-        Logger::log_error("Unknown command received from " + username + ": " + message);
+
+    for (int i = 0; i < config.shards; i++) {
+        shards.push_back(std::make_unique<Shard>(i));
+        if (!shards.back()->open(config.port)) {
+            return false;
+        }
+    }
+    hashing.start(config.hash_workers);
+    if (config.groups == "owned") {
+        group_ring = group_owners::HashRing(config.shards);
+        for (int i = 0; i < config.shards; i++) {
+            owners.push_back(std::make_unique<GroupOwner>(i, config.shards));
+        }
+    }
+    LOG_INFO("Reactor mode with " + std::to_string(config.shards) + " shards listening on port " +
+                     std::to_string(config.port) + "...");
+    for (int i = 0; i + 1 < config.shards; i++) {
+        std::thread(&Shard::run, shards[i].get()).detach();
+    }
+    shards.back()->run();
+    return true;
+}
+
+// --- Metrics endpoint ---
+// A plain HTTP responder on its own thread and loopback port. A scrape sums
+// the per-thread metric slabs with relaxed loads and reads a few existing
+// atomics; it takes no lock the chat threads use for messages.
+std::string render_metrics() {
+    metrics::ThreadMetrics total;
+    metrics::registry.collect(total);
+    std::string body = metrics::render(total);
+    metrics::write_scalar(body, "chat_clients_online", "gauge", "Authenticated client sessions.",
+                          std::to_string(clients_online.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_users_loaded", "gauge", "Users in the published credential table or index.",
+                          std::to_string(users.load(std::memory_order_acquire)->size()));
+    metrics::write_scalar(body, "chat_user_reloads_total", "counter", "Times the user file was loaded and published.",
+                          std::to_string(user_reloads.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_log_appends_total", "counter", "Messages appended to the message log.",
+                          std::to_string(history.appended.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_log_commits_total", "counter", "Group commits (one fsync round) of the message log.",
+                          std::to_string(history.commits.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_log_replayed_bytes_total", "counter", "Logged message bytes sent by replays.",
+                          std::to_string(history.replayed.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_log_errors_total", "counter", "Message log writes or syncs that failed.",
+                          std::to_string(history.errors.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_log_dropped_total", "counter", "Messages sent but not logged because the log fell behind.",
+                          std::to_string(history.dropped.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_offline_messages", "gauge", "Private messages waiting for offline users.",
+                          std::to_string(offline.messages.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_offline_memory_bytes", "gauge", "Memory held by offline messages.",
+                          std::to_string(offline.memory_used()));
+    metrics::write_scalar(body, "chat_offline_spilled_total", "counter", "Offline messages written to spill files.",
+                          std::to_string(offline.spilled.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_offline_expired_total", "counter", "Offline messages dropped by the TTL.",
+                          std::to_string(offline.expired.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_offline_delivered_total", "counter", "Offline messages delivered at login.",
+                          std::to_string(offline.delivered.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_offline_rejected_total", "counter", "Offline messages refused: inbox full.",
+                          std::to_string(offline.rejected.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_offline_errors_total", "counter", "Offline message spill writes that failed.",
+                          std::to_string(offline.errors.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_cluster_links_up", "gauge", "Cluster nodes this node has a link to.",
+                          std::to_string(cluster.links_up()));
+    metrics::write_scalar(body, "chat_cluster_frames_sent_total", "counter", "Frames queued for other nodes.",
+                          std::to_string(cluster.frames_sent.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_cluster_batches_sent_total", "counter", "Writes carrying frames to other nodes.",
+                          std::to_string(cluster.batches_sent.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_cluster_bytes_sent_total", "counter", "Bytes written to other nodes.",
+                          std::to_string(cluster.bytes_sent.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_cluster_frames_received_total", "counter", "Frames read from other nodes.",
+                          std::to_string(cluster.frames_received.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_cluster_frames_dropped_total", "counter",
+                          "Frames not sent: the link was down or its queue full.",
+                          std::to_string(cluster.frames_dropped.load(std::memory_order_relaxed)));
+    uint64_t hops = 0, forwarded = 0, kept_back = 0, moves = 0;
+    for (const auto& owner : owners) {
+        hops += owner->hops.load(std::memory_order_relaxed);
+        forwarded += owner->forwarded.load(std::memory_order_relaxed);
+        kept_back += owner->kept_back.load(std::memory_order_relaxed);
+        moves += owner->moves.load(std::memory_order_relaxed);
     }
+    metrics::write_scalar(body, "chat_group_owner_hops_total", "counter",
+                          "Group commands sent to the shard that owns the group.", std::to_string(hops));
+    metrics::write_scalar(body, "chat_group_owner_forwarded_total", "counter",
+                          "Group requests passed on by a group's previous owner.", std::to_string(forwarded));
+    metrics::write_scalar(body, "chat_group_owner_kept_back_total", "counter",
+                          "Group requests that found the owner's mailbox full.", std::to_string(kept_back));
+    metrics::write_scalar(body, "chat_group_owner_moves_total", "counter",
+                          "Groups handed to a less busy owner.", std::to_string(moves));
+    metrics::write_scalar(body, "chat_fanout_pool_jobs_total", "counter",
+                          "Large fan-outs split over the fan-out pool.",
+                          std::to_string(fanout.splits.load(std::memory_order_relaxed)));
+    metrics::write_scalar(body, "chat_fanout_pool_stolen_total", "counter",
+                          "Fan-out chunks written by a thread other than the one dealt them.",
+                          std::to_string(fanout.stolen.load(std::memory_order_relaxed)));
+    return body;
 }
 
-// Main client handler function
-void handle_client(int client_socket) {
+void serve_metrics_request(int client_socket) {
+    // A scraper that stalls cannot hold the endpoint for long
+    timeval timeout{1, 0};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::string request;
     char buffer[BUFFER_SIZE];
-    std::string username;
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t received = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (received <= 0) break;
+        request.append(buffer, received);
+    }
+    std::string response;
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0) {
+        std::string body = render_metrics();
+        response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    } else {
+        response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    size_t offset = 0;
+    while (offset < response.size()) {
+        ssize_t sent = send(client_socket, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+        if (sent <= 0) break;
+        offset += sent;
+    }
+    close(client_socket);
+}
 
-    // Use the new authentication helper
-    if (!authenticate_client(client_socket, username)) {
-        close(client_socket);
-        return;
+// Serves scrapes one at a time on 127.0.0.1:admin_port; false if the port cannot be bound
+bool start_admin_server(int port) {
+    int admin_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    setsockopt(admin_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (admin_socket < 0 || bind(admin_socket, (sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(admin_socket, 16) < 0) {
+        LOG_ERROR("Failed to open metrics port " + std::to_string(port));
+        return false;
     }
+    std::thread([admin_socket] {
+        while (true) {
+            int client_socket = accept(admin_socket, nullptr, nullptr);
+            if (client_socket < 0) {
+                if (errno != EINTR) LOG_ERROR("Error accepting metrics connection.");
+                continue;
+            }
+            serve_metrics_request(client_socket);
+        }
+    }).detach();
+    LOG_INFO("Metrics on http://127.0.0.1:" + std::to_string(port) + "/metrics");
+    return true;
+}
 
-    // Handle incoming messages
-    while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        int recv_size = recv(client_socket, buffer, sizeof(buffer), 0);
-        if (recv_size <= 0) {
-            break;
+// Sets the open file limit as high as allowed so that tens of thousands of
+// clients fit, but to at most MAX_OPEN_FILES: hosts with a hard limit near
+// 2^30 would otherwise size the reactor's per-descriptor tables in GiB.
+// A soft limit already above the cap is lowered, so no descriptor falls
+// outside the tables.
+void raise_fd_limit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        rlim_t wanted = std::min<rlim_t>(limit.rlim_max, MAX_OPEN_FILES);
+        if (limit.rlim_cur != wanted) {
+            limit.rlim_cur = wanted;
+            setrlimit(RLIMIT_NOFILE, &limit);
         }
-        std::string message(buffer);
-        processClientMessage(client_socket, message, username);
     }
+}
 
-    // Cleanup after the client disconnects
-    close(client_socket);
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.erase(client_socket);
-    }
-    // Notify remaining clients about the disconnection
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        for (const auto& [sock, user] : clients) {
-            send_message(sock, username + " has left the chat\n");
+// Parses command line options into the global config; returns false on bad usage
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--mode" && i + 1 < argc) {
+            config.mode = argv[++i];
+        } else if (arg == "--shards" && i + 1 < argc) {
+            config.shards = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--io" && i + 1 < argc) {
+            config.io = argv[++i];
+        } else if (arg == "--groups" && i + 1 < argc) {
+            config.groups = argv[++i];
+        } else if (arg == "--fanout-threshold" && i + 1 < argc) {
+            config.fanout_threshold = std::max(0L, std::atol(argv[++i]));
+        } else if (arg == "--fanout-workers" && i + 1 < argc) {
+            config.fanout_workers = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--hash-workers" && i + 1 < argc) {
+            config.hash_workers = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--flush-cap-us" && i + 1 < argc) {
+            config.flush_cap_us = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--queue-limit" && i + 1 < argc) {
+            config.queue_limit = std::max(1L, std::atol(argv[++i]));
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "drop_oldest") {
+                config.overflow = OverflowPolicy::DropOldest;
+            } else if (policy == "disconnect") {
+                config.overflow = OverflowPolicy::Disconnect;
+            } else {
+                return false;
+            }
+        } else if (arg == "--port" && i + 1 < argc) {
+            config.port = std::atoi(argv[++i]);
+        } else if (arg == "--admin-port" && i + 1 < argc) {
+            config.admin_port = std::atoi(argv[++i]);
+        } else if (arg == "--users" && i + 1 < argc) {
+            config.users_file = argv[++i];
+        } else if (arg == "--login-timeout" && i + 1 < argc) {
+            config.login_timeout = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            config.idle_timeout = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--ping-timeout" && i + 1 < argc) {
+            config.ping_timeout = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            config.log_dir = argv[++i];
+        } else if (arg == "--offline-ttl" && i + 1 < argc) {
+            config.offline_ttl = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--offline-memory" && i + 1 < argc) {
+            config.offline_memory_mb = std::max(0L, std::atol(argv[++i]));
+        } else if (arg == "--offline-dir" && i + 1 < argc) {
+            config.offline_dir = argv[++i];
+        } else if (arg == "--cluster" && i + 1 < argc) {
+            std::stringstream addresses(argv[++i]);
+            std::string address;
+            while (std::getline(addresses, address, ',')) {
+                config.cluster.push_back(address);
+            }
+        } else if (arg == "--node-id" && i + 1 < argc) {
+            config.node_id = std::atoi(argv[++i]);
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            std::string level = argv[++i];
+            if (level == "info") {
+                Logger::min_level = static_cast<int>(Logger::Level::Info);
+            } else if (level == "error") {
+                Logger::min_level = static_cast<int>(Logger::Level::Error);
+            } else if (level == "off") {
+                Logger::min_level = static_cast<int>(Logger::Level::Off);
+            } else {
+                return false;
+            }
+        } else if (arg == "--log-format" && i + 1 < argc) {
+            std::string format = argv[++i];
+            if (format != "text" && format != "binary") {
+                return false;
+            }
+            Logger::binary = format == "binary";
+        } else {
+            return false;
         }
     }
-    Logger::log_info("User " + username + " disconnected.");
+    // Keepalive is opt-in: clients that predate /ping never answer one
+    if (config.idle_timeout > 0 && config.ping_timeout == 0) config.ping_timeout = DEFAULT_PING_TIMEOUT;
+    // Owned groups need the fixed set of reactor threads to own them
+    return (config.mode == "thread" || config.mode == "reactor") && (config.io == "epoll" || config.io == "uring") &&
+           (config.groups == "shared" || (config.groups == "owned" && config.mode == "reactor"));
 }
 
+// server_bench.cpp includes this file to call the handlers directly and
+// defines SERVER_GRP_NO_MAIN to leave out main()
+#ifndef SERVER_GRP_NO_MAIN
 // Main server function to accept and handle incoming connections
-int main() {
-    // Load allowed users from the file
-    users = load_users("users.txt");
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " [--mode thread|reactor] [--shards N] [--io epoll|uring] [--port PORT]\n"
+                  << "       [--groups shared|owned] [--fanout-threshold N] [--fanout-workers N]\n"
+                  << "       [--admin-port PORT] [--users FILE] [--hash-workers N] [--login-timeout SECONDS]\n"
+                  << "       [--idle-timeout SECONDS] [--ping-timeout SECONDS] [--log-dir DIR]\n"
+                  << "       [--offline-ttl SECONDS] [--offline-memory MB] [--offline-dir DIR]\n"
+                  << "       [--cluster IP:PORT,IP:PORT,... --node-id N]\n"
+                  << "       [--queue-limit BYTES] [--overflow drop_oldest|disconnect] [--flush-cap-us MICROSECONDS]\n"
+                  << "       [--log-level info|error|off] [--log-format text|binary]" << std::endl;
+        return 1;
+    }
+    raise_fd_limit();
+
+    // Load allowed users from the file and pick up later edits to it
+    publish_users(config.users_file);
+    start_user_watcher(config.users_file);
+    presence.start();
+    std::string open_error;
+    if (!config.log_dir.empty() && !history.open(config.log_dir, open_error)) {
+        LOG_ERROR("Failed to open message log: " + open_error);
+        return 1;
+    }
+    if (config.offline_ttl > 0 &&
+        !offline.open(config.offline_memory_mb << 20, config.offline_ttl, config.offline_dir, open_error)) {
+        LOG_ERROR("Failed to open offline inbox: " + open_error);
+        return 1;
+    }
+    if (!config.cluster.empty() && !cluster.start(config.node_id, config.cluster)) {
+        return 1;
+    }
+    if (config.admin_port > 0 && !start_admin_server(config.admin_port)) {
+        return 1;
+    }
+
+    if (config.mode == "reactor") {
+        return run_reactor_mode() ? 0 : 1;
+    }
 
     // Create the server socket
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
-        Logger::log_error("Error creating socket.");
+        LOG_ERROR("Error creating socket.");
         return 1;
     }
 
+    // Allow quick restarts while old connections linger in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     sockaddr_in server_address{};
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
+    server_address.sin_port = htons(config.port);
     server_address.sin_addr.s_addr = INADDR_ANY;
 
     if (bind(server_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        Logger::log_error("Error binding socket.");
+        LOG_ERROR("Error binding socket.");
         return 1;
     }
 
-    if (listen(server_socket, 5) < 0) {
-        Logger::log_error("Error listening for connections.");
+    if (listen(server_socket, SOMAXCONN) < 0) {
+        LOG_ERROR("Error listening for connections.");
         return 1;
     }
 
-    Logger::log_info("Server listening on port 12345...");
+    LOG_INFO("Server listening on port " + std::to_string(config.port) + "...");
 
-    // Accept and handle clients in separate threads
-    while (true) {
-        sockaddr_in client_address{};
-        socklen_t client_address_size = sizeof(client_address);
-        int client_socket = accept(server_socket, (sockaddr*)&client_address, &client_address_size);
-        if (client_socket < 0) {
-            Logger::log_error("Error accepting connection.");
-            continue;
-        }
-        Logger::log_info("New connection accepted. Waiting for authentication...");
-        std::thread client_thread(handle_client, client_socket);
-        client_thread.detach(); 
+    if (config.fanout_threshold > 0) {
+        fanout.start(config.fanout_workers > 0 ? config.fanout_workers
+                                               : std::max(1u, std::thread::hardware_concurrency()));
     }
+    run_thread_mode(server_socket);
 
     close(server_socket);
     return 0;
 }
+#endif
@@ -1,22 +1,60 @@
 #include <iostream>
+#include <iomanip>
+#include <fstream>
 #include <vector>
 #include <thread>
 #include <chrono>
 #include <random>
+#include <atomic>
+#include <string>
+#include <string_view>
 #include <cstring>
+#include <cstdlib>
+#include <sstream>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 
-#define BUFFER_SIZE 1024
-#define NUM_CLIENTS 20  // Reduced from 100 to 20 for initial testing
-#define TEST_DURATION 60 // seconds
+// Open-loop load generator. Every worker thread owns a share of the
+// connections and sends on a fixed schedule (--rate messages per second in
+// total) whether or not earlier messages have been answered, so a slow server
+// cannot slow the generator down and hide its own latency (coordinated
+// omission). Each message carries its scheduled send time; receivers record
+// scheduled-send-to-delivery latency in a log-linear histogram. The
+// server's /stats is read before and after the run, and the writes it made
+// to client sockets in between are reported per delivered message.
+//
+// Usage: ./stress_test [--port N] [--connections N] [--rate MSGS_PER_SEC]
+//                      [--duration S] [--warmup S] [--drain S] [--threads N]
+//                      [--mix msg=60,group=30,broadcast=10] [--group-size N]
+//                      [--csv FILE] [--json FILE]
+
+#define BUFFER_SIZE 65536
 #define MAX_RETRIES 3   // Number of connection retries
+#define MAX_EVENTS 256
+
+using Clock = std::chrono::steady_clock;
 
-struct TestClient {
-    int socket;
-    std::string username;
-    std::string password;
+struct LoadConfig {
+    int port = 12345;
+    int connections = 20;
+    double rate = 100;       // Messages per second, all connections together
+    double duration = 60;    // Seconds of sending
+    double warmup = 1;       // Leading seconds excluded from the latency histogram
+    double drain = 2;        // Seconds to wait for deliveries after the last send
+    int threads = 0;         // 0: min(4, connections)
+    int mix_msg = 60;        // Relative weights of the command mix
+    int mix_group = 30;
+    int mix_broadcast = 10;
+    int group_size = 5;      // Connections per group; group k is connections [k*size, (k+1)*size)
+    std::string csv_file;
+    std::string json_file;
 };
+LoadConfig config;
 
 // Test users from users.txt
 std::vector<std::pair<std::string, std::string>> test_users = {
@@ -29,15 +67,100 @@ std::vector<std::pair<std::string, std::string>> test_users = {
     {"grace", "passw0rd"}
 };
 
-std::vector<std::string> test_messages = {
-    "/broadcast Hello everyone!",
-    "/create_group TestGroup",
-    "/join_group TestGroup",
-    "/group_msg TestGroup Test message",
-    "/leave_group TestGroup",
-    "/msg alice Hello there!"
+// HDR-style histogram of nanosecond values: exact below 128, above that
+// 128 linear sub-buckets per power of two, i.e. under 1% relative error
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 7;
+    static constexpr uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+
+    LatencyHistogram() : counts(SUB_BUCKETS * 58, 0) {}
+
+    void record(uint64_t value) {
+        counts[index_of(value)]++;
+        total++;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    // Upper bound of the bucket holding the given quantile (0..1)
+    uint64_t percentile(double quantile) const {
+        if (total == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(upper_bound(i), max);
+        }
+        return max;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return max; }
+    double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+
+private:
+    static size_t index_of(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        int shift = 64 - __builtin_clzll(value) - (SUB_BITS + 1);
+        return SUB_BUCKETS * (shift + 1) + ((value >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t upper_bound(size_t index) {
+        if (index < SUB_BUCKETS) return index;
+        int shift = static_cast<int>(index / SUB_BUCKETS) - 1;
+        uint64_t mantissa = SUB_BUCKETS + index % SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+struct LoadConnection {
+    int fd = -1;
+    int user = 0;       // Index into test_users
+    int group = -1;     // Index of the group it belongs to, -1 if none
+    std::string received;  // Bytes after the last complete line
+    std::string unsent;    // Commands the socket buffer had no room for
+};
+
+// Per-worker results, merged by the main thread at the end
+struct WorkerResult {
+    LatencyHistogram latency;
+    uint64_t sent = 0;
+    uint64_t expected = 0;   // Deliveries the sent messages should cause
+    uint64_t delivered = 0;  // Timestamped messages received, warmup included
+    uint64_t late_sends = 0; // Sends more than 1 ms behind schedule
 };
 
+enum class Phase { Login, Setup, Run, Drain, Stop };
+std::atomic<Phase> phase{Phase::Login};
+std::atomic<int> logged_in{0};
+std::atomic<int> login_failures{0};
+Clock::time_point run_start;
+
+std::vector<LoadConnection> connections;
+std::vector<int> sessions_per_user;  // Logged-in connections per test user
+std::string group_prefix;
+
+std::string group_name(int group) {
+    return group_prefix + std::to_string(group);
+}
+
+int group_members(int group) {
+    return std::min(config.group_size, config.connections - group * config.group_size);
+}
+
 bool try_connect(int& sock, const sockaddr_in& server_addr, int retries) {
     for (int i = 0; i < retries; i++) {
         sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -57,102 +180,484 @@ bool try_connect(int& sock, const sockaddr_in& server_addr, int retries) {
     return false;
 }
 
-void simulate_client(int client_id) {
-    TestClient client;
-    
-    // Connect to server
+sockaddr_in server_address() {
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(12345);
+    server_addr.sin_port = htons(config.port);
     server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    return server_addr;
+}
+
+// Connects and logs in with the line protocol, which lets the login and every
+// later command be pipelined; returns false if the server refuses it
+bool login(LoadConnection& conn) {
+    if (!try_connect(conn.fd, server_address(), MAX_RETRIES)) {
+        return false;
+    }
+    // The generator's own sends must not wait on Nagle's algorithm
+    int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    const auto& [username, password] = test_users[conn.user];
+    std::string request = "/protocol line\n" + username + "\n" + password + "\n";
+    if (send(conn.fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        return false;
+    }
+    std::string reply;
+    char buffer[4096];
+    while (reply.find("Welcome") == std::string::npos) {
+        ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n <= 0 || reply.find("Authentication failed") != std::string::npos) {
+            return false;
+        }
+        reply.append(buffer, n);
+    }
+    // Anything after the welcome line (online users, join notices) is left
+    // for the worker, which skips lines that are not load messages
+    fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+// Writes as much as the socket takes; the rest waits for EPOLLOUT
+void flush_unsent(int epoll_fd, LoadConnection& conn) {
+    while (!conn.unsent.empty()) {
+        ssize_t n = send(conn.fd, conn.unsent.data(), conn.unsent.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            conn.unsent.erase(0, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+    epoll_event ev{};
+    ev.events = conn.unsent.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    ev.data.u32 = &conn - connections.data();
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+// Picks a command by the configured mix, stamped with its scheduled send time
+void send_one(int epoll_fd, LoadConnection& conn, int64_t scheduled_ns, std::mt19937& gen, WorkerResult& result) {
+    int total = config.mix_msg + config.mix_group + config.mix_broadcast;
+    int pick = std::uniform_int_distribution<>(0, total - 1)(gen);
+    std::string stamp = " lg " + std::to_string(scheduled_ns) + "\n";
+    std::string command;
+    if (pick < config.mix_msg) {
+        // Any logged-in user but the sender, reaching all of that user's sessions
+        int users = std::min<int>(test_users.size(), config.connections);
+        int recipient = conn.user;
+        if (users > 1) {
+            recipient = std::uniform_int_distribution<>(0, users - 2)(gen);
+            if (recipient >= conn.user) recipient++;
+        }
+        command = "/msg " + test_users[recipient].first + stamp;
+        result.expected += sessions_per_user[recipient];
+    } else if (pick < config.mix_msg + config.mix_group && conn.group >= 0) {
+        command = "/group_msg " + group_name(conn.group) + stamp;
+        result.expected += group_members(conn.group) - 1;
+    } else {
+        command = "/broadcast" + stamp;
+        result.expected += config.connections - 1;
+    }
+    bool idle = conn.unsent.empty();
+    conn.unsent += command;
+    if (idle) flush_unsent(epoll_fd, conn);
+    result.sent++;
+}
+
+// Records every complete load message in the received bytes and answers keepalive pings
+void handle_received(int epoll_fd, LoadConnection& conn, int64_t now_ns, WorkerResult& result) {
+    static const std::string marker = "]: lg ";
+    int64_t warmup_end = std::chrono::duration_cast<std::chrono::nanoseconds>(run_start.time_since_epoch()).count() +
+                         static_cast<int64_t>(config.warmup * 1e9);
+    size_t start = 0;
+    size_t end;
+    while ((end = conn.received.find('\n', start)) != std::string::npos) {
+        std::string_view line(conn.received.data() + start, end - start);
+        if (line == "/ping") {
+            bool idle = conn.unsent.empty();
+            conn.unsent += "/pong\n";
+            if (idle) flush_unsent(epoll_fd, conn);
+        }
+        size_t found = line.find(marker);
+        if (found != std::string_view::npos) {
+            int64_t scheduled_ns = std::atoll(line.data() + found + marker.size());
+            result.delivered++;
+            if (scheduled_ns >= warmup_end) {
+                result.latency.record(std::max<int64_t>(0, now_ns - scheduled_ns));
+            }
+        }
+        start = end + 1;
+    }
+    conn.received.erase(0, start);
+}
+
+// Logs in the worker's connections, then runs the send schedule and drains
+// deliveries until the main thread stops it. The i-th send of worker w is due
+// at run_start + (i * threads + w) / rate; a timerfd wakes it with nanosecond
+// precision and overdue sends go out immediately, never skipped.
+void run_worker(int worker, int threads, WorkerResult& result) {
+    std::vector<size_t> owned;
+    for (size_t i = worker; i < connections.size(); i += threads) {
+        owned.push_back(i);
+    }
+    int epoll_fd = epoll_create1(0);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
 
-    if (!try_connect(client.socket, server_addr, MAX_RETRIES)) {
-        std::cerr << "Client " << client_id << ": Connection failed after " << MAX_RETRIES << " attempts" << std::endl;
-        return;
+    for (size_t index : owned) {
+        LoadConnection& conn = connections[index];
+        if (!login(conn)) {
+            login_failures++;
+            if (conn.fd >= 0) close(conn.fd);
+            conn.fd = -1;
+        } else {
+            ev.events = EPOLLIN;
+            ev.data.u32 = index;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.fd, &ev);
+        }
+        logged_in++;
     }
 
-    std::cout << "Client " << client_id << ": Successfully connected" << std::endl;
+    std::mt19937 gen(std::random_device{}() + worker);
+    std::vector<size_t> senders;
+    for (size_t index : owned) {
+        if (connections[index].fd >= 0) senders.push_back(index);
+    }
+    double interval_ns = 1e9 / config.rate * threads;
+    double offset_ns = 1e9 / config.rate * worker;
+    uint64_t next = 0;  // Index of the next scheduled send
+    bool timer_armed = false;
+    epoll_event events[MAX_EVENTS];
+    char buffer[BUFFER_SIZE];
 
-    // Random number generator
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> user_dist(0, test_users.size() - 1);
-    std::uniform_int_distribution<> msg_dist(0, test_messages.size() - 1);
-    std::uniform_int_distribution<> delay_dist(500, 3000); // Increased delay range
+    while (phase != Phase::Stop) {
+        Phase current = phase;
+        int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+        int64_t start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(run_start.time_since_epoch()).count();
+        int64_t end_ns = start_ns + static_cast<int64_t>(config.duration * 1e9);
+        if (current == Phase::Run && !senders.empty()) {
+            int64_t due;
+            while ((due = start_ns + static_cast<int64_t>(offset_ns + next * interval_ns)) <= now_ns && due < end_ns) {
+                if (now_ns - due > 1000000) result.late_sends++;
+                LoadConnection& conn = connections[senders[std::uniform_int_distribution<size_t>(0, senders.size() - 1)(gen)]];
+                send_one(epoll_fd, conn, due, gen, result);
+                next++;
+            }
+            if (due < end_ns && !timer_armed) {
+                itimerspec when{};
+                when.it_value.tv_sec = due / 1000000000;
+                when.it_value.tv_nsec = due % 1000000000;
+                timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, nullptr);
+                timer_armed = true;
+            }
+        }
+        // Clock::now() is CLOCK_MONOTONIC, the timerfd's clock; the timeout only
+        // bounds how long a phase change from the main thread goes unnoticed
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 10);
+        for (int i = 0; i < n; i++) {
+            uint32_t index = events[i].data.u32;
+            if (index == UINT32_MAX) {
+                uint64_t expirations;
+                while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {}
+                timer_armed = false;
+                continue;
+            }
+            LoadConnection& conn = connections[index];
+            if (events[i].events & EPOLLOUT) {
+                flush_unsent(epoll_fd, conn);
+            }
+            ssize_t received;
+            while ((received = recv(conn.fd, buffer, sizeof(buffer), 0)) > 0) {
+                conn.received.append(buffer, received);
+            }
+            int64_t arrival_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+            handle_received(epoll_fd, conn, arrival_ns, result);
+        }
+    }
+    for (size_t index : owned) {
+        if (connections[index].fd >= 0) close(connections[index].fd);
+    }
+    close(timer_fd);
+    close(epoll_fd);
+}
+
+// Logs in one more client and returns the lines of the server's per-shard load report
+std::vector<std::string> fetch_server_stats() {
+    std::vector<std::string> report;
+    sockaddr_in server_addr = server_address();
+
+    int sock;
+    if (!try_connect(sock, server_addr, MAX_RETRIES)) {
+        std::cerr << "Stats: connection failed" << std::endl;
+        return report;
+    }
 
     char buffer[BUFFER_SIZE];
-    
-    // Authentication
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client.socket, buffer, BUFFER_SIZE, 0); // "Enter username: "
-    
-    int user_idx = user_dist(gen);
-    client.username = test_users[user_idx].first;
-    client.password = test_users[user_idx].second;
-    
-    send(client.socket, client.username.c_str(), client.username.length(), 0);
-    
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client.socket, buffer, BUFFER_SIZE, 0); // "Enter password: "
-    
-    send(client.socket, client.password.c_str(), client.password.length(), 0);
-    
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client.socket, buffer, BUFFER_SIZE, 0); // Welcome message
-    
-    // If authentication failed, close connection
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
-        std::cout << "Client " << client_id << ": Authentication failed" << std::endl;
-        close(client.socket);
-        return;
-    }
-
-    std::cout << "Client " << client_id << " (" << client.username << "): Connected and authenticated" << std::endl;
-
-    // Start time for test duration
-    auto start_time = std::chrono::steady_clock::now();
-    
-    // Main test loop
-    while (true) {
-        auto current_time = std::chrono::steady_clock::now();
-        if (std::chrono::duration_cast<std::chrono::seconds>(current_time - start_time).count() >= TEST_DURATION) {
-            break;
+    const auto& [username, password] = test_users[0];
+    recv(sock, buffer, BUFFER_SIZE, 0); // "Enter username: "
+    send(sock, username.c_str(), username.length(), 0);
+    recv(sock, buffer, BUFFER_SIZE, 0); // "Enter password: "
+    send(sock, password.c_str(), password.length(), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    recv(sock, buffer, BUFFER_SIZE, MSG_DONTWAIT); // Welcome message and online users
+
+    std::string request = "/stats";
+    send(sock, request.c_str(), request.length(), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // Skip chat traffic from other clients; the report lines start with "Shard" or "Thread mode"
+    std::string reply;
+    ssize_t n;
+    while ((n = recv(sock, buffer, BUFFER_SIZE, MSG_DONTWAIT)) > 0) {
+        reply.append(buffer, n);
+    }
+    std::istringstream lines(reply);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.rfind("Shard", 0) == 0 || line.rfind("Thread mode", 0) == 0) {
+            report.push_back(line);
         }
+    }
+    close(sock);
+    return report;
+}
 
-        // Send random message
-        std::string message = test_messages[msg_dist(gen)];
-        send(client.socket, message.c_str(), message.length(), 0);
-        
-        // Random delay between messages
-        std::this_thread::sleep_for(std::chrono::milliseconds(delay_dist(gen)));
-        
-        // Receive any pending messages
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(client.socket, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+// Sum of "name=N" over the report lines
+uint64_t sum_stat(const std::vector<std::string>& report, const std::string& name) {
+    uint64_t total = 0;
+    for (const std::string& line : report) {
+        size_t at = line.find(" " + name + "=");
+        if (at != std::string::npos) total += std::strtoull(line.c_str() + at + name.size() + 2, nullptr, 10);
     }
+    return total;
+}
 
-    close(client.socket);
-    std::cout << "Client " << client_id << " (" << client.username << "): Test completed" << std::endl;
+// Parses "msg=60,group=30,broadcast=10" into the mix weights
+bool parse_mix(const std::string& value) {
+    config.mix_msg = config.mix_group = config.mix_broadcast = 0;
+    std::istringstream items(value);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        size_t equals = item.find('=');
+        if (equals == std::string::npos) return false;
+        std::string name = item.substr(0, equals);
+        int weight = std::atoi(item.c_str() + equals + 1);
+        if (weight < 0) return false;
+        if (name == "msg") {
+            config.mix_msg = weight;
+        } else if (name == "group") {
+            config.mix_group = weight;
+        } else if (name == "broadcast") {
+            config.mix_broadcast = weight;
+        } else {
+            return false;
+        }
+    }
+    return config.mix_msg + config.mix_group + config.mix_broadcast > 0;
 }
 
-int main() {
-    std::cout << "Starting stress test with " << NUM_CLIENTS << " clients for " 
-              << TEST_DURATION << " seconds..." << std::endl;
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--port") {
+            config.port = std::stoi(value);
+        } else if (option == "--connections") {
+            config.connections = std::max(1, std::stoi(value));
+        } else if (option == "--rate") {
+            config.rate = std::stod(value);
+        } else if (option == "--duration") {
+            config.duration = std::stod(value);
+        } else if (option == "--warmup") {
+            config.warmup = std::stod(value);
+        } else if (option == "--drain") {
+            config.drain = std::stod(value);
+        } else if (option == "--threads") {
+            config.threads = std::max(1, std::stoi(value));
+        } else if (option == "--mix") {
+            if (!parse_mix(value)) return false;
+        } else if (option == "--group-size") {
+            config.group_size = std::max(1, std::stoi(value));
+        } else if (option == "--csv") {
+            config.csv_file = value;
+        } else if (option == "--json") {
+            config.json_file = value;
+        } else {
+            return false;
+        }
+    }
+    return argc % 2 == 1 && config.rate > 0 && config.duration > 0;
+}
 
-    std::vector<std::thread> client_threads;
-    
-    // Launch client threads
-    for (int i = 0; i < NUM_CLIENTS; ++i) {
-        client_threads.emplace_back(simulate_client, i);
-        // Increased delay between client launches
-        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+struct Summary {
+    uint64_t sent;
+    uint64_t expected;
+    uint64_t delivered;
+    uint64_t late_sends;
+    double send_rate;
+    double delivery_rate;
+    uint64_t send_calls;  // Server writes to client sockets during the run
+    double send_calls_per_message;
+    LatencyHistogram latency;
+};
+
+std::string mix_string() {
+    return "msg=" + std::to_string(config.mix_msg) + ",group=" + std::to_string(config.mix_group) +
+           ",broadcast=" + std::to_string(config.mix_broadcast);
+}
+
+double micros(uint64_t ns) { return ns / 1000.0; }
+
+// Appends one row per run, with a header when the file is new
+void write_csv(const Summary& summary) {
+    bool fresh = std::ifstream(config.csv_file).peek() == std::ifstream::traits_type::eof();
+    std::ofstream out(config.csv_file, std::ios::app);
+    if (fresh) {
+        out << "unix_time,connections,target_rate,duration_s,mix,group_size,sent,send_rate,expected,delivered,"
+               "delivered_per_s,late_sends,p50_us,p90_us,p99_us,p999_us,max_us,mean_us,send_calls_per_message\n";
+    }
+    out << std::time(nullptr) << ',' << config.connections << ',' << config.rate << ',' << config.duration << ",\""
+        << mix_string() << "\"," << config.group_size << ',' << summary.sent << ',' << summary.send_rate << ','
+        << summary.expected << ',' << summary.delivered << ',' << summary.delivery_rate << ',' << summary.late_sends
+        << ',' << micros(summary.latency.percentile(0.5)) << ',' << micros(summary.latency.percentile(0.9)) << ','
+        << micros(summary.latency.percentile(0.99)) << ',' << micros(summary.latency.percentile(0.999)) << ','
+        << micros(summary.latency.maximum()) << ',' << summary.latency.mean() / 1000 << ','
+        << summary.send_calls_per_message << '\n';
+}
+
+void write_json(const Summary& summary) {
+    std::ofstream out(config.json_file);
+    out << "{\n"
+        << "  \"connections\": " << config.connections << ",\n"
+        << "  \"target_rate\": " << config.rate << ",\n"
+        << "  \"duration_s\": " << config.duration << ",\n"
+        << "  \"mix\": {\"msg\": " << config.mix_msg << ", \"group\": " << config.mix_group
+        << ", \"broadcast\": " << config.mix_broadcast << "},\n"
+        << "  \"group_size\": " << config.group_size << ",\n"
+        << "  \"sent\": " << summary.sent << ",\n"
+        << "  \"send_rate\": " << summary.send_rate << ",\n"
+        << "  \"expected\": " << summary.expected << ",\n"
+        << "  \"delivered\": " << summary.delivered << ",\n"
+        << "  \"delivered_per_s\": " << summary.delivery_rate << ",\n"
+        << "  \"late_sends\": " << summary.late_sends << ",\n"
+        << "  \"send_calls\": " << summary.send_calls << ",\n"
+        << "  \"send_calls_per_message\": " << summary.send_calls_per_message << ",\n"
+        << "  \"latency_us\": {\"p50\": " << micros(summary.latency.percentile(0.5))
+        << ", \"p90\": " << micros(summary.latency.percentile(0.9))
+        << ", \"p99\": " << micros(summary.latency.percentile(0.99))
+        << ", \"p99.9\": " << micros(summary.latency.percentile(0.999))
+        << ", \"max\": " << micros(summary.latency.maximum())
+        << ", \"mean\": " << summary.latency.mean() / 1000
+        << ", \"samples\": " << summary.latency.count() << "}\n"
+        << "}\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " [--port N] [--connections N] [--rate MSGS_PER_SEC] [--duration S]\n"
+                  << "       [--warmup S] [--drain S] [--threads N] [--mix msg=60,group=30,broadcast=10]\n"
+                  << "       [--group-size N] [--csv FILE] [--json FILE]" << std::endl;
+        return 1;
+    }
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    int threads = config.threads ? std::min(config.threads, config.connections) : std::min(4, config.connections);
+    group_prefix = "lg" + std::to_string(getpid()) + "_";
+
+    connections.resize(config.connections);
+    sessions_per_user.assign(test_users.size(), 0);
+    for (int i = 0; i < config.connections; i++) {
+        connections[i].user = i % test_users.size();
+        connections[i].group = config.group_size > 1 ? i / config.group_size : -1;
+        sessions_per_user[connections[i].user]++;
     }
 
-    // Wait for all clients to complete
-    for (auto& thread : client_threads) {
-        thread.join();
+    std::cout << "Open-loop load: " << config.connections << " connections, " << config.rate << " msg/s for "
+              << config.duration << " s (" << mix_string() << ", group size " << config.group_size << ", "
+              << threads << " threads)" << std::endl;
+
+    std::vector<WorkerResult> results(threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(run_worker, i, threads, std::ref(results[i]));
+    }
+    while (logged_in < config.connections) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (login_failures > 0) {
+        std::cerr << login_failures << " connections failed to log in" << std::endl;
+        phase = Phase::Stop;
+        for (auto& worker : workers) worker.join();
+        return 1;
+    }
+
+    // Groups: the first member creates, the others join once it exists.
+    // Workers keep draining the sockets meanwhile.
+    phase = Phase::Setup;
+    if (config.group_size > 1) {
+        for (int group = 0; group * config.group_size < config.connections; group++) {
+            std::string create = "/create_group " + group_name(group) + "\n";
+            send(connections[group * config.group_size].fd, create.data(), create.size(), MSG_NOSIGNAL);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        for (int i = 0; i < config.connections; i++) {
+            if (i % config.group_size == 0) continue;
+            std::string join = "/join_group " + group_name(connections[i].group) + "\n";
+            send(connections[i].fd, join.data(), join.size(), MSG_NOSIGNAL);
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::vector<std::string> stats_before = fetch_server_stats();
+
+    run_start = Clock::now() + std::chrono::milliseconds(100);
+    phase = Phase::Run;
+    auto run_end = run_start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.duration));
+    std::this_thread::sleep_until(run_end);
+    phase = Phase::Drain;
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.drain));
+    phase = Phase::Stop;
+    for (auto& worker : workers) worker.join();
+
+    Summary summary{};
+    for (const WorkerResult& result : results) {
+        summary.sent += result.sent;
+        summary.expected += result.expected;
+        summary.delivered += result.delivered;
+        summary.late_sends += result.late_sends;
+        summary.latency.merge(result.latency);
     }
+    summary.send_rate = summary.sent / config.duration;
+    summary.delivery_rate = summary.delivered / config.duration;
+    std::vector<std::string> stats_after = fetch_server_stats();
+    summary.send_calls = sum_stat(stats_after, "send_calls") - sum_stat(stats_before, "send_calls");
+    summary.send_calls_per_message = static_cast<double>(summary.send_calls) / std::max<uint64_t>(summary.delivered, 1);
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "sent=" << summary.sent << " (" << summary.send_rate << "/s, " << summary.late_sends
+              << " more than 1 ms behind schedule)\n"
+              << "delivered=" << summary.delivered << " of " << summary.expected << " expected ("
+              << summary.delivery_rate << "/s)\n"
+              << "latency_us p50=" << micros(summary.latency.percentile(0.5))
+              << " p90=" << micros(summary.latency.percentile(0.9))
+              << " p99=" << micros(summary.latency.percentile(0.99))
+              << " p99.9=" << micros(summary.latency.percentile(0.999))
+              << " max=" << micros(summary.latency.maximum())
+              << " (" << summary.latency.count() << " samples after " << config.warmup << " s warmup)\n"
+              << std::setprecision(3) << "server send_calls=" << summary.send_calls << " ("
+              << summary.send_calls_per_message << " per delivered message)" << std::endl;
+    if (!config.csv_file.empty()) write_csv(summary);
+    if (!config.json_file.empty()) write_json(summary);
 
+    std::cout << "Server load:" << std::endl;
+    for (const std::string& line : stats_after) {
+        std::cout << "  " << line << std::endl;
+    }
     std::cout << "Stress test completed." << std::endl;
     return 0;
 }
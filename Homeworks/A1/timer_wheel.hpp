@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Hierarchical timing wheel (Varghese and Lauck) for the timeouts of one
+// event loop. Level 0 has a slot per tick; every higher level has a slot per
+// SLOTS ticks of the level below, so four levels of 256 slots span 2^32
+// ticks. A timer is linked into the slot of the level its delay falls in,
+// and when a level's slot comes up its timers are cascaded into lower levels
+// as they get close to expiring. Timers are intrusive list nodes, typically
+// members of the connection they time, so scheduling and cancelling are a
+// few pointer writes with no allocation or search at any timer count, and a
+// timer destroyed while armed unlinks itself.
+//
+// Time is counted in ticks; the caller decides what a tick is and calls
+// advance() with the current tick. Not thread-safe: one loop owns a wheel.
+
+class TimerWheel {
+public:
+    static constexpr unsigned SLOT_BITS = 8;
+    static constexpr size_t SLOTS = size_t{1} << SLOT_BITS;
+    static constexpr unsigned LEVELS = 4;
+    static constexpr uint64_t MAX_DELAY = (uint64_t{1} << (SLOT_BITS * LEVELS)) - 1;
+
+    class Timer {
+    public:
+        Timer() = default;
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() {
+            if (armed()) owner->cancel(*this);
+        }
+
+        bool armed() const { return prev != nullptr; }
+        uint64_t expiry() const { return expires; }
+
+        uintptr_t data = 0;  // Identifies the owner to the expiry callback
+
+    private:
+        friend class TimerWheel;
+
+        void unlink() {
+            if (!prev) return;
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+        }
+
+        // Inserts before node, i.e. at the tail of the list that node heads
+        void link_before(Timer& node) {
+            prev = node.prev;
+            next = &node;
+            node.prev->next = this;
+            node.prev = this;
+        }
+
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        TimerWheel* owner = nullptr;
+        uint64_t expires = 0;
+    };
+
+    explicit TimerWheel(uint64_t start_tick = 0) : current(start_tick) {
+        for (auto& level : slots) {
+            for (Timer& head : level) head.prev = head.next = &head;
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Timers still armed are detached, so destroying them later is safe
+    ~TimerWheel() {
+        for (auto& level : slots) {
+            for (Timer& head : level) {
+                while (head.next != &head) head.next->unlink();
+                head.prev = head.next = nullptr;
+            }
+        }
+    }
+
+    // (Re)arms timer to expire delay ticks from now (at least one tick)
+    void schedule(Timer& timer, uint64_t delay) {
+        cancel(timer);
+        if (delay == 0) delay = 1;
+        if (delay > MAX_DELAY) delay = MAX_DELAY;
+        timer.owner = this;
+        timer.expires = current + delay;
+        place(timer);
+        count++;
+    }
+
+    void cancel(Timer& timer) {
+        if (timer.armed()) {
+            timer.unlink();
+            count--;
+        }
+    }
+
+    uint64_t now() const { return current; }
+    size_t size() const { return count; }
+
+    // Runs every tick up to now, calling on_expired(timer) for each timer
+    // that expires, already disarmed. The callback may schedule, cancel or
+    // destroy any timer, including the one it was called with.
+    template <typename OnExpired>
+    void advance(uint64_t now, OnExpired&& on_expired) {
+        if (count == 0 && now > current) {
+            current = now;
+            return;
+        }
+        while (current < now) {
+            current++;
+            // Cascade the highest level due first, so its timers can drop
+            // into the lower slots cascaded right after at the same tick
+            unsigned top = 0;
+            while (top + 1 < LEVELS && (current & ((uint64_t{1} << (SLOT_BITS * (top + 1))) - 1)) == 0) top++;
+            for (unsigned level = top; level >= 1; level--) cascade(level);
+
+            Timer& head = slots[0][current & (SLOTS - 1)];
+            Timer due;
+            if (head.next == &head) continue;
+            // Detach the slot into a local list first, so timers the
+            // callback reschedules into this same slot wait a full turn
+            due.prev = head.prev;
+            due.next = head.next;
+            head.prev->next = &due;
+            head.next->prev = &due;
+            head.prev = head.next = &head;
+            while (due.next != &due) {
+                Timer& timer = *due.next;
+                timer.unlink();
+                count--;
+                on_expired(timer);
+            }
+            due.prev = nullptr;  // Empty; skip the destructor's unlink
+        }
+    }
+
+private:
+    void place(Timer& timer) {
+        uint64_t delta = timer.expires > current ? timer.expires - current : 0;
+        unsigned level = 0;
+        while (level + 1 < LEVELS && delta >= (uint64_t{1} << (SLOT_BITS * (level + 1)))) level++;
+        size_t slot = (timer.expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+        timer.link_before(slots[level][slot]);
+    }
+
+    // Moves the timers of this level's current slot into lower levels
+    void cascade(unsigned level) {
+        Timer& head = slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        while (head.next != &head) {
+            Timer& timer = *head.next;
+            timer.unlink();
+            place(timer);
+        }
+    }
+
+    Timer slots[LEVELS][SLOTS];
+    uint64_t current;
+    size_t count = 0;
+};
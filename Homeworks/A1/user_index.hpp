@@ -0,0 +1,467 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Compiled credential index: the user directory converted offline
+// (build_user_index) into a file the server maps read-only. Nothing is parsed
+// or copied at startup, so opening it costs the same for a hundred users or
+// ten million, and pages are only read as logins touch them.
+//
+// Usernames are placed with a minimal-probe perfect hash (hash and displace):
+// a key's bucket names a seed, and the seed picks the one slot that can hold
+// the key, so a lookup reads one seed, one 64-byte record and the name bytes.
+// Passwords are stored as PBKDF2-HMAC-SHA256 with a random per-user salt.
+//
+// Layout, in host byte order (build on the architecture that serves it):
+//   Header | uint32 seeds[bucket_count] | Record slots[slot_count] | names
+// Records start on a 64-byte boundary; an empty slot has name_offset EMPTY.
+
+namespace user_index {
+
+// --- SHA-256 (FIPS 180-4), HMAC (RFC 2104) and PBKDF2 (RFC 8018) ---
+
+class Sha256 {
+public:
+    static constexpr size_t DIGEST_BYTES = 32;
+    static constexpr size_t BLOCK_BYTES = 64;
+    using Digest = std::array<uint8_t, DIGEST_BYTES>;
+
+    void update(const void* data, size_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        total += length;
+        while (length > 0) {
+            size_t take = std::min(length, BLOCK_BYTES - buffered);
+            memcpy(buffer + buffered, bytes, take);
+            buffered += take;
+            bytes += take;
+            length -= take;
+            if (buffered == BLOCK_BYTES) {
+                compress(buffer);
+                buffered = 0;
+            }
+        }
+    }
+
+    Digest finish() {
+        uint64_t bits = total * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (buffered != BLOCK_BYTES - 8) update(&pad, 1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        update(length, 8);
+        Digest digest;
+        for (size_t i = 0; i < 8; i++) {
+            for (size_t j = 0; j < 4; j++) digest[4 * i + j] = static_cast<uint8_t>(state[i] >> (24 - 8 * j));
+        }
+        return digest;
+    }
+
+private:
+    static uint32_t rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* block) {
+        static constexpr uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = uint32_t{block[4 * i]} << 24 | uint32_t{block[4 * i + 1]} << 16 |
+                   uint32_t{block[4 * i + 2]} << 8 | uint32_t{block[4 * i + 3]};
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t buffer[BLOCK_BYTES];
+    size_t buffered = 0;
+    uint64_t total = 0;
+};
+
+// HMAC-SHA256 with the keyed inner and outer states computed once, so each
+// PBKDF2 round costs two compressions instead of four
+class HmacSha256 {
+public:
+    explicit HmacSha256(std::string_view key) {
+        uint8_t block[Sha256::BLOCK_BYTES] = {};
+        if (key.size() > Sha256::BLOCK_BYTES) {
+            Sha256 hashed;
+            hashed.update(key.data(), key.size());
+            Sha256::Digest digest = hashed.finish();
+            memcpy(block, digest.data(), digest.size());
+        } else {
+            memcpy(block, key.data(), key.size());
+        }
+        uint8_t pad[Sha256::BLOCK_BYTES];
+        for (size_t i = 0; i < sizeof(pad); i++) pad[i] = block[i] ^ 0x36;
+        inner.update(pad, sizeof(pad));
+        for (size_t i = 0; i < sizeof(pad); i++) pad[i] = block[i] ^ 0x5c;
+        outer.update(pad, sizeof(pad));
+    }
+
+    Sha256::Digest mac(const void* first, size_t first_length, const void* second = nullptr,
+                       size_t second_length = 0) const {
+        Sha256 hash = inner;
+        hash.update(first, first_length);
+        if (second_length > 0) hash.update(second, second_length);
+        Sha256::Digest inner_digest = hash.finish();
+        hash = outer;
+        hash.update(inner_digest.data(), inner_digest.size());
+        return hash.finish();
+    }
+
+private:
+    Sha256 inner;
+    Sha256 outer;
+};
+
+// One 32-byte PBKDF2-HMAC-SHA256 block
+inline Sha256::Digest pbkdf2(std::string_view password, const uint8_t* salt, size_t salt_length,
+                             uint32_t iterations) {
+    HmacSha256 hmac(password);
+    const uint8_t block_index[4] = {0, 0, 0, 1};
+    Sha256::Digest u = hmac.mac(salt, salt_length, block_index, sizeof(block_index));
+    Sha256::Digest result = u;
+    for (uint32_t i = 1; i < iterations; i++) {
+        u = hmac.mac(u.data(), u.size());
+        for (size_t j = 0; j < result.size(); j++) result[j] ^= u[j];
+    }
+    return result;
+}
+
+// --- File format ---
+
+constexpr char MAGIC[8] = {'C', 'H', 'A', 'T', 'U', 'I', 'X', '1'};
+constexpr uint32_t VERSION = 1;
+constexpr size_t SALT_BYTES = 16;
+constexpr uint32_t DEFAULT_ITERATIONS = 1000;
+constexpr uint64_t EMPTY = UINT64_MAX;
+constexpr size_t KEYS_PER_BUCKET = 3;  // Average bucket size when placing keys
+constexpr uint32_t MAX_SEED = 1u << 24;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t iterations;    // PBKDF2 rounds for every record
+    uint64_t count;         // Users in the index
+    uint64_t bucket_count;  // Entries in seeds
+    uint64_t slot_count;    // Entries in slots; count / slot_count is about 0.8
+    uint64_t seeds_offset;
+    uint64_t slots_offset;
+    uint64_t names_offset;
+    uint64_t names_bytes;
+};
+
+struct Record {
+    uint64_t name_offset;  // From names_offset; EMPTY for an unused slot
+    uint32_t name_length;
+    uint32_t reserved;
+    uint8_t salt[SALT_BYTES];
+    uint8_t hash[Sha256::DIGEST_BYTES];
+};
+static_assert(sizeof(Record) == 64);  // Slots start on a cache line, so a record never straddles two
+constexpr size_t RECORD_ALIGN = 64;
+
+inline uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t key_hash(std::string_view name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (char c : name) hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+    return mix(hash);
+}
+
+inline uint64_t bucket_of(uint64_t hash, uint64_t bucket_count) { return hash % bucket_count; }
+
+inline uint64_t slot_of(uint64_t hash, uint32_t seed, uint64_t slot_count) {
+    uint64_t h1 = mix(hash ^ 0x9e3779b97f4a7c15ULL);
+    uint64_t h2 = mix(hash ^ 0xc2b2ae3d27d4eb4fULL) | 1;
+    return (h1 + seed * h2) % slot_count;
+}
+
+inline bool constant_time_equal(const uint8_t* a, const uint8_t* b, size_t length) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; i++) difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+inline size_t align_up(size_t value, size_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+// --- Building ---
+
+// Serializes users (later duplicates of a name win, as in the text loader)
+// into an index image. Password hashing is spread over threads; false with
+// error set if the keys cannot be placed.
+inline bool build(std::vector<std::pair<std::string, std::string>> users, uint32_t iterations,
+                  std::vector<char>& image, std::string& error, unsigned threads = 0) {
+    // Keep the last entry for every name
+    std::vector<size_t> order(users.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return users[a].first < users[b].first; });
+    std::vector<std::pair<std::string, std::string>> unique;
+    unique.reserve(users.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i + 1 < order.size() && users[order[i]].first == users[order[i + 1]].first) continue;
+        unique.push_back(std::move(users[order[i]]));
+    }
+    users.clear();
+
+    uint64_t count = unique.size();
+    uint64_t bucket_count = count / KEYS_PER_BUCKET + 1;
+    uint64_t slot_count = count + count / 4 + 1;
+    std::vector<uint64_t> hashes(count);
+    for (size_t i = 0; i < count; i++) hashes[i] = key_hash(unique[i].first);
+
+    // Hash and displace: largest buckets first, each gets the first seed
+    // that sends all its keys to distinct free slots
+    std::vector<std::vector<uint32_t>> buckets(bucket_count);
+    for (size_t i = 0; i < count; i++) buckets[bucket_of(hashes[i], bucket_count)].push_back(static_cast<uint32_t>(i));
+    std::vector<uint32_t> bucket_order(bucket_count);
+    for (size_t i = 0; i < bucket_count; i++) bucket_order[i] = static_cast<uint32_t>(i);
+    std::stable_sort(bucket_order.begin(), bucket_order.end(),
+                     [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+    std::vector<uint32_t> seeds(bucket_count, 0);
+    std::vector<int64_t> slot_key(slot_count, -1);
+    std::vector<uint64_t> candidate;
+    for (uint32_t bucket : bucket_order) {
+        const std::vector<uint32_t>& keys = buckets[bucket];
+        if (keys.empty()) break;
+        uint32_t seed = 0;
+        for (; seed < MAX_SEED; seed++) {
+            candidate.clear();
+            bool placed = true;
+            for (uint32_t key : keys) {
+                uint64_t slot = slot_of(hashes[key], seed, slot_count);
+                if (slot_key[slot] >= 0 || std::find(candidate.begin(), candidate.end(), slot) != candidate.end()) {
+                    placed = false;
+                    break;
+                }
+                candidate.push_back(slot);
+            }
+            if (placed) break;
+        }
+        if (seed == MAX_SEED) {
+            error = "could not place the users of one hash bucket";
+            return false;
+        }
+        seeds[bucket] = seed;
+        for (size_t i = 0; i < keys.size(); i++) slot_key[candidate[i]] = keys[i];
+    }
+
+    Header header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.iterations = std::max(1u, iterations);
+    header.count = count;
+    header.bucket_count = bucket_count;
+    header.slot_count = slot_count;
+    header.seeds_offset = sizeof(Header);
+    header.slots_offset = align_up(header.seeds_offset + bucket_count * sizeof(uint32_t), RECORD_ALIGN);
+    header.names_offset = header.slots_offset + slot_count * sizeof(Record);
+    for (const auto& [name, _] : unique) header.names_bytes += name.size();
+
+    image.assign(header.names_offset + header.names_bytes, 0);
+    memcpy(image.data(), &header, sizeof(header));
+    memcpy(image.data() + header.seeds_offset, seeds.data(), bucket_count * sizeof(uint32_t));
+    Record* slots = reinterpret_cast<Record*>(image.data() + header.slots_offset);
+    char* names = image.data() + header.names_offset;
+    std::vector<uint64_t> name_offsets(count);
+    uint64_t next_name = 0;
+    for (size_t i = 0; i < count; i++) {
+        name_offsets[i] = next_name;
+        memcpy(names + next_name, unique[i].first.data(), unique[i].first.size());
+        next_name += unique[i].first.size();
+    }
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    std::atomic<bool> salted{true};  // Cleared by any worker; read after the joins
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            for (uint64_t slot = t; slot < slot_count; slot += threads) {
+                Record& record = slots[slot];
+                if (slot_key[slot] < 0) {
+                    record.name_offset = EMPTY;
+                    continue;
+                }
+                const auto& [name, password] = unique[slot_key[slot]];
+                record.name_offset = name_offsets[slot_key[slot]];
+                record.name_length = static_cast<uint32_t>(name.size());
+                if (getrandom(record.salt, SALT_BYTES, 0) != static_cast<ssize_t>(SALT_BYTES)) {
+                    salted.store(false, std::memory_order_relaxed);
+                }
+                Sha256::Digest hash = pbkdf2(password, record.salt, SALT_BYTES, header.iterations);
+                memcpy(record.hash, hash.data(), hash.size());
+            }
+        });
+    }
+    for (std::thread& worker : workers) worker.join();
+    if (!salted.load(std::memory_order_relaxed)) {
+        error = "could not read random salt";
+        return false;
+    }
+    return true;
+}
+
+// --- Reading ---
+
+// True if the file starts with the index magic (otherwise it is a text user file)
+inline bool is_index_file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char magic[sizeof(MAGIC)];
+    bool match = pread(fd, magic, sizeof(magic), 0) == static_cast<ssize_t>(sizeof(magic)) &&
+                 memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    ::close(fd);
+    return match;
+}
+
+// A read-only mapping of an index file. The mapping stays valid if the file
+// is replaced by rename while it is open (the old inode lives until unmapped).
+class Index {
+public:
+    Index() = default;
+    Index(const Index&) = delete;
+    Index& operator=(const Index&) = delete;
+    Index(Index&& other) noexcept { swap(other); }
+    Index& operator=(Index&& other) noexcept {
+        Index moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+    ~Index() {
+        if (base) munmap(const_cast<char*>(base), length);
+    }
+
+    // Maps and validates an index; false with error set if it is not one or is damaged
+    bool open(const std::string& path, std::string& error) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = "cannot open " + path;
+            return false;
+        }
+        struct stat info{};
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(Header)) {
+            mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            error = "cannot map " + path;
+            return false;
+        }
+        Index index;
+        index.base = static_cast<const char*>(mapped);
+        index.length = info.st_size;
+        if (!index.valid()) {
+            error = path + " is not a valid user index";
+            return false;
+        }
+        madvise(mapped, info.st_size, MADV_RANDOM);  // Logins touch scattered pages; skip readahead
+        swap(index);
+        return true;
+    }
+
+    size_t size() const { return base ? header().count : 0; }
+
+    // Whether name is a user, without hashing a password
+    bool contains(std::string_view name) const { return base && find(name); }
+
+    // Runs the full password hash even for unknown users so that the
+    // response time does not reveal which names exist
+    bool verify(std::string_view name, std::string_view password) const {
+        static constexpr uint8_t UNKNOWN_SALT[SALT_BYTES] = {};
+        if (!base) return false;
+        const Record* record = find(name);
+        Sha256::Digest hash = pbkdf2(password, record ? record->salt : UNKNOWN_SALT, SALT_BYTES, header().iterations);
+        return record && constant_time_equal(hash.data(), record->hash, hash.size());
+    }
+
+private:
+    const Header& header() const { return *reinterpret_cast<const Header*>(base); }
+
+    const Record* find(std::string_view name) const {
+        const Header& h = header();
+        uint64_t hash = key_hash(name);
+        const uint32_t* seeds = reinterpret_cast<const uint32_t*>(base + h.seeds_offset);
+        uint64_t slot = slot_of(hash, seeds[bucket_of(hash, h.bucket_count)], h.slot_count);
+        const Record* record = reinterpret_cast<const Record*>(base + h.slots_offset) + slot;
+        if (record->name_offset == EMPTY || record->name_length != name.size() ||
+            record->name_offset > h.names_bytes || h.names_bytes - record->name_offset < name.size()) {
+            return nullptr;
+        }
+        return memcmp(base + h.names_offset + record->name_offset, name.data(), name.size()) == 0 ? record : nullptr;
+    }
+
+    bool valid() const {
+        const Header& h = header();
+        if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION || h.iterations == 0 ||
+            h.bucket_count == 0 || h.slot_count == 0 || h.count > h.slot_count) {
+            return false;
+        }
+        uint64_t seeds_end = h.seeds_offset + h.bucket_count * sizeof(uint32_t);
+        uint64_t slots_end = h.slots_offset + h.slot_count * sizeof(Record);
+        return h.seeds_offset >= sizeof(Header) && h.seeds_offset % alignof(uint32_t) == 0 &&
+               h.bucket_count < length / sizeof(uint32_t) && h.slot_count < length / sizeof(Record) &&
+               seeds_end <= h.slots_offset && h.slots_offset % RECORD_ALIGN == 0 && slots_end <= h.names_offset &&
+               h.names_offset <= length && h.names_bytes <= length - h.names_offset;
+    }
+
+    void swap(Index& other) {
+        std::swap(base, other.base);
+        std::swap(length, other.length);
+    }
+
+    const char* base = nullptr;
+    size_t length = 0;
+};
+
+}  // namespace user_index